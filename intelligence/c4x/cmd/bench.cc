@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "game.h"
+#include "mcts.h"
+#include "nn.h"
+#include "pool.h"
+#include "prof.h"
+#include "tensor.h"
+
+using namespace hermes;
+
+/* === --- Configurations and Macros ------------------------------------ === */
+
+#define BIN_DATA_FILE ".build/tensor_data.bin" /* Tensor data dump file */
+
+/* Each case runs max(BENCH_MIN_ITERS, BENCH_ITERS / batch) timed iterations,
+ * after 1/10 of that (at least 2) warmup iterations. The counts are fixed, so
+ * runs are comparable.
+ */
+#ifndef BENCH_ITERS
+#define BENCH_ITERS 200
+#endif
+#define BENCH_MIN_ITERS 10
+
+#define BENCH_FORWARD_MAXB 256 /* Max batch of the forward cases. */
+
+/* Each MCTS case runs BENCH_MCTS_RUNS searches of BENCH_MCTS_SIMULATIONS from
+ * the empty board, without the eval cache, and keeps the median.
+ */
+#ifndef BENCH_MCTS_SIMULATIONS
+#define BENCH_MCTS_SIMULATIONS 400
+#endif
+#define BENCH_MCTS_RUNS 3
+
+/* === --- Timing ------------------------------------------------------- === */
+
+/* One benchmark case: run calls fn once on ctx. */
+typedef struct {
+        const char *name;
+        u32         batch;
+        u64         flops; /* Per run. */
+        void ( *run )( void *ctx );
+        void *ctx;
+} BenchCase;
+
+int
+cmp_u64( const void *a, const void *b )
+{
+        u64 x = *(const u64 *)a;
+        u64 y = *(const u64 *)b;
+        return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Time the case and print one row: median and p99 latency, and GFLOP/s at the
+ * median.
+ */
+void
+bench_run( BenchCase *c )
+{
+        static u64 samples[BENCH_ITERS];
+
+        u32 iters  = BENCH_ITERS / c->batch;
+        if ( iters < BENCH_MIN_ITERS ) iters = BENCH_MIN_ITERS;
+        if ( iters > BENCH_ITERS ) iters = BENCH_ITERS;
+        u32 warmup = iters / 10 < 2 ? 2 : iters / 10;
+
+        for ( u32 i = 0; i < warmup; i++ ) c->run( c->ctx );
+        for ( u32 i = 0; i < iters; i++ ) {
+                u64 t0 = prof_now( );
+                c->run( c->ctx );
+                samples[i] = prof_now( ) - t0;
+        }
+        qsort( samples, iters, sizeof( u64 ), cmp_u64 );
+
+        u64 median = samples[iters / 2];
+        u64 p99    = samples[( iters * 99 + 99 ) / 100 - 1];
+        printf( "%-32s %5u %6u %11.2f %11.2f %9.2f\n", c->name, c->batch,
+                iters, (double)median / 1e3, (double)p99 / 1e3,
+                (double)c->flops / (double)median );
+}
+
+void
+bench_header( const char *title )
+{
+        printf( "\n=== %s\n", title );
+        printf( "%-32s %5s %6s %11s %11s %9s\n", "case", "batch", "iters",
+                "median us", "p99 us", "GFLOP/s" );
+}
+
+#ifdef __linux__
+cpu_set_t bench_cpus;       /* Affinity before bench_pin_cpu. */
+int       bench_pinned = 0; /* Non-zero if bench_pin_cpu pinned. */
+#endif
+
+/* Pin the calling thread to the CPU it runs on, to avoid migrations. Skipped
+ * with a thread pool, as the workers inherit the affinity.
+ */
+void
+bench_pin_cpu( void )
+{
+#ifdef __linux__
+        if ( pool_thread_cnt( ) > 1 ) return;
+        int cpu = sched_getcpu( );
+        if ( cpu < 0 ) return;
+        if ( sched_getaffinity( 0, sizeof( bench_cpus ), &bench_cpus ) != 0 )
+                return;
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        if ( sched_setaffinity( 0, sizeof( set ), &set ) == 0 ) {
+                bench_pinned = 1;
+                printf( "pinned to cpu %d\n", cpu );
+        }
+#endif
+}
+
+/* Undo bench_pin_cpu, e.g., before starting threads. */
+void
+bench_unpin_cpu( void )
+{
+#ifdef __linux__
+        if ( !bench_pinned ) return;
+        sched_setaffinity( 0, sizeof( bench_cpus ), &bench_cpus );
+        bench_pinned = 0;
+#endif
+}
+
+/* === --- Kernels ------------------------------------------------------ === */
+
+void
+random_tensor( Tensor **dst, u32 dim, u32 *shape, f32 lo, f32 hi )
+{
+        alloc_tensor( dst, dim, shape );
+        for ( u32 i = 0; i < ( *dst )->ele_total; i++ ) {
+                ( *dst )->data[i] =
+                    lo + ( hi - lo ) * (f32)rand( ) / (f32)RAND_MAX;
+        }
+}
+
+typedef enum { CONV_NAIVE, CONV_BLAS, CONV_DIRECT, CONV_INT8 } ConvKind;
+
+/* A conv2d on a model shape with its own (packed) weight. */
+typedef struct {
+        ConvKind kind;
+        Tensor  *input;
+        Tensor  *weight;
+        Tensor  *bias;
+        QConv   *q;
+        Tensor  *output;
+        Tensor  *scratch;
+} ConvCtx;
+
+void
+conv_run( void *ctx )
+{
+        ConvCtx *c = (ConvCtx *)ctx;
+        switch ( c->kind ) {
+        case CONV_NAIVE:
+                conv2d_naive( &c->output, c->input, c->weight, c->bias,
+                              c->scratch, NULL );
+                break;
+        case CONV_BLAS:
+                conv2d_blas( &c->output, c->input, c->weight, c->bias,
+                             c->scratch, NULL );
+                break;
+        case CONV_DIRECT:
+                conv2d_direct( &c->output, c->input, c->weight, c->bias,
+                               c->scratch, NULL );
+                break;
+        case CONV_INT8:
+                conv2d_int8( &c->output, c->input, c->q, c->bias,
+                             c->scratch, NULL );
+                break;
+        }
+}
+
+/* Bench all conv2d kernels on (batch, c_in, ROWS, COLS) x (c_out, c_in, k,
+ * k).
+ */
+void
+bench_conv2d( const char *shape_name, u32 batch, u32 c_in, u32 c_out, u32 k )
+{
+        static const char *kind_names[] = { "naive", "blas", "direct",
+                                            "int8" };
+
+        u32 hw             = ROWS * COLS;
+        u32 input_shape[]  = { batch, c_in, ROWS, COLS };
+        u32 weight_shape[] = { c_out, c_in, k, k };
+        u32 bias_shape[]   = { c_out };
+        u32 output_shape[] = { batch, c_out, ROWS, COLS };
+
+        /* Large enough for any kernel, see their NOTE on scratch. */
+        u32 scratch_shape[] = { batch * hw * ( c_in * k * k + c_out ) +
+                                batch * c_in * ( ROWS + k ) * ( COLS + k ) +
+                                POOL_MAX_THREADS * CONV2D_DIRECT_BLOCK * hw +
+                                batch };
+
+        Tensor *input, *weight, *bias, *output, *scratch;
+        /* Non-negative as relu output, which conv2d_int8 requires. */
+        random_tensor( &input, 4, input_shape, 0.f, 1.f );
+        random_tensor( &weight, 4, weight_shape, -0.5f, 0.5f );
+        random_tensor( &bias, 1, bias_shape, -0.5f, 0.5f );
+        alloc_tensor( &output, 4, output_shape );
+        alloc_tensor( &scratch, 1, scratch_shape );
+
+        for ( int kind = CONV_NAIVE; kind <= CONV_INT8; kind++ ) {
+                ConvCtx ctx = { (ConvKind)kind, input, NULL, bias,
+                                NULL,           output, scratch };
+                Tensor *w   = NULL;
+                if ( kind == CONV_INT8 ) {
+                        if ( !qconv_quantizable( weight ) ) continue;
+                        ctx.q = qconv_quantize( weight );
+                } else {
+                        dup_tensor( &w, weight, /*copy_data=*/1 );
+                        if ( kind == CONV_BLAS ) conv2d_blas_pack_weight( w );
+                        if ( kind == CONV_DIRECT &&
+                             conv2d_direct_packable( w ) )
+                                conv2d_direct_pack_weight( w );
+                        ctx.weight = w;
+                }
+
+                char name[64];
+                snprintf( name, sizeof( name ), "conv2d_%s %s",
+                          kind_names[kind], shape_name );
+                u64       flops = prof_conv2d_flops( output, weight );
+                BenchCase c     = { name, batch, flops, conv_run, &ctx };
+                bench_run( &c );
+
+                free_tensor( w );
+                qconv_free( ctx.q );
+        }
+
+        free_tensor( input );
+        free_tensor( weight );
+        free_tensor( bias );
+        free_tensor( output );
+        free_tensor( scratch );
+}
+
+typedef struct {
+        Tensor *input, *weight, *bias, *mean, *var, *output;
+} LayerCtx;
+
+void
+batchnorm2d_run( void *ctx )
+{
+        LayerCtx *c = (LayerCtx *)ctx;
+        batchnorm2d( &c->output, c->input, c->weight, c->bias, c->mean,
+                     c->var );
+}
+
+void
+bench_batchnorm2d( u32 batch )
+{
+        u32 input_shape[] = { batch, 128, ROWS, COLS };
+        u32 param_shape[] = { 128 };
+
+        LayerCtx c = { };
+        random_tensor( &c.input, 4, input_shape, -1.f, 1.f );
+        random_tensor( &c.weight, 1, param_shape, 0.5f, 1.5f );
+        random_tensor( &c.bias, 1, param_shape, -0.5f, 0.5f );
+        random_tensor( &c.mean, 1, param_shape, -0.5f, 0.5f );
+        random_tensor( &c.var, 1, param_shape, 0.5f, 1.5f );
+        alloc_tensor( &c.output, 4, input_shape );
+
+        BenchCase bc = { "batchnorm2d 128x6x7", batch,
+                         2 * (u64)c.output->ele_total, batchnorm2d_run, &c };
+        bench_run( &bc );
+
+        free_tensor( c.input );
+        free_tensor( c.weight );
+        free_tensor( c.bias );
+        free_tensor( c.mean );
+        free_tensor( c.var );
+        free_tensor( c.output );
+}
+
+void
+linear_run( void *ctx )
+{
+        LayerCtx *c = (LayerCtx *)ctx;
+        linear( &c->output, c->input, c->weight, c->bias );
+}
+
+void
+bench_linear( const char *shape_name, u32 batch, u32 in_dim, u32 out_dim )
+{
+        u32 input_shape[]  = { batch, in_dim };
+        u32 weight_shape[] = { out_dim, in_dim };
+        u32 bias_shape[]   = { out_dim };
+        u32 output_shape[] = { batch, out_dim };
+
+        LayerCtx c = { };
+        random_tensor( &c.input, 2, input_shape, -1.f, 1.f );
+        random_tensor( &c.weight, 2, weight_shape, -0.5f, 0.5f );
+        random_tensor( &c.bias, 1, bias_shape, -0.5f, 0.5f );
+        alloc_tensor( &c.output, 2, output_shape );
+
+        char name[64];
+        snprintf( name, sizeof( name ), "linear %s", shape_name );
+        BenchCase bc = { name, batch, prof_linear_flops( c.output, c.weight ),
+                         linear_run, &c };
+        bench_run( &bc );
+
+        free_tensor( c.input );
+        free_tensor( c.weight );
+        free_tensor( c.bias );
+        free_tensor( c.output );
+}
+
+/* === --- Model -------------------------------------------------------- === */
+
+typedef struct {
+        NN     *nn;
+        Tensor *input;
+} ForwardCtx;
+
+void
+forward_run( void *ctx )
+{
+        ForwardCtx *c = (ForwardCtx *)ctx;
+        Tensor     *policy;
+        Tensor     *value;
+        nn_forward_batch( c->nn, c->input, &policy, &value );
+}
+
+/* A head of the layer graph, see nn_new. */
+typedef struct {
+        NN            *nn;
+        Tensor        *input;
+        const NNLayer *layer;
+} HeadCtx;
+
+/* The heads run on the trunk output left in the plan by forward_run. */
+void
+head_run( void *ctx )
+{
+        HeadCtx *c = (HeadCtx *)ctx;
+        nn_run_ops( c->nn, c->input, c->layer->op_begin, c->layer->op_end );
+}
+
+/* Forward from the stem accumulator of the input, see nn_forward_stem. */
+typedef struct {
+        NN     *nn;
+        Tensor *acc;
+} StemCtx;
+
+void
+stem_run( void *ctx )
+{
+        StemCtx *c = (StemCtx *)ctx;
+        Tensor  *policy;
+        Tensor  *value;
+        nn_forward_stem( c->nn, c->acc, &policy, &value );
+}
+
+/* FLOPs of conv2d and linear layers of weights [begin, end). */
+u64
+range_flops( NN *nn, u32 batch, u32 begin, u32 end )
+{
+        u64 flops = 0;
+        for ( u32 i = begin; i < end; i++ ) {
+                Tensor *w = &nn->weights[i];
+                if ( w->dim == 4 )
+                        flops += 2 * (u64)batch * ROWS * COLS * w->ele_total;
+                if ( w->dim == 2 ) flops += 2 * (u64)batch * w->ele_total;
+        }
+        return flops;
+}
+
+void
+bench_model( NN *nn )
+{
+        bench_header( "heads and nn_forward_batch" );
+        for ( u32 batch = 1; batch <= BENCH_FORWARD_MAXB; batch *= 2 ) {
+                u32 shape[] = { batch, 3, ROWS, COLS };
+
+                ForwardCtx ctx = { nn, NULL };
+                /* Board like input: 0 or 1. */
+                random_tensor( &ctx.input, 4, shape, 0.f, 1.f );
+                for ( u32 i = 0; i < ctx.input->ele_total; i++ ) {
+                        ctx.input->data[i] =
+                            ctx.input->data[i] < 0.5f ? 0.f : 1.f;
+                }
+                /* Plan the batch and fill the trunk output for the heads. */
+                forward_run( &ctx );
+
+                for ( u32 i = 0; batch == 1 && i < nn->layer_cnt; i++ ) {
+                        const NNLayer *l = &nn->layers[i];
+                        if ( l->kind != NN_LAYER_POLICY_HEAD &&
+                             l->kind != NN_LAYER_VALUE_HEAD )
+                                continue;
+                        HeadCtx   lc = { nn, ctx.input, l };
+                        BenchCase h  = {
+                            l->kind == NN_LAYER_POLICY_HEAD ? "policy_head"
+                                                            : "value_head",
+                            batch,
+                            range_flops( nn, batch, l->weight,
+                                         l->weight + l->weight_cnt ),
+                            head_run, &lc };
+                        bench_run( &h );
+                }
+
+                if ( batch == 1 && nn_stem_incremental( nn ) ) {
+                        StemCtx sc = { nn, NULL };
+                        nn_stem_new( nn, &sc.acc, ctx.input );
+                        BenchCase s = { "nn_forward_stem", batch,
+                                        range_flops( nn, batch,
+                                                     nn->layers[0].weight_cnt,
+                                                     nn->weight_cnt ),
+                                        stem_run, &sc };
+                        bench_run( &s );
+                        free_tensor( sc.acc );
+                }
+
+                BenchCase c = { "nn_forward_batch", batch,
+                                range_flops( nn, batch, 0, nn->weight_cnt ),
+                                forward_run,
+                                &ctx };
+                bench_run( &c );
+                free_tensor( ctx.input );
+        }
+}
+
+/* === --- MCTS --------------------------------------------------------- === */
+
+/* Scaling of the tree parallel search with batched leaves: playouts
+ * (simulations) per second and the speedup over one thread and batch of 1,
+ * and the memory of the tree searched (see mcts_tree_stats).
+ */
+void
+bench_mcts( NN *nn )
+{
+        static const u32 cases[][2] = {
+            /* threads, batch */
+            { 1, 1 },  { 2, 1 }, { 4, 1 }, { 8, 1 }, { 1, 4 },
+            { 1, 16 }, { 1, 32 }, { 4, 8 },
+        };
+
+        /* The search threads would inherit the pinned CPU. */
+        bench_unpin_cpu( );
+
+        printf( "\n=== mcts_search, %d simulations from the empty board, "
+                "threads started\n",
+                BENCH_MCTS_SIMULATIONS );
+        printf( "%-32s %7s %5s %11s %11s %9s %8s\n", "case", "threads",
+                "batch", "median ms", "playouts/s", "speedup", "tree MB" );
+        double base = 0.0;
+        for ( size_t c = 0; c < sizeof( cases ) / sizeof( cases[0] ); c++ ) {
+                mcts_set_thread_cnt( cases[c][0] );
+                mcts_set_batch_size( cases[c][1] );
+                u64           samples[BENCH_MCTS_RUNS];
+                MCTSTreeStats tree;
+                /* Run 0 is a warm-up, not timed. */
+                for ( u32 i = 0; i <= BENCH_MCTS_RUNS; i++ ) {
+                        MCTSNode *root = mcts_node_new( game_new( ), nn, NULL );
+                        /* Start the search threads and NN forks first. */
+                        mcts_search( root, 0, /*stop=*/NULL, /*report=*/0 );
+                        u64 t0 = prof_now( );
+                        mcts_search( root, BENCH_MCTS_SIMULATIONS,
+                                     /*stop=*/NULL, /*report=*/0 );
+                        if ( i > 0 ) samples[i - 1] = prof_now( ) - t0;
+                        tree = mcts_tree_stats( root );
+                        mcts_node_free( root );
+                }
+                qsort( samples, BENCH_MCTS_RUNS, sizeof( u64 ), cmp_u64 );
+
+                u64    median = samples[BENCH_MCTS_RUNS / 2];
+                double rate   = BENCH_MCTS_SIMULATIONS * 1e9 / (double)median;
+                if ( c == 0 ) base = rate;
+                printf( "%-32s %7u %5u %11.2f %11.1f %8.2fx %8.1f\n",
+                        "mcts_search", cases[c][0], cases[c][1],
+                        (double)median / 1e6, rate, rate / base,
+                        (double)tree.bytes / ( 1 << 20 ) );
+        }
+        mcts_set_thread_cnt( 1 );
+        mcts_set_batch_size( 1 );
+}
+
+/* === --- Main --------------------------------------------------------- === */
+
+int
+main( void )
+{
+        srand( 123 );
+        bench_pin_cpu( );
+        printf( "threads %u, iterations %u (min %u) / batch\n",
+                pool_thread_cnt( ), BENCH_ITERS, BENCH_MIN_ITERS );
+
+        static const u32 kernel_batches[] = { 1, 16 };
+        for ( u32 batch : kernel_batches ) {
+                bench_header( "kernels" );
+                bench_conv2d( "3->128 5x5", batch, 3, 128, 5 );
+                bench_conv2d( "128->128 5x5", batch, 128, 128, 5 );
+                bench_conv2d( "128->2 1x1", batch, 128, 2, 1 );
+                bench_batchnorm2d( batch );
+                bench_linear( "84->42", batch, 2 * ROWS * COLS, ROWS * COLS );
+                bench_linear( "84->256", batch, 2 * ROWS * COLS, 256 );
+                bench_linear( "256->1", batch, 256, 1 );
+        }
+
+        NN *nn = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        bench_model( nn );
+        bench_mcts( nn );
+        nn_free( nn );
+        return 0;
+}
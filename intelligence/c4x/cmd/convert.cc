@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "nn.h"
+
+using namespace hermes;
+
+/* === --- Configurations and Macros ------------------------------------ === */
+
+#define BIN_DATA_FILE ".build/tensor_data.bin"    /* Tensor data dump file */
+#define V2_DATA_FILE  ".build/tensor_data_v2.bin" /* Output v2 data file */
+
+/* Names of NNDType on the command line, indexed by the dtype. */
+static const char *dtype_names[] = { "f32", "f16", "bf16", "int8" };
+
+/* === --- Main --------------------------------------------------------- === */
+
+/* Convert BIN_DATA_FILE (v1 or v2) into the v2 data file V2_DATA_FILE, with
+ * the kernels in the dtype given by the only argument (f32 by default). See
+ * nn_new for the format.
+ */
+int
+main( int argc, char **argv )
+{
+        u32 dtype = NN_DTYPE_F32;
+        if ( argc > 1 ) {
+                u32 cnt = sizeof( dtype_names ) / sizeof( dtype_names[0] );
+                for ( dtype = 0; dtype < cnt; dtype++ ) {
+                        if ( strcmp( argv[1], dtype_names[dtype] ) == 0 ) break;
+                }
+                if ( dtype == cnt )
+                        PANIC( "unknown dtype %s, use f32, f16, bf16 or int8",
+                               argv[1] );
+        }
+
+        nn_save_data( BIN_DATA_FILE, V2_DATA_FILE, (NNDType)dtype );
+
+        struct stat st;
+        if ( stat( V2_DATA_FILE, &st ) != 0 ) PANIC( "failed to stat output" );
+        printf( "converted %s into %s (%s kernels, %lld KB)\n", BIN_DATA_FILE,
+                V2_DATA_FILE, dtype_names[dtype],
+                (long long)st.st_size / 1024 );
+        return 0;
+}
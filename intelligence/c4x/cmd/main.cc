@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "eval_cache.h"
 #include "game.h"
 #include "log.h"
 #include "mcts.h"
@@ -13,7 +14,8 @@ using namespace hermes;
 
 /* === --- Configurations and Macros ------------------------------------ === */
 
-#define BIN_DATA_FILE ".build/tensor_data.bin" /* Tensor data dump file */
+#define BIN_DATA_FILE  ".build/tensor_data.bin"      /* Tensor data dump file */
+#define INT8_DATA_FILE ".build/tensor_data_int8.bin" /* INT8 kernels file */
 
 // Simulation iteration count.
 //
@@ -25,6 +27,16 @@ using namespace hermes;
 #define MCTS_ITER_CNT 1600
 #endif
 
+// Simulations pondered at most while the human thinks, with MCTS_PONDER.
+#ifndef MCTS_PONDER_ITER_CNT
+#define MCTS_PONDER_ITER_CNT ( 8 * MCTS_ITER_CNT )
+#endif
+
+// Slots of the NN evaluation cache shared by all MCTS moves. 0 disables it.
+#ifndef EVAL_CACHE_SIZE
+#define EVAL_CACHE_SIZE ( 1 << 18 )
+#endif
+
 /* === --- Policy ------------------------------------------------------- === */
 
 int
@@ -81,10 +93,9 @@ policy_nn_move( Game *g, NN *nn )
         // - The index of each probability is same as COL_ROW_TO_IDX. Top left
         //   corner is (col=0,row=0).
         //
-        Tensor *out;        // Policy output.
-        Tensor *value_out;  // Value output, not used.
+        Tensor *out;        // Policy output. Owned by nn.
+        Tensor *value_out;  // Value output, not used. Owned by nn.
         nn_forward( nn, in, &out, &value_out );
-        free_tensor( value_out );
         free_tensor( in );
 
         assert( out->ele_total == ROWS * COLS );
@@ -105,37 +116,65 @@ policy_nn_move( Game *g, NN *nn )
                 PANIC( "is the board full???" );
         }
 
-        free_tensor( out );
         return best_col;
 }
 
+/* Search g from the subtree kept by the session (see mcts_session_root) until
+ * its root has MCTS_ITER_CNT visits.
+ */
 int
-policy_nn_mcts_move( Game *g, NN *nn )
+policy_nn_mcts_move( Game *g, MCTSSession *session, EvalCache *cache )
 {
-        Game     *dup_game = game_dup_snapshot( g );
-        MCTSNode *root     = mcts_node_new( /*moved_in*/ dup_game, nn );
-        mcts_run_simulation( root, MCTS_ITER_CNT );
-        int col = mcts_node_select_next_col_to_play( root );
-        mcts_node_free( root );
+        MCTSNode *root   = mcts_session_root( session, g );
+        int       reused = root->total_count;
+        if ( reused < MCTS_ITER_CNT )
+                mcts_run_simulation( root, MCTS_ITER_CNT - reused );
+        int           col  = mcts_node_select_next_col_to_play( root );
+        MCTSTreeStats tree = mcts_tree_stats( root );
+
+        printf( "MCTS tree: %d simulations reused, %llu nodes, %.1f MB "
+                "(%.1f MB reserved)\n",
+                reused, (unsigned long long)tree.nodes,
+                (double)tree.bytes / ( 1 << 20 ),
+                (double)tree.reserved / ( 1 << 20 ) );
+
+        if ( cache != NULL ) {
+                EvalCacheStats s = eval_cache_stats( cache );
+                printf( "NN eval cache: %llu hits / %llu lookups (%.1f%%), "
+                        "%llu evictions\n",
+                        (unsigned long long)s.hits,
+                        (unsigned long long)s.lookups,
+                        s.lookups ? 100.0 * (double)s.hits / (double)s.lookups
+                                  : 0.0,
+                        (unsigned long long)s.evictions );
+        }
         return col;
 }
 
 /* === --- Play the Game ------------------------------------------------ === */
 
 void
-play_game( NN *nn )
+play_game( NN *nn, EvalCache *cache )
 {
-        Game *g = game_new( );
+        Game        *g       = game_new( );
+        MCTSSession *session = mcts_session_new( nn, cache );
 
         show_board( g );
         while ( 1 ) {
                 int col, row;
 
                 if ( g->next_player == g->nn_player ) {
-                        col = policy_nn_mcts_move( g, nn );
+                        col = policy_nn_mcts_move( g, session, cache );
                 } else {
 #ifdef MCTS_SELF_PLAY
-                        col = policy_nn_mcts_move( g, nn );
+                        col = policy_nn_mcts_move( g, session, cache );
+#elif defined( MCTS_PONDER )
+                        /* Search the position while the human thinks. */
+                        mcts_session_ponder_start( session, g,
+                                                   MCTS_PONDER_ITER_CNT );
+                        col          = policy_human_move( g );
+                        int pondered = mcts_session_ponder_stop( session );
+                        printf( "MCTS pondered %d simulations\n", pondered );
 #else
                         col = policy_human_move( g );
 #endif
@@ -173,6 +212,7 @@ play_game( NN *nn )
                 }
         }
 cleanup:
+        mcts_session_free( session );
         game_free( g );
 }
 
@@ -182,7 +222,13 @@ int
 main( void )
 {
         srand( (unsigned)time( NULL ) );
-        NN *nn = nn_new( /*data_file=*/BIN_DATA_FILE );
-        play_game( nn );
+        NN *nn = nn_new( /*data_file=*/BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+#ifdef NN_INT8
+        nn_load_int8( nn, INT8_DATA_FILE );
+#endif
+        EvalCache *cache =
+            EVAL_CACHE_SIZE > 0 ? eval_cache_new( EVAL_CACHE_SIZE ) : NULL;
+        play_game( nn, cache );
+        eval_cache_free( cache );
         nn_free( nn );
 }
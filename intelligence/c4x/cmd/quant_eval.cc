@@ -0,0 +1,232 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "game.h"
+#include "log.h"
+#include "mcts.h"
+#include "nn.h"
+#include "tensor.h"
+
+using namespace hermes;
+
+/* === --- Configurations and Macros ------------------------------------ === */
+
+#define BIN_DATA_FILE  ".build/tensor_data.bin"      /* Tensor data dump file */
+#define INT8_DATA_FILE ".build/tensor_data_int8.bin" /* INT8 kernels file */
+
+#define QEVAL_POS_CNT    256 /* Number of random positions to evaluate. */
+#define QEVAL_BENCH_CNT  200 /* Number of forwards to time. */
+#define QEVAL_GAME_CNT   10  /* Number of head-to-head games. */
+#define QEVAL_OPEN_PLIES 2   /* Random moves before each game. */
+
+#ifndef QEVAL_MCTS_ITER_CNT
+#define QEVAL_MCTS_ITER_CNT 64 /* Simulation count per move. */
+#endif
+
+/* === --- Positions ---------------------------------------------------- === */
+
+/* Play random moves on a new game until plies moves or the game ends. */
+Game *
+random_game( int plies )
+{
+        Game *g = game_new( );
+        for ( int i = 0; i < plies; i++ ) {
+                if ( game_winner( g ) != -1 ) break;
+                int col, row;
+                do {
+                        col = rand( ) % COLS;
+                        row = game_legal_row( g, col );
+                } while ( row == -1 );
+                g->board[COL_ROW_TO_IDX( col, row )] = g->next_player;
+                g->next_player = g->next_player == BLACK ? WHITE : BLACK;
+        }
+        return g;
+}
+
+/* Returns the legal column with the highest policy, or -1 if none. */
+int
+best_legal_col( Game *g, f32 *policy )
+{
+        int best_col = -1;
+        for ( int col = 0; col < COLS; col++ ) {
+                int row = game_legal_row( g, col );
+                if ( row == -1 ) continue;
+                if ( best_col == -1 ||
+                     policy[COL_ROW_TO_IDX( col, row )] >
+                         policy[COL_ROW_TO_IDX(
+                             best_col, game_legal_row( g, best_col ) )] )
+                        best_col = col;
+        }
+        return best_col;
+}
+
+/* === --- Drift -------------------------------------------------------- === */
+
+/* Report the policy/value drift of q against the f32 model on random
+ * positions.
+ */
+void
+report_drift( NN *f32_nn, NN *q )
+{
+        Game *games[QEVAL_POS_CNT];
+        u32   size    = 3 * ROWS * COLS;
+        u32   shape[] = { QEVAL_POS_CNT, 3, ROWS, COLS };
+
+        Tensor *inputs;
+        alloc_tensor( &inputs, 4, shape );
+        for ( u32 i = 0; i < QEVAL_POS_CNT; i++ ) {
+                games[i] = random_game( rand( ) % ( ROWS * COLS ) );
+                Tensor *in;
+                convert_game_to_tensor_input( &in, games[i] );
+                memcpy( inputs->data + i * size, in->data,
+                        sizeof( f32 ) * size );
+                free_tensor( in );
+        }
+
+        Tensor *ref_policy = NULL;
+        Tensor *ref_value  = NULL;
+        Tensor *policy;
+        Tensor *value;
+        nn_forward_batch( f32_nn, inputs, &policy, &value );
+        dup_tensor( &ref_policy, policy, /*copy_data=*/1 );
+        dup_tensor( &ref_value, value, /*copy_data=*/1 );
+        nn_forward_batch( q, inputs, &policy, &value );
+
+        f32 policy_max = 0.f, policy_sum = 0.f;
+        f32 value_max = 0.f, value_sum = 0.f;
+        u32 top1 = 0, legal = 0;
+        for ( u32 i = 0; i < QEVAL_POS_CNT; i++ ) {
+                f32 *p  = policy->data + i * ROWS * COLS;
+                f32 *rp = ref_policy->data + i * ROWS * COLS;
+                for ( u32 j = 0; j < ROWS * COLS; j++ ) {
+                        f32 d = fabsf( p[j] - rp[j] );
+                        policy_sum += d;
+                        if ( d > policy_max ) policy_max = d;
+                }
+                f32 d = fabsf( value->data[i] - ref_value->data[i] );
+                value_sum += d;
+                if ( d > value_max ) value_max = d;
+
+                int col = best_legal_col( games[i], rp );
+                if ( col == -1 ) continue;
+                legal++;
+                if ( col == best_legal_col( games[i], p ) ) top1++;
+        }
+
+        printf( "policy drift: max %.3e mean %.3e\n", (double)policy_max,
+                (double)( policy_sum / ( QEVAL_POS_CNT * ROWS * COLS ) ) );
+        printf( "value  drift: max %.3e mean %.3e\n", (double)value_max,
+                (double)( value_sum / QEVAL_POS_CNT ) );
+        printf( "top-1 move agreement: %u/%u\n", top1, legal );
+
+        for ( u32 i = 0; i < QEVAL_POS_CNT; i++ ) {
+                game_free( games[i] );
+        }
+        free_tensor( inputs );
+        free_tensor( ref_policy );
+        free_tensor( ref_value );
+}
+
+/* Returns ms per single position nn_forward. */
+double
+bench_forward( NN *nn )
+{
+        Game   *g = random_game( 8 );
+        Tensor *in;
+        convert_game_to_tensor_input( &in, g );
+
+        Tensor *policy;
+        Tensor *value;
+        nn_forward( nn, in, &policy, &value ); /* Warm up. */
+
+        struct timespec start, end;
+        clock_gettime( CLOCK_MONOTONIC, &start );
+        for ( int i = 0; i < QEVAL_BENCH_CNT; i++ ) {
+                nn_forward( nn, in, &policy, &value );
+        }
+        clock_gettime( CLOCK_MONOTONIC, &end );
+
+        free_tensor( in );
+        game_free( g );
+        return ( (double)( end.tv_sec - start.tv_sec ) * 1e3 +
+                 (double)( end.tv_nsec - start.tv_nsec ) / 1e6 ) /
+               QEVAL_BENCH_CNT;
+}
+
+/* === --- Head to Head ------------------------------------------------- === */
+
+/* Play one game from a random opening. Returns BLACK or WHITE for the winner,
+ * or 0 for tie. */
+int
+play_game( NN *black, NN *white )
+{
+        Game *g = random_game( QEVAL_OPEN_PLIES );
+        while ( 1 ) {
+                int winner = game_winner( g );
+                if ( winner != -1 ) {
+                        game_free( g );
+                        return winner;
+                }
+
+                NN       *nn   = g->next_player == BLACK ? black : white;
+                MCTSNode *root = mcts_node_new( game_dup_snapshot( g ), nn,
+                                                /*cache=*/NULL );
+                mcts_run_simulation( root, QEVAL_MCTS_ITER_CNT );
+                int col = mcts_node_select_next_col_to_play( root );
+                mcts_node_free( root );
+
+                int row = game_legal_row( g, col );
+                if ( row == -1 ) PANIC( "invalid column %d", col );
+                g->board[COL_ROW_TO_IDX( col, row )] = g->next_player;
+                g->next_player = g->next_player == BLACK ? WHITE : BLACK;
+        }
+}
+
+/* Report the results of q against the f32 model, swapping colors. */
+void
+report_head_to_head( NN *f32_nn, NN *q )
+{
+        int win = 0, tie = 0, loss = 0;
+        for ( int i = 0; i < QEVAL_GAME_CNT; i++ ) {
+                int   q_black = i % 2 == 0;
+                Color q_color = q_black ? BLACK : WHITE;
+
+                /* Same opening for both colors. */
+                srand( (unsigned)( 1000 + i / 2 ) );
+                int winner = q_black ? play_game( q, f32_nn )
+                                     : play_game( f32_nn, q );
+                if ( winner == 0 )
+                        tie++;
+                else if ( winner == (int)q_color )
+                        win++;
+                else
+                        loss++;
+        }
+        printf( "int8 vs f32 (%d games, %d iterations): %d wins, %d ties, "
+                "%d losses\n",
+                QEVAL_GAME_CNT, QEVAL_MCTS_ITER_CNT, win, tie, loss );
+}
+
+/* === --- Main --------------------------------------------------------- === */
+
+int
+main( void )
+{
+        srand( 123 );
+
+        NN *f32_nn = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        NN *q      = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        nn_load_int8( q, INT8_DATA_FILE );
+
+        report_drift( f32_nn, q );
+        printf( "forward: f32 %.3f ms, int8 %.3f ms\n", bench_forward( f32_nn ),
+                bench_forward( q ) );
+        report_head_to_head( f32_nn, q );
+
+        nn_free( f32_nn );
+        nn_free( q );
+        return 0;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+
+#include "log.h"
+#include "nn.h"
+
+using namespace hermes;
+
+/* === --- Configurations and Macros ------------------------------------ === */
+
+#define BIN_DATA_FILE  ".build/tensor_data.bin"      /* Tensor data dump file */
+#define INT8_DATA_FILE ".build/tensor_data_int8.bin" /* Output INT8 file */
+
+/* === --- Main --------------------------------------------------------- === */
+
+/* Quantise the conv2d kernels of the model (with batchnorm2d folded) to INT8
+ * with per output channel scales and save them into INT8_DATA_FILE, which is
+ * loaded by nn_load_int8.
+ */
+int
+main( void )
+{
+        NN *nn = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN | NN_FLAG_INT8 );
+
+        u32    cnt   = 0;
+        size_t bytes = 0;
+        for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                QConv *q = nn->qconv[i];
+                if ( q == NULL ) continue;
+                cnt++;
+                bytes += (size_t)q->c_out * q->c_in * q->kh * q->kw;
+        }
+        if ( cnt == 0 ) PANIC( "no conv2d kernel to quantise" );
+
+        nn_save_int8( nn, INT8_DATA_FILE );
+        printf( "quantised %u conv2d kernels (%zu KB) into %s\n", cnt,
+                bytes / 1024, INT8_DATA_FILE );
+        nn_free( nn );
+        return 0;
+}
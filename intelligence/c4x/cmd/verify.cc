@@ -0,0 +1,1220 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eval_cache.h"
+#include "game.h"
+#include "log.h"
+#include "mcts.h"
+#include "nn.h"
+#include "pool.h"
+#include "tensor.h"
+
+using namespace hermes;
+
+/* === --- Configurations and Macros ------------------------------------ === */
+
+#define BIN_DATA_FILE ".build/tensor_data.bin" /* Tensor data dump file */
+
+/* The same tensor data (a symlink) with an explicit layer graph, see nn_new. */
+#define GRAPH_DATA_FILE ".build/verify_graph.bin"
+
+/* The same tensor data converted to the v2 format, with kernels in f32, f16,
+ * bf16 and int8, see nn_save_data.
+ */
+#define V2_F32_DATA_FILE  ".build/verify_v2_f32.bin"
+#define V2_F16_DATA_FILE  ".build/verify_v2_f16.bin"
+#define V2_BF16_DATA_FILE ".build/verify_v2_bf16.bin"
+#define V2_I8_DATA_FILE   ".build/verify_v2_int8.bin"
+
+#define VERIFY_POS_CNT        16    /* Random positions to evaluate. */
+#define VERIFY_TOLERANCE      1e-4f /* Max abs diff allowed for any output. */
+#define VERIFY_F16_TOLERANCE  1e-3f /* Kernels in f16, drift about 3e-4. */
+#define VERIFY_BF16_TOLERANCE 1e-2f /* Kernels in bf16, drift about 3e-3. */
+#define VERIFY_I8_TOLERANCE   2e-2f /* Kernels in int8, drift about 5e-3. */
+#define VERIFY_THREADS        3     /* Threads of the pool for the 2nd pass. */
+#define VERIFY_TANH_CNT       4001  /* Points of tanh on [-10, 10]. */
+#define VERIFY_TANH_ERROR     1e-6  /* Max abs error of tanh vs libm. */
+#define VERIFY_SOFTMAX_ROWS   64    /* Random rows of softmax. */
+#define VERIFY_SOFTMAX_ERROR  1e-6  /* Max relative error of softmax vs libm. */
+#define VERIFY_STEM_ITER_CNT  64    /* MCTS simulations of the stem case. */
+#define VERIFY_MCTS_ITER_CNT  256   /* MCTS simulations of the parallel case. */
+#define VERIFY_PONDER_CNT     32    /* MCTS simulations pondered in full. */
+
+/* Whether the search keeps stem accumulators, see MCTS_STEM in mcts.cc. */
+#if defined( MCTS_STEM_DENSE ) || defined( EVAL_SYMMETRY_AVERAGE )
+#define VERIFY_MCTS_STEM 0
+#else
+#define VERIFY_MCTS_STEM 1
+#endif
+
+/* Each case loads the model from data_file with load time graph optimizations
+ * (flags), which must match the reference model (see ref_eval) within
+ * tolerance. Kernels
+ * stored in a narrower dtype only match loosely.
+ */
+typedef struct {
+        const char *name;
+        u32         flags;
+        const char *data_file;
+        f32         tolerance;
+} VerifyCase;
+
+static VerifyCase verify_cases[] = {
+    { "none", NN_FLAG_NONE, BIN_DATA_FILE, VERIFY_TOLERANCE },
+    { "fold_bn", NN_FLAG_FOLD_BN, BIN_DATA_FILE, VERIFY_TOLERANCE },
+    { "no_mmap", NN_FLAG_FOLD_BN | NN_FLAG_NO_MMAP, BIN_DATA_FILE,
+      VERIFY_TOLERANCE },
+    { "graph", NN_FLAG_FOLD_BN, GRAPH_DATA_FILE, VERIFY_TOLERANCE },
+    { "v2_f32", NN_FLAG_FOLD_BN | NN_FLAG_CRC32, V2_F32_DATA_FILE,
+      VERIFY_TOLERANCE },
+    { "v2_no_mmap", NN_FLAG_FOLD_BN | NN_FLAG_NO_MMAP, V2_F32_DATA_FILE,
+      VERIFY_TOLERANCE },
+    { "v2_f16", NN_FLAG_FOLD_BN, V2_F16_DATA_FILE, VERIFY_F16_TOLERANCE },
+    { "v2_bf16", NN_FLAG_FOLD_BN, V2_BF16_DATA_FILE,
+      VERIFY_BF16_TOLERANCE },
+    { "v2_int8", NN_FLAG_FOLD_BN, V2_I8_DATA_FILE, VERIFY_I8_TOLERANCE },
+};
+
+/* Each conv2d case runs conv2d_direct and conv2d_blas on random (N, C_in, H,
+ * W) input and (C_out, C_in, K, K) kernel, which must match conv2d_naive. If
+ * the kernel is quantizable, conv2d_int8 is checked as well.
+ */
+typedef struct {
+        u32 n, c_in, h, w, c_out, k;
+} Conv2dCase;
+
+static Conv2dCase conv2d_cases[] = {
+    { 3, 128, 6, 7, 128, 5 }, /* Resnet blocks. */
+    { 3, 3, 6, 7, 128, 5 },   /* First layer. */
+    { 2, 128, 6, 7, 2, 1 },   /* Heads, not packable. */
+    { 2, 5, 4, 9, 32, 3 },    /* Generic kernel. */
+};
+
+/* === --- Positions ---------------------------------------------------- === */
+
+/* Place a stone of the next player in the legal column col. */
+void
+play_col( Game *g, int col )
+{
+        int row = game_legal_row( g, col );
+        assert( row != -1 );
+        g->board[COL_ROW_TO_IDX( col, row )] = g->next_player;
+        g->next_player = g->next_player == BLACK ? WHITE : BLACK;
+}
+
+/* Play random moves on a new game until plies moves or the game ends. */
+Game *
+random_game( int plies )
+{
+        Game *g = game_new( );
+        for ( int i = 0; i < plies; i++ ) {
+                if ( game_winner( g ) != -1 ) break;
+                int col;
+                do {
+                        col = rand( ) % COLS;
+                } while ( game_legal_row( g, col ) == -1 );
+                play_col( g, col );
+        }
+        return g;
+}
+
+/* Fill (VERIFY_POS_CNT, 3, ROWS, COLS) input with random positions. */
+void
+random_inputs( Tensor **dst )
+{
+        u32 shape[] = { VERIFY_POS_CNT, 3, ROWS, COLS };
+        alloc_tensor( dst, 4, shape );
+
+        u32 size = 3 * ROWS * COLS;
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                Game   *g = random_game( rand( ) % ( ROWS * COLS ) );
+                Tensor *in;
+                convert_game_to_tensor_input( &in, g );
+                memcpy( ( *dst )->data + i * size, in->data,
+                        sizeof( f32 ) * size );
+                free_tensor( in );
+                game_free( g );
+        }
+}
+
+/* === --- Reference model ---------------------------------------------- === */
+
+/* The reference outputs come from the model of etc/reference_model.py, run on
+ * the weights of BIN_DATA_FILE as read from disk, with conv2d_naive and plain
+ * loops. Nothing of nn_forward is used (no packed kernels, layer graph, fused
+ * epilogues or vectorised elementwise ops), so a bug there cannot hide in the
+ * reference as well.
+ */
+#define REF_WEIGHT_CNT 84    /* Weights of the stem, 5 blocks and 2 heads. */
+#define REF_BLOCK_CNT  5     /* Resnet blocks. */
+#define REF_BN_EPS     1e-3f /* eps of the BatchNorm2d. */
+#define REF_HIDDEN     256   /* Width of the value head fc1. */
+
+/* Read the weights of the v1 data file (see nn.cc) into weights. */
+void
+ref_read_weights( const char *file, Tensor *weights )
+{
+        FILE *f = fopen( file, "rb" );
+        if ( f == NULL ) PANIC( "failed to open %s", file );
+        u32 cnt;
+        if ( fread( &cnt, 4, 1, f ) != 1 || cnt != REF_WEIGHT_CNT )
+                PANIC( "%s is not a v1 data file of the model", file );
+        for ( u32 i = 0; i < cnt; i++ ) {
+                Tensor *t = &weights[i];
+                if ( fread( &t->dim, 4, 1, f ) != 1 ||
+                     t->dim > MAX_DIM_LIMIT ||
+                     fread( t->shape, 4, t->dim, f ) != t->dim )
+                        PANIC( "failed to read the shapes of %s", file );
+                t->ele_total = 1;
+                for ( u32 j = 0; j < t->dim; j++ ) t->ele_total *= t->shape[j];
+                t->ele_cap = t->ele_total;
+        }
+        for ( u32 i = 0; i < cnt; i++ ) {
+                Tensor *t = &weights[i];
+                t->data   = (f32 *)malloc( sizeof( f32 ) * t->ele_total );
+                assert( t->data != NULL );
+                if ( fread( t->data, 4, t->ele_total, f ) != t->ele_total )
+                        PANIC( "failed to read the tensors of %s", file );
+        }
+        fclose( f );
+}
+
+/* x = batchnorm2d(conv2d(x)) with the 6 weights w, plus residual if not NULL,
+ * then relu.
+ */
+void
+ref_conv_bn_relu( Tensor **x, Tensor *w, Tensor *residual )
+{
+        Tensor *y = NULL;
+        conv2d_naive( &y, *x, &w[0], &w[1], NULL, NULL );
+        u32 c_out = y->shape[1];
+        u32 hw    = y->shape[2] * y->shape[3];
+        for ( u32 c = 0; c < c_out; c++ ) {
+                f32  gamma = w[2].data[c];
+                f32  beta  = w[3].data[c];
+                f32  mean  = w[4].data[c];
+                f32  var   = w[5].data[c];
+                f32 *o     = y->data + c * hw;
+                for ( u32 p = 0; p < hw; p++ ) {
+                        f32 v = ( o[p] - mean ) / sqrtf( var + REF_BN_EPS ) *
+                                    gamma +
+                                beta;
+                        if ( residual != NULL ) v += residual->data[c * hw + p];
+                        o[p] = v > 0.f ? v : 0.f;
+                }
+        }
+        free_tensor( *x );
+        *x = y;
+}
+
+/* out = weight * in + bias, with (out_cnt, in_cnt) weight. */
+void
+ref_linear( f32 *out, const f32 *in, Tensor *weight, Tensor *bias )
+{
+        u32 out_cnt = weight->shape[0];
+        u32 in_cnt  = weight->shape[1];
+        for ( u32 j = 0; j < out_cnt; j++ ) {
+                f32 v = bias->data[j];
+                for ( u32 k = 0; k < in_cnt; k++ ) {
+                        v += weight->data[j * in_cnt + k] * in[k];
+                }
+                out[j] = v;
+        }
+}
+
+/* Evaluate all positions in inputs by the reference model. */
+void
+ref_eval( Tensor *inputs, Tensor **policy, Tensor **value )
+{
+        Tensor w[REF_WEIGHT_CNT];
+        ref_read_weights( BIN_DATA_FILE, w );
+
+        u32 size  = 3 * ROWS * COLS;
+        u32 batch = inputs->shape[0];
+
+        u32 policy_shape[] = { batch, ROWS * COLS };
+        u32 value_shape[]  = { batch, 1 };
+        alloc_tensor( policy, 2, policy_shape );
+        alloc_tensor( value, 2, value_shape );
+
+        u32 in_shape[] = { 1, 3, ROWS, COLS };
+        for ( u32 i = 0; i < batch; i++ ) {
+                Tensor *x;
+                alloc_tensor( &x, 4, in_shape );
+                memcpy( x->data, inputs->data + i * size,
+                        sizeof( f32 ) * size );
+
+                ref_conv_bn_relu( &x, &w[0], NULL );
+                for ( u32 b = 0; b < REF_BLOCK_CNT; b++ ) {
+                        Tensor *inp = NULL;
+                        dup_tensor( &inp, x, /*copy_data=*/1 );
+                        ref_conv_bn_relu( &x, &w[6 + 12 * b], NULL );
+                        ref_conv_bn_relu( &x, &w[6 + 12 * b + 6], inp );
+                        free_tensor( inp );
+                }
+                Tensor *trunk = x;
+
+                /* Policy head: softmax of the logits. */
+                Tensor *p = NULL;
+                dup_tensor( &p, trunk, /*copy_data=*/1 );
+                ref_conv_bn_relu( &p, &w[66], NULL );
+                f32 *logits = ( *policy )->data + i * ROWS * COLS;
+                ref_linear( logits, p->data, &w[72], &w[73] );
+                f32 max = logits[0];
+                for ( u32 j = 1; j < ROWS * COLS; j++ ) {
+                        if ( logits[j] > max ) max = logits[j];
+                }
+                f32 sum = 0.f;
+                for ( u32 j = 0; j < ROWS * COLS; j++ ) {
+                        logits[j] = expf( logits[j] - max );
+                        sum += logits[j];
+                }
+                for ( u32 j = 0; j < ROWS * COLS; j++ ) logits[j] /= sum;
+                free_tensor( p );
+
+                /* Value head: tanh of fc2(relu(fc1)). */
+                Tensor *v = NULL;
+                dup_tensor( &v, trunk, /*copy_data=*/1 );
+                ref_conv_bn_relu( &v, &w[74], NULL );
+                f32 hidden[REF_HIDDEN];
+                assert( w[80].shape[0] == REF_HIDDEN );
+                ref_linear( hidden, v->data, &w[80], &w[81] );
+                for ( u32 j = 0; j < REF_HIDDEN; j++ ) {
+                        if ( hidden[j] < 0.f ) hidden[j] = 0.f;
+                }
+                f32 out;
+                ref_linear( &out, hidden, &w[82], &w[83] );
+                ( *value )->data[i] = tanhf( out );
+                free_tensor( v );
+                free_tensor( trunk );
+        }
+        free_static_tensor_data( REF_WEIGHT_CNT, w );
+}
+
+/* === --- Verification ------------------------------------------------- === */
+
+f32
+max_abs_diff( f32 *a, f32 *b, u32 cnt )
+{
+        f32 diff = 0.f;
+        for ( u32 i = 0; i < cnt; i++ ) {
+                f32 d = fabsf( a[i] - b[i] );
+                if ( d > diff ) diff = d;
+        }
+        return diff;
+}
+
+/* Evaluate all positions in inputs one by one and store the outputs. */
+void
+eval_one_by_one( NN *nn, Tensor *inputs, Tensor **policy, Tensor **value )
+{
+        u32 size  = 3 * ROWS * COLS;
+        u32 batch = inputs->shape[0];
+
+        u32 policy_shape[] = { batch, ROWS * COLS };
+        u32 value_shape[]  = { batch, 1 };
+        alloc_tensor( policy, 2, policy_shape );
+        alloc_tensor( value, 2, value_shape );
+
+        Tensor *in;
+        u32     in_shape[] = { 1, 3, ROWS, COLS };
+        alloc_tensor( &in, 4, in_shape );
+        for ( u32 i = 0; i < batch; i++ ) {
+                memcpy( in->data, inputs->data + i * size,
+                        sizeof( f32 ) * size );
+                Tensor *p;
+                Tensor *v;
+                nn_forward( nn, in, &p, &v );
+                memcpy( ( *policy )->data + i * ROWS * COLS, p->data,
+                        sizeof( f32 ) * ROWS * COLS );
+                ( *value )->data[i] = v->data[0];
+        }
+        free_tensor( in );
+}
+
+/* Returns 0 if the case matches the reference outputs. */
+int
+verify_case( VerifyCase *c, Tensor *inputs, Tensor *ref_policy,
+             Tensor *ref_value )
+{
+        NN *nn = nn_new( c->data_file, c->flags );
+
+        Tensor *policy;
+        Tensor *value;
+        eval_one_by_one( nn, inputs, &policy, &value );
+        f32 policy_diff = max_abs_diff( policy->data, ref_policy->data,
+                                        ref_policy->ele_total );
+        f32 value_diff =
+            max_abs_diff( value->data, ref_value->data, ref_value->ele_total );
+        free_tensor( policy );
+        free_tensor( value );
+
+        /* The batched forward must match as well. */
+        nn_forward_batch( nn, inputs, &policy, &value );
+        f32 d = max_abs_diff( policy->data, ref_policy->data,
+                              ref_policy->ele_total );
+        if ( d > policy_diff ) policy_diff = d;
+        d = max_abs_diff( value->data, ref_value->data, ref_value->ele_total );
+        if ( d > value_diff ) value_diff = d;
+        nn_free( nn );
+
+        int ok = policy_diff <= c->tolerance && value_diff <= c->tolerance;
+        printf( "%-10s policy max diff %.3e value max diff %.3e: %s\n",
+                c->name, (double)policy_diff, (double)value_diff,
+                ok ? "OK" : "FAILED" );
+        return ok ? 0 : 1;
+}
+
+void
+random_tensor( Tensor **dst, u32 dim, u32 *shape )
+{
+        alloc_tensor( dst, dim, shape );
+        for ( u32 i = 0; i < ( *dst )->ele_total; i++ ) {
+                ( *dst )->data[i] = (f32)rand( ) / (f32)RAND_MAX - 0.5f;
+        }
+}
+
+/* Returns 0 if got matches expected. */
+int
+verify_conv2d_output( Conv2dCase *c, const char *name, Tensor *got,
+                      Tensor *expected )
+{
+        f32 diff =
+            max_abs_diff( got->data, expected->data, expected->ele_total );
+        int ok = diff <= VERIFY_TOLERANCE;
+        printf( "%-10s (%u, %u, %u, %u) x (%u, %u, %u, %u) max diff %.3e: "
+                "%s\n",
+                name, c->n, c->c_in, c->h, c->w, c->c_out, c->c_in, c->k, c->k,
+                (double)diff, ok ? "OK" : "FAILED" );
+        return ok ? 0 : 1;
+}
+
+/* Reference of the conv2d epilogue ep (with scale, residual and relu) applied
+ * in place on the (N, C_out, H, W) output t.
+ */
+void
+epilogue_ref( Tensor *t, const ConvEpilogue *ep )
+{
+        u32 c_out = t->shape[1];
+        u32 hw    = t->shape[2] * t->shape[3];
+        for ( u32 i = 0; i < t->ele_total; i++ ) {
+                u32 c = i / hw % c_out;
+                f32 v = t->data[i] * ep->scale[c] + ep->shift[c] +
+                        ep->residual[i];
+                t->data[i] = v > 0.f ? v : 0.f;
+        }
+}
+
+/* Returns 0 if conv2d_int8 matches conv2d_naive on the dequantised kernel and
+ * input, i.e., only f32 rounding errors are allowed. With the epilogue ep, it
+ * must match the reference epilogue on its own output.
+ */
+int
+verify_conv2d_int8_case( Conv2dCase *c, Tensor *input, Tensor *weight,
+                         Tensor *bias, const ConvEpilogue *ep )
+{
+        if ( !qconv_quantizable( weight ) ) return 0;
+
+        /* conv2d_int8 needs non-negative input. */
+        Tensor *relu = NULL;
+        dup_tensor( &relu, input, /*copy_data=*/1 );
+        relu_inplace( relu );
+
+        QConv  *q     = qconv_quantize( weight );
+        Tensor *dq_w  = NULL;
+        Tensor *dq_in = NULL;
+        u32     k     = q->c_in * q->kh * q->kw;
+        u32     size  = relu->ele_total / c->n;
+        dup_tensor( &dq_w, weight, /*copy_data=*/0 );
+        dup_tensor( &dq_in, relu, /*copy_data=*/0 );
+        for ( u32 o = 0; o < q->c_out; o++ ) {
+                for ( u32 i = 0; i < k; i++ ) {
+                        dq_w->data[o * k + i] =
+                            (f32)q->weight[o * q->k_pad + i] * q->scale[o];
+                }
+        }
+        /* Same per sample UINT8 quantisation as conv2d_int8. */
+        for ( u32 b = 0; b < c->n; b++ ) {
+                f32 *src = relu->data + b * size;
+                f32 *dst = dq_in->data + b * size;
+                f32  max = 0.f;
+                for ( u32 i = 0; i < size; i++ ) {
+                        if ( src[i] > max ) max = src[i];
+                }
+                f32 scale = max > 0.f ? max / 255.f : 1.f;
+                f32 inv   = 1.f / scale;
+                for ( u32 i = 0; i < size; i++ ) {
+                        f32 v  = src[i] * inv + 0.5f;
+                        dst[i] = (f32)( v >= 255.f ? 255 : (u32)v ) * scale;
+                }
+        }
+
+        Tensor *expected = NULL;
+        Tensor *got      = NULL;
+        conv2d_naive( &expected, dq_in, dq_w, bias, NULL, NULL );
+        conv2d_int8( &got, relu, q, bias, NULL, NULL );
+        int failed = verify_conv2d_output( c, "int8", got, expected );
+
+        epilogue_ref( got, ep );
+        conv2d_int8( &expected, relu, q, bias, NULL, ep );
+        failed += verify_conv2d_output( c, "int8+ep", got, expected );
+
+        qconv_free( q );
+        free_tensor( relu );
+        free_tensor( dq_w );
+        free_tensor( dq_in );
+        free_tensor( expected );
+        free_tensor( got );
+        return failed;
+}
+
+/* Returns 0 if conv2d_direct and conv2d_blas match conv2d_naive, without and
+ * with an epilogue (batchnorm2d, residual add and relu).
+ */
+int
+verify_conv2d_case( Conv2dCase *c )
+{
+        Tensor *input, *weight, *packed, *gemm_packed, *bias;
+        Tensor *scale, *shift, *residual;
+        u32     input_shape[]  = { c->n, c->c_in, c->h, c->w };
+        u32     weight_shape[] = { c->c_out, c->c_in, c->k, c->k };
+        u32     bias_shape[]   = { c->c_out };
+        u32     output_shape[] = { c->n, c->c_out, c->h, c->w };
+        random_tensor( &input, 4, input_shape );
+        random_tensor( &weight, 4, weight_shape );
+        random_tensor( &bias, 1, bias_shape );
+        random_tensor( &scale, 1, bias_shape );
+        random_tensor( &shift, 1, bias_shape );
+        random_tensor( &residual, 4, output_shape );
+        ConvEpilogue ep = { scale->data, shift->data, residual->data, 1 };
+
+        dup_tensor( &packed, weight, /*copy_data=*/1 );
+        if ( conv2d_direct_packable( packed ) ) {
+                conv2d_direct_pack_weight( packed );
+        }
+        dup_tensor( &gemm_packed, weight, /*copy_data=*/1 );
+        conv2d_blas_pack_weight( gemm_packed );
+
+        Tensor *expected = NULL;
+        Tensor *got      = NULL;
+        conv2d_naive( &expected, input, weight, bias, NULL, NULL );
+        conv2d_direct( &got, input, packed, bias, NULL, NULL );
+        int failed = verify_conv2d_output( c, "direct", got, expected );
+
+        conv2d_blas( &got, input, gemm_packed, bias, NULL, NULL );
+        failed += verify_conv2d_output( c, "blas", got, expected );
+
+        epilogue_ref( expected, &ep );
+        conv2d_naive( &got, input, weight, bias, NULL, &ep );
+        failed += verify_conv2d_output( c, "naive+ep", got, expected );
+
+        conv2d_direct( &got, input, packed, bias, NULL, &ep );
+        failed += verify_conv2d_output( c, "direct+ep", got, expected );
+
+        conv2d_blas( &got, input, gemm_packed, bias, NULL, &ep );
+        failed += verify_conv2d_output( c, "blas+ep", got, expected );
+
+        failed += verify_conv2d_int8_case( c, input, weight, bias, &ep );
+
+        free_tensor( input );
+        free_tensor( weight );
+        free_tensor( packed );
+        free_tensor( gemm_packed );
+        free_tensor( bias );
+        free_tensor( scale );
+        free_tensor( shift );
+        free_tensor( residual );
+        free_tensor( expected );
+        free_tensor( got );
+        return failed;
+}
+
+/* Returns 0 if tanh_inplace and softmax_inplace, which approximate exp, are
+ * within the error bounds of libm.
+ */
+int
+verify_elementwise( void )
+{
+        /* tanh on evenly spaced points, so the SIMD kernel has a tail. */
+        u32     tanh_shape[] = { VERIFY_TANH_CNT };
+        Tensor *t            = NULL;
+        alloc_tensor( &t, 1, tanh_shape );
+        for ( u32 i = 0; i < VERIFY_TANH_CNT; i++ ) {
+                t->data[i] = -10.f + 20.f * (f32)i / ( VERIFY_TANH_CNT - 1 );
+        }
+        double tanh_err = 0.0;
+        Tensor *x       = NULL;
+        dup_tensor( &x, t, /*copy_data=*/1 );
+        tanh_inplace( t );
+        for ( u32 i = 0; i < VERIFY_TANH_CNT; i++ ) {
+                double err = fabs( (double)t->data[i] - tanh( x->data[i] ) );
+                if ( err > tanh_err ) tanh_err = err;
+        }
+
+        /* softmax on policy sized rows, with exp inputs down to -80. */
+        u32     softmax_shape[] = { VERIFY_SOFTMAX_ROWS, ROWS * COLS };
+        Tensor *s               = NULL;
+        random_tensor( &s, 2, softmax_shape );
+        for ( u32 i = 0; i < s->ele_total; i++ ) s->data[i] *= 80.f;
+        free_tensor( x );
+        x = NULL;
+        dup_tensor( &x, s, /*copy_data=*/1 );
+        softmax_inplace( s );
+        double softmax_err = 0.0;
+        for ( u32 b = 0; b < VERIFY_SOFTMAX_ROWS; b++ ) {
+                f32 *in  = x->data + b * ROWS * COLS;
+                f32 *out = s->data + b * ROWS * COLS;
+                f32  max = in[0];
+                for ( u32 i = 1; i < ROWS * COLS; i++ ) {
+                        if ( in[i] > max ) max = in[i];
+                }
+                /* The input of exp is rounded to f32 as in softmax_inplace. */
+                double total = 0.0;
+                for ( u32 i = 0; i < ROWS * COLS; i++ ) {
+                        total += exp( (f32)( in[i] - max ) );
+                }
+                for ( u32 i = 0; i < ROWS * COLS; i++ ) {
+                        double ref = exp( (f32)( in[i] - max ) ) / total;
+                        double err = fabs( out[i] - ref ) / ref;
+                        if ( err > softmax_err ) softmax_err = err;
+                }
+        }
+
+        int failed = tanh_err > VERIFY_TANH_ERROR;
+        failed += softmax_err > VERIFY_SOFTMAX_ERROR;
+        printf( "tanh max abs error %.3e, softmax max relative error %.3e: "
+                "%s\n",
+                tanh_err, softmax_err, failed ? "FAILED" : "OK" );
+
+        free_tensor( t );
+        free_tensor( s );
+        free_tensor( x );
+        return failed;
+}
+
+/* Returns non-zero if both nodes hold the same NN outputs. */
+int
+same_node_eval( MCTSNode *a, MCTSNode *b )
+{
+        return a->predicated_reward == b->predicated_reward &&
+               memcmp( a->p, b->p, sizeof( a->p ) ) == 0 &&
+               memcmp( a->n, b->n, sizeof( a->n ) ) == 0;
+}
+
+/* Returns 0 if game_key identifies positions exactly, MCTS nodes served by
+ * the eval cache match the ones evaluated by NN, and mirrored positions get
+ * mirrored nodes.
+ */
+int
+verify_eval_cache( void )
+{
+        int failed = 0;
+
+        /* Transposition: same position by different move orders. */
+        Game *a = game_new( );
+        Game *b = game_new( );
+        int   cols_a[] = { 3, 2, 3, 4 };
+        int   cols_b[] = { 3, 4, 3, 2 };
+        for ( int i = 0; i < 4; i++ ) {
+                play_col( a, cols_a[i] );
+                play_col( b, cols_b[i] );
+        }
+        if ( game_key( a ) != game_key( b ) ) {
+                printf( "game_key differs for transposed positions\n" );
+                failed++;
+        }
+        game_free( a );
+        game_free( b );
+
+        /* Keys are equal iff positions are equal. */
+        Game *games[VERIFY_POS_CNT];
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                games[i] = random_game( rand( ) % ( ROWS * COLS ) );
+        }
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                for ( u32 j = 0; j < VERIFY_POS_CNT; j++ ) {
+                        int same = memcmp( games[i]->board, games[j]->board,
+                                           sizeof( games[i]->board ) ) == 0 &&
+                                   games[i]->next_player ==
+                                       games[j]->next_player;
+                        int same_key =
+                            game_key( games[i] ) == game_key( games[j] );
+                        if ( same != same_key ) {
+                                printf( "game_key mismatch for positions %u "
+                                        "and %u\n",
+                                        i, j );
+                                failed++;
+                        }
+                }
+        }
+
+        /* game_from_key restores the position of the key. */
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                Game d;
+                u64  key = game_key( games[i] );
+                game_from_key( key, &d );
+                int same = memcmp( d.board, games[i]->board,
+                                   sizeof( d.board ) ) == 0 &&
+                           d.next_player == games[i]->next_player &&
+                           game_key_next_player( key ) == d.next_player;
+                if ( !same ) {
+                        printf( "game_from_key mismatch for position %u\n",
+                                i );
+                        failed++;
+                }
+        }
+
+        /* game_winner_at agrees with game_winner along random games, and
+         * game_unplay undoes game_play. */
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                Game *g      = game_new( );
+                int   winner = -1;
+                while ( winner == -1 ) {
+                        int col;
+                        do {
+                                col = rand( ) % COLS;
+                        } while ( game_legal_row( g, col ) == -1 );
+                        Game before = *g;
+                        int  row    = game_play( g, col );
+                        winner      = game_winner_at( g, col, row );
+                        Game after  = *g;
+                        game_unplay( g, col, row );
+                        int same = memcmp( g, &before, sizeof( *g ) ) == 0;
+                        *g       = after;
+                        if ( winner != game_winner( g ) || !same ) {
+                                printf( "game_play mismatch in game %u\n",
+                                        i );
+                                failed++;
+                                break;
+                        }
+                }
+                game_free( g );
+        }
+
+        /* Nodes from the cache (second lookup) must match the NN. */
+        NN        *nn    = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        EvalCache *cache = eval_cache_new( 1 );
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                if ( game_winner( games[i] ) != -1 ) continue;
+                MCTSNode *want =
+                    mcts_node_new( game_dup_snapshot( games[i] ), nn, NULL );
+                for ( int k = 0; k < 2; k++ ) {
+                        MCTSNode *got = mcts_node_new(
+                            game_dup_snapshot( games[i] ), nn, cache );
+                        if ( !same_node_eval( got, want ) ) {
+                                printf( "eval cache mismatch for position "
+                                        "%u\n",
+                                        i );
+                                failed++;
+                        }
+                        mcts_node_free( got );
+                }
+                mcts_node_free( want );
+        }
+
+#ifndef EVAL_SYMMETRY_NONE
+        /* A position and its mirror image share one evaluation. */
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) {
+                if ( game_winner( games[i] ) != -1 ) continue;
+                Game *m = game_dup_snapshot( games[i] );
+                game_mirror( m );
+                /* A symmetric position is its own mirror image, and the NN is
+                 * not mirror symmetric. */
+                if ( game_key( m ) == game_key( games[i] ) ) {
+                        game_free( m );
+                        continue;
+                }
+                MCTSNode *a =
+                    mcts_node_new( game_dup_snapshot( games[i] ), nn, NULL );
+                MCTSNode *b = mcts_node_new( m, nn, NULL );
+                for ( int col = 0; col < COLS; col++ ) {
+                        if ( a->predicated_reward == b->predicated_reward &&
+                             a->p[col] == b->p[COLS - 1 - col] )
+                                continue;
+                        printf( "mirror mismatch for position %u\n", i );
+                        failed++;
+                        break;
+                }
+                mcts_node_free( a );
+                mcts_node_free( b );
+        }
+#endif
+
+        EvalCacheStats stats = eval_cache_stats( cache );
+        if ( stats.hits + stats.stores != stats.lookups ||
+             stats.hits * 2 < stats.lookups ) {
+                printf( "eval cache stats: %llu hits %llu stores %llu "
+                        "lookups\n",
+                        (unsigned long long)stats.hits,
+                        (unsigned long long)stats.stores,
+                        (unsigned long long)stats.lookups );
+                failed++;
+        }
+        printf( "eval cache %llu hits / %llu lookups: %s\n",
+                (unsigned long long)stats.hits,
+                (unsigned long long)stats.lookups, failed ? "FAILED" : "OK" );
+
+        eval_cache_free( cache );
+        nn_free( nn );
+        for ( u32 i = 0; i < VERIFY_POS_CNT; i++ ) game_free( games[i] );
+        return failed;
+}
+
+/* Outputs of the MCTS node must match the node created from scratch by nn. */
+void
+verify_stem_node( MCTSNode *c, NN *nn, f32 *diff )
+{
+        Game g;
+        mcts_node_game( c, &g );
+        MCTSNode *want = mcts_node_new( game_dup_snapshot( &g ), nn, NULL );
+        f32 d = fabsf( c->predicated_reward - want->predicated_reward );
+        if ( d > *diff ) *diff = d;
+        /* The priors are kept in f16, so the tiny drift of the outputs may
+         * round them to neighbours. */
+        for ( int col = 0; col < COLS; col++ ) {
+                if ( abs( c->p[col] - want->p[col] ) > 1 ) *diff = INFINITY;
+        }
+        mcts_node_free( want );
+}
+
+/* verify_stem_node for all nodes in the tree. */
+int
+verify_stem_tree( MCTSNode *n, NN *nn, f32 *diff )
+{
+        int cnt = 0;
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = mcts_node_child( n, col );
+                if ( c == NULL ) continue;
+                verify_stem_node( c, nn, diff );
+                cnt += 1 + verify_stem_tree( c, nn, diff );
+        }
+        return cnt;
+}
+
+/* Returns the number of nodes in the tree at n with a stem accumulator. A
+ * leaf must not have one, as it is only filled for the children, so leaves
+ * with one are counted in bad.
+ */
+int
+count_stems( MCTSNode *n, int *bad )
+{
+        int cnt  = n->stem != 0;
+        int leaf = 1;
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = mcts_node_child( n, col );
+                if ( c == NULL ) continue;
+                leaf = 0;
+                cnt += count_stems( c, bad );
+        }
+        if ( leaf && n->stem != 0 ) ( *bad )++;
+        return cnt;
+}
+
+/* Collect the distinct nodes of the graph at n (excluding n) into nodes, which
+ * holds cnt nodes so far and at most cap. Returns the number of nodes found
+ * with the position of another node.
+ */
+int
+collect_dag( MCTSNode *n, MCTSNode **nodes, int *cnt, int cap )
+{
+        int dup = 0;
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = mcts_node_child( n, col );
+                if ( c == NULL ) continue;
+                int seen = 0;
+                for ( int i = 0; i < *cnt && !seen; i++ ) {
+                        if ( nodes[i] == c ) {
+                                seen = 1;
+                        } else if ( nodes[i]->key == c->key ) {
+                                dup++;
+                        }
+                }
+                if ( seen ) continue;
+                assert( *cnt < cap );
+                nodes[( *cnt )++] = c;
+                dup += collect_dag( c, nodes, cnt, cap );
+        }
+        return dup;
+}
+
+/* The incremental stem must match the dense forward along a random game, and
+ * in an MCTS tree.
+ */
+int
+verify_stem( void )
+{
+        NN *nn = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        assert( nn_stem_incremental( nn ) );
+
+        Game   *g = game_new( );
+        Tensor *in;
+        Tensor *acc = NULL;
+        Tensor *policy;
+        Tensor *value;
+        f32     diff  = 0.f;
+        int     plies = 0;
+        convert_game_to_tensor_input( &in, g );
+        nn_stem_new( nn, &acc, in );
+        free_tensor( in );
+        while ( game_winner( g ) == -1 ) {
+                int col;
+                do {
+                        col = rand( ) % COLS;
+                } while ( game_legal_row( g, col ) == -1 );
+                int   row   = game_legal_row( g, col );
+                Color mover = g->next_player;
+                play_col( g, col );
+                nn_stem_add( nn, acc, mover == BLACK ? 0 : 1, (u32)row,
+                             (u32)col, 1.f );
+                nn_stem_add_plane( nn, acc, 2, mover == BLACK ? -1.f : 1.f );
+                plies++;
+
+                f32 want[ROWS * COLS + 1];
+                convert_game_to_tensor_input( &in, g );
+                nn_forward( nn, in, &policy, &value );
+                memcpy( want, policy->data, sizeof( f32 ) * ROWS * COLS );
+                want[ROWS * COLS] = value->data[0];
+                free_tensor( in );
+
+                nn_forward_stem( nn, acc, &policy, &value );
+                f32 d = max_abs_diff( policy->data, want, ROWS * COLS );
+                if ( d > diff ) diff = d;
+                d = fabsf( value->data[0] - want[ROWS * COLS] );
+                if ( d > diff ) diff = d;
+        }
+        free_tensor( acc );
+        game_free( g );
+
+        MCTSNode *root  = mcts_node_new( random_game( 4 ), nn, NULL );
+        mcts_run_simulation( root, VERIFY_STEM_ITER_CNT );
+        int       nodes = verify_stem_tree( root, nn, &diff );
+        int       bad   = 0;
+        int       stems = count_stems( root, &bad );
+        mcts_node_free( root );
+        nn_free( nn );
+
+        int ok = diff <= VERIFY_TOLERANCE && bad == 0 &&
+                 ( stems > 0 ) == VERIFY_MCTS_STEM;
+        printf( "stem %d plies %d nodes %d stems max diff %.3e: %s\n", plies,
+                nodes, stems, (double)diff, ok ? "OK" : "FAILED" );
+        return ok ? 0 : 1;
+}
+
+/* verify_stem_node for the nodes below root, once each in a graph (dag), where
+ * positions with two nodes are counted in bad. Returns the number of nodes.
+ */
+int
+verify_mcts_nodes( MCTSNode *root, NN *nn, int dag, f32 *diff, int *bad )
+{
+        if ( !dag ) return verify_stem_tree( root, nn, diff );
+
+        static MCTSNode *nodes[VERIFY_MCTS_ITER_CNT];
+        int              cnt = 0;
+        *bad += collect_dag( root, nodes, &cnt, VERIFY_MCTS_ITER_CNT );
+        for ( int i = 0; i < cnt; i++ ) {
+                verify_stem_node( nodes[i], nn, diff );
+        }
+        return cnt;
+}
+
+/* Returns the number of nodes in the tree at n whose statistics do not add up:
+ * the visits of a node sum up to its total_count, an edge has one more visit
+ * than its child (the one which expanded it) and no virtual loss is left. In a
+ * graph (dag), a child is also visited through other edges.
+ */
+int
+verify_mcts_stats( MCTSNode *n, int dag )
+{
+        int bad = 0;
+        int sum = 0;
+        for ( int col = 0; col < COLS; col++ ) {
+                if ( n->n[col] == MCTS_N_ILLEGAL ) continue;
+                sum += (int)n->n[col];
+                if ( fabsf( n->w[col] ) > (f32)n->n[col] + 1e-3f ) bad++;
+                MCTSNode *c = mcts_node_child( n, col );
+                if ( c == NULL ) continue;
+                if ( !dag && (int)n->n[col] < c->total_count + 1 ) bad++;
+                bad += verify_mcts_stats( c, dag );
+        }
+        if ( sum != n->total_count ) bad++;
+        return bad;
+}
+
+/* Each MCTS case searches with threads (see mcts_set_thread_cnt) and batch
+ * (see mcts_set_batch_size), a graph if dag (see mcts_set_dag).
+ */
+typedef struct {
+        u32 threads, batch;
+        int dag;
+} MCTSCase;
+
+static MCTSCase mcts_cases[] = {
+    { 4, 1, 0 }, /* Tree parallel. */
+    { 1, 8, 0 }, /* Batched leaves. */
+    { 2, 8, 0 }, /* Both. */
+    { 1, 1, 1 }, /* Graph. */
+    { 2, 8, 1 }, /* Parallel graph with batched leaves. */
+};
+
+/* The tree searched by the case must add up, and the nodes evaluated by the
+ * forks of the NN (in batches) must match the nodes created from scratch. A
+ * graph must have one node per position.
+ */
+int
+verify_mcts_case( MCTSCase *c )
+{
+        NN *nn         = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        u32 thread_cnt = mcts_thread_cnt( );
+        u32 batch_size = mcts_batch_size( );
+        int dag        = mcts_dag( );
+        mcts_set_thread_cnt( c->threads );
+        mcts_set_batch_size( c->batch );
+        mcts_set_dag( c->dag );
+
+        MCTSNode *root = mcts_node_new( random_game( 4 ), nn, NULL );
+        mcts_run_simulation( root, VERIFY_MCTS_ITER_CNT );
+        f32 diff  = 0.f;
+        int bad   = verify_mcts_stats( root, c->dag );
+        int nodes = verify_mcts_nodes( root, nn, c->dag, &diff, &bad );
+        if ( root->total_count != VERIFY_MCTS_ITER_CNT ) bad++;
+
+        /* All nodes (and the ones lost to a race) are in the arena. */
+        MCTSTreeStats tree = mcts_tree_stats( root );
+        if ( tree.nodes < (u64)nodes + 1 ||
+             tree.bytes < tree.nodes * sizeof( MCTSNode ) ||
+             tree.bytes > tree.reserved )
+                bad++;
+        mcts_node_free( root );
+        mcts_set_thread_cnt( thread_cnt );
+        mcts_set_batch_size( batch_size );
+        mcts_set_dag( dag );
+        nn_free( nn );
+
+        int ok = bad == 0 && diff <= VERIFY_TOLERANCE;
+        printf( "mcts %u threads batch %u%s %d nodes %d bad max diff %.3e: "
+                "%s\n",
+                c->threads, c->batch, c->dag ? " dag" : "", nodes, bad,
+                (double)diff, ok ? "OK" : "FAILED" );
+        return ok ? 0 : 1;
+}
+
+/* Returns the most visited child of n, or NULL if none is expanded. */
+MCTSNode *
+most_visited_child( MCTSNode *n )
+{
+        MCTSNode *best = NULL;
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = mcts_node_child( n, col );
+                if ( c != NULL && ( best == NULL ||
+                                    c->total_count > best->total_count ) )
+                        best = c;
+        }
+        return best;
+}
+
+/* A session searching the position two plies (a move and the reply) after its
+ * root must reuse the subtree of that position: same visits, statistics which
+ * add up, and nodes (kept in place or copied) which match the nodes created
+ * from scratch. Then the search tops it up. The session searches a graph if
+ * dag.
+ */
+int
+verify_mcts_session( int dag )
+{
+        int prev_dag = mcts_dag( );
+        mcts_set_dag( dag );
+
+        NN          *nn = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        MCTSSession *s  = mcts_session_new( nn, NULL );
+        Game        *g  = random_game( 4 );
+
+        MCTSNode *root = mcts_session_root( s, g );
+        mcts_run_simulation( root, VERIFY_MCTS_ITER_CNT );
+        MCTSNode *next = most_visited_child( most_visited_child( root ) );
+        assert( next != NULL );
+        Game next_game;
+        mcts_node_game( next, &next_game );
+        int reused = next->total_count;
+
+        int bad = 0;
+        root    = mcts_session_root( s, &next_game );
+        if ( root->total_count != reused ) bad++;
+        if ( mcts_session_root( s, &next_game ) != root ) bad++;
+        f32 diff  = 0.f;
+        int nodes = verify_mcts_nodes( root, nn, dag, &diff, &bad );
+        if ( mcts_tree_stats( root ).nodes != (u64)nodes + 1 ) bad++;
+
+        mcts_run_simulation( root, VERIFY_MCTS_ITER_CNT - reused );
+        bad += verify_mcts_stats( root, dag );
+        if ( root->total_count != VERIFY_MCTS_ITER_CNT ) bad++;
+
+        /* The subtree of the most visited move fills more of the arena. */
+        next = most_visited_child( root );
+        if ( next != NULL ) {
+                mcts_node_game( next, &next_game );
+                int kept = next->total_count;
+                root     = mcts_session_root( s, &next_game );
+                if ( root->total_count != kept ) bad++;
+                bad += verify_mcts_stats( root, dag );
+                int cnt = verify_mcts_nodes( root, nn, dag, &diff, &bad );
+                if ( mcts_tree_stats( root ).nodes != (u64)cnt + 1 ) bad++;
+        }
+
+        mcts_session_free( s );
+        game_free( g );
+        nn_free( nn );
+        mcts_set_dag( prev_dag );
+
+        int ok = bad == 0 && diff <= VERIFY_TOLERANCE;
+        printf( "mcts session%s %d visits reused %d nodes %d bad max diff "
+                "%.3e: %s\n",
+                dag ? " dag" : "", reused, nodes, bad, (double)diff,
+                ok ? "OK" : "FAILED" );
+        return ok ? 0 : 1;
+}
+
+/* Ponder the position after the most visited move of a search, in full and
+ * then stopped, and check the root keeps every pondered visit and the reply
+ * then reuses them.
+ */
+int
+verify_mcts_ponder( void )
+{
+        NN          *nn = nn_new( BIN_DATA_FILE, NN_FLAG_FOLD_BN );
+        MCTSSession *s  = mcts_session_new( nn, NULL );
+        Game        *g  = random_game( 4 );
+
+        MCTSNode *root = mcts_session_root( s, g );
+        mcts_run_simulation( root, VERIFY_MCTS_ITER_CNT );
+        Game moved;
+        mcts_node_game( most_visited_child( root ), &moved );
+        int before = most_visited_child( root )->total_count;
+
+        /* Pondered all, then stopped while pondering or pondered all. */
+        int bad = 0;
+        mcts_session_ponder_start( s, &moved, VERIFY_PONDER_CNT );
+        int pondered = mcts_session_ponder_wait( s );
+        if ( pondered != VERIFY_PONDER_CNT ) bad++;
+        root = mcts_session_root( s, &moved );
+        if ( root->total_count != before + VERIFY_PONDER_CNT ) bad++;
+        bad += verify_mcts_stats( root, mcts_dag( ) );
+
+        mcts_session_ponder_start( s, &moved, VERIFY_MCTS_ITER_CNT );
+        usleep( 100 * 1000 );
+        int stopped = mcts_session_ponder_stop( s );
+        if ( stopped < 0 || stopped > VERIFY_MCTS_ITER_CNT ) bad++;
+        pondered += stopped;
+        mcts_session_ponder_start( s, &moved, 0 );
+        if ( mcts_session_ponder_stop( s ) != 0 ) bad++;
+
+        root = mcts_session_root( s, &moved );
+        if ( root->total_count != before + pondered ) bad++;
+        bad += verify_mcts_stats( root, mcts_dag( ) );
+        MCTSNode *reply = most_visited_child( root );
+        int       reused = reply != NULL ? reply->total_count : 0;
+        if ( reply != NULL ) {
+                Game replied;
+                mcts_node_game( reply, &replied );
+                if ( mcts_session_root( s, &replied )->total_count != reused )
+                        bad++;
+        }
+
+        mcts_session_free( s );
+        game_free( g );
+        nn_free( nn );
+
+        printf( "mcts ponder %d simulations %d visits reused %d bad: %s\n",
+                pondered, reused, bad, bad == 0 ? "OK" : "FAILED" );
+        return bad == 0 ? 0 : 1;
+}
+
+/* Write GRAPH_DATA_FILE and its layer graph, which spells out the default graph
+ * of the reference model with comments and a split repeat count.
+ */
+void
+write_graph_data_file( void )
+{
+        unlink( GRAPH_DATA_FILE );
+        if ( symlink( "tensor_data.bin", GRAPH_DATA_FILE ) != 0 )
+                PANIC( "failed to create %s", GRAPH_DATA_FILE );
+
+        FILE *f = fopen( GRAPH_DATA_FILE ".graph", "w" );
+        if ( f == NULL ) PANIC( "failed to create the layer graph" );
+        fprintf( f, "# Written by verify.\n"
+                    "stem\n"
+                    "block 2\n"
+                    "block 3  # 5 blocks in total\n"
+                    "\n"
+                    "policy_head\n"
+                    "value_head\n" );
+        fclose( f );
+}
+
+/* Convert BIN_DATA_FILE into the v2 data files of the cases. */
+void
+write_v2_data_files( void )
+{
+        nn_save_data( BIN_DATA_FILE, V2_F32_DATA_FILE, NN_DTYPE_F32 );
+        nn_save_data( BIN_DATA_FILE, V2_F16_DATA_FILE, NN_DTYPE_F16 );
+        nn_save_data( BIN_DATA_FILE, V2_BF16_DATA_FILE, NN_DTYPE_BF16 );
+        nn_save_data( BIN_DATA_FILE, V2_I8_DATA_FILE, NN_DTYPE_I8 );
+}
+
+/* === --- Main --------------------------------------------------------- === */
+
+int
+main( void )
+{
+        srand( 123 );
+
+        Tensor *inputs;
+        random_inputs( &inputs );
+        write_graph_data_file( );
+        write_v2_data_files( );
+
+        /* Reference outputs from the reference model, single threaded. */
+        pool_set_thread_cnt( 1 );
+        Tensor *ref_policy;
+        Tensor *ref_value;
+        ref_eval( inputs, &ref_policy, &ref_value );
+
+        /* All cases run single threaded and then on the pool. */
+        int failed       = 0;
+        u32 thread_cnt[] = { 1, VERIFY_THREADS };
+        for ( u32 t = 0; t < 2; t++ ) {
+                pool_set_thread_cnt( thread_cnt[t] );
+                printf( "=== %u thread(s)\n", thread_cnt[t] );
+                for ( size_t i = 0;
+                      i < sizeof( conv2d_cases ) / sizeof( Conv2dCase ); i++ ) {
+                        failed += verify_conv2d_case( &conv2d_cases[i] );
+                }
+                for ( size_t i = 0;
+                      i < sizeof( verify_cases ) / sizeof( VerifyCase ); i++ ) {
+                        failed += verify_case( &verify_cases[i], inputs,
+                                               ref_policy, ref_value );
+                }
+        }
+
+        failed += verify_elementwise( );
+        failed += verify_eval_cache( );
+        failed += verify_stem( );
+        for ( size_t i = 0; i < sizeof( mcts_cases ) / sizeof( MCTSCase );
+              i++ ) {
+                failed += verify_mcts_case( &mcts_cases[i] );
+        }
+        failed += verify_mcts_session( /*dag=*/0 );
+        failed += verify_mcts_session( /*dag=*/1 );
+        failed += verify_mcts_ponder( );
+
+        free_tensor( inputs );
+        free_tensor( ref_policy );
+        free_tensor( ref_value );
+
+        if ( failed ) PANIC( "%d verification case(s) failed", failed );
+        printf( "all verification cases passed\n" );
+        return 0;
+}
@@ -1 +1 @@
-../mk/Makefile.v1
\ No newline at end of file
+../mk/Makefile.v2
\ No newline at end of file
@@ -0,0 +1,387 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nn.h"
+#include "pool.h"
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+/* === Direct conv2d ----------------------------------------------------------
+ *
+ * The conv2d is computed directly, without im2col, as follows
+ *
+ * - The kernel (weight) is repacked once at load time into blocks of
+ *   CONV2D_DIRECT_BLOCK output channels, see conv2d_direct_pack_weight. So all
+ *   output channels of a block for one (C_in, KH, KW) tap are contiguous and
+ *   fit one (AVX-512) or two (AVX2) SIMD registers.
+ * - The input is zero padded (halo) by (K-1)/2 on each side into scratch, so
+ *   the inner loops have no bounds checks.
+ * - Each output pixel of a block accumulates in a SIMD register, with the
+ *   input pixel broadcasted. The result tile (H*W, BLOCK) is then transposed
+ *   into the NCHW output.
+ *
+ * The model shapes (5x5 kernel on 6x7 board) are compile time constants of the
+ * SIMD kernels. Other shapes fall back to the generic kernel, which reads the
+ * same packed kernel.
+ */
+
+#define DIRECT_KS 5 /* Kernel size of the specialized kernels. */
+
+namespace hermes {
+
+namespace {
+
+/* Computes one block of output channels for one sample.
+ *
+ * - tile:  Output (h*w, CONV2D_DIRECT_BLOCK).
+ * - in:    Padded input (c_in, h+ks-1, w+ks-1).
+ * - wt:    Packed kernel of the block (c_in, ks, ks, CONV2D_DIRECT_BLOCK).
+ * - bias:  Bias of the block (CONV2D_DIRECT_BLOCK).
+ */
+typedef void ( *DirectBlockFn )( f32 *tile, const f32 *in, const f32 *wt,
+                                 const f32 *bias, u32 c_in, u32 h, u32 w,
+                                 u32 ks );
+
+void
+conv2d_direct_block_generic( f32 *tile, const f32 *in, const f32 *wt,
+                             const f32 *bias, u32 c_in, u32 h, u32 w, u32 ks )
+{
+        const u32 B  = CONV2D_DIRECT_BLOCK;
+        const u32 ph = h + ks - 1;
+        const u32 pw = w + ks - 1;
+
+        for ( u32 p = 0; p < h * w; p++ ) {
+                for ( u32 j = 0; j < B; j++ ) tile[p * B + j] = bias[j];
+        }
+
+        for ( u32 c = 0; c < c_in; c++ ) {
+                const f32 *in_c = in + c * ph * pw;
+                for ( u32 ky = 0; ky < ks; ky++ ) {
+                        for ( u32 kx = 0; kx < ks; kx++ ) {
+                                const f32 *wv =
+                                    wt + ( ( c * ks + ky ) * ks + kx ) * B;
+                                for ( u32 y = 0; y < h; y++ ) {
+                                        const f32 *in_row =
+                                            in_c + ( y + ky ) * pw + kx;
+                                        f32 *t = tile + y * w * B;
+                                        for ( u32 x = 0; x < w; x++ ) {
+                                                f32 v = in_row[x];
+                                                for ( u32 j = 0; j < B; j++ )
+                                                        t[x * B + j] +=
+                                                            v * wv[j];
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+#if defined( __x86_64__ )
+
+/* AVX-512: One register holds the whole block. Two output rows are computed
+ * together, i.e., 2*W accumulators.
+ */
+template <u32 C_IN, u32 H, u32 W>
+__attribute__( ( target( "avx512f" ) ) ) void
+conv2d_direct_block_avx512( f32 *tile, const f32 *in, const f32 *wt,
+                            const f32 *bias, u32 c_in, u32 h, u32 w, u32 ks )
+{
+        static_assert( CONV2D_DIRECT_BLOCK == 16, "one zmm per block" );
+        static_assert( H % 2 == 0, "two rows at a time" );
+        constexpr u32 KS = DIRECT_KS;
+        constexpr u32 PH = H + KS - 1;
+        constexpr u32 PW = W + KS - 1;
+        assert( c_in == C_IN && h == H && w == W && ks == KS );
+        (void)c_in, (void)h, (void)w, (void)ks;
+
+        const __m512 b = _mm512_loadu_ps( bias );
+        for ( u32 y = 0; y < H; y += 2 ) {
+                __m512 acc[2][W];
+                for ( u32 r = 0; r < 2; r++ ) {
+                        for ( u32 x = 0; x < W; x++ ) acc[r][x] = b;
+                }
+
+                for ( u32 c = 0; c < C_IN; c++ ) {
+                        const f32 *in_c = in + c * PH * PW + y * PW;
+                        const f32 *w_c  = wt + c * KS * KS * 16;
+                        for ( u32 ky = 0; ky < KS; ky++ ) {
+                                for ( u32 kx = 0; kx < KS; kx++ ) {
+                                        __m512 wv = _mm512_loadu_ps(
+                                            w_c + ( ky * KS + kx ) * 16 );
+                                        for ( u32 r = 0; r < 2; r++ ) {
+                                                const f32 *p =
+                                                    in_c + ( r + ky ) * PW + kx;
+                                                for ( u32 x = 0; x < W; x++ ) {
+                                                        acc[r][x] =
+                                                            _mm512_fmadd_ps(
+                                                                _mm512_set1_ps(
+                                                                    p[x] ),
+                                                                wv, acc[r][x] );
+                                                }
+                                        }
+                                }
+                        }
+                }
+
+                for ( u32 r = 0; r < 2; r++ ) {
+                        for ( u32 x = 0; x < W; x++ ) {
+                                _mm512_storeu_ps(
+                                    tile + ( ( y + r ) * W + x ) * 16,
+                                    acc[r][x] );
+                        }
+                }
+        }
+}
+
+/* AVX2: One register holds half of the block. Each half is computed for two
+ * output rows together, i.e., 2*W accumulators, plus one register for the
+ * kernel and one for the broadcasted input.
+ */
+template <u32 C_IN, u32 H, u32 W>
+__attribute__( ( target( "avx2,fma" ) ) ) void
+conv2d_direct_half_avx2( f32 *tile, const f32 *in, const f32 *wt,
+                         const f32 *bias )
+{
+        constexpr u32 KS = DIRECT_KS;
+        constexpr u32 PH = H + KS - 1;
+        constexpr u32 PW = W + KS - 1;
+
+        const __m256 b = _mm256_loadu_ps( bias );
+        for ( u32 y = 0; y < H; y += 2 ) {
+                __m256 acc[2][W];
+                for ( u32 r = 0; r < 2; r++ ) {
+                        for ( u32 x = 0; x < W; x++ ) acc[r][x] = b;
+                }
+
+                for ( u32 c = 0; c < C_IN; c++ ) {
+                        const f32 *in_c = in + c * PH * PW + y * PW;
+                        const f32 *w_c  = wt + c * KS * KS * 16;
+                        for ( u32 ky = 0; ky < KS; ky++ ) {
+                                for ( u32 kx = 0; kx < KS; kx++ ) {
+                                        __m256 wv = _mm256_loadu_ps(
+                                            w_c + ( ky * KS + kx ) * 16 );
+                                        for ( u32 r = 0; r < 2; r++ ) {
+                                                const f32 *p =
+                                                    in_c + ( r + ky ) * PW + kx;
+                                                for ( u32 x = 0; x < W; x++ ) {
+                                                        acc[r][x] =
+                                                            _mm256_fmadd_ps(
+                                                                _mm256_set1_ps(
+                                                                    p[x] ),
+                                                                wv, acc[r][x] );
+                                                }
+                                        }
+                                }
+                        }
+                }
+
+                for ( u32 r = 0; r < 2; r++ ) {
+                        for ( u32 x = 0; x < W; x++ ) {
+                                _mm256_storeu_ps(
+                                    tile + ( ( y + r ) * W + x ) * 16,
+                                    acc[r][x] );
+                        }
+                }
+        }
+}
+
+template <u32 C_IN, u32 H, u32 W>
+void
+conv2d_direct_block_avx2( f32 *tile, const f32 *in, const f32 *wt,
+                          const f32 *bias, u32 c_in, u32 h, u32 w, u32 ks )
+{
+        static_assert( CONV2D_DIRECT_BLOCK == 16, "two ymm per block" );
+        static_assert( H % 2 == 0, "two rows at a time" );
+        assert( c_in == C_IN && h == H && w == W && ks == DIRECT_KS );
+        (void)c_in, (void)h, (void)w, (void)ks;
+
+        conv2d_direct_half_avx2<C_IN, H, W>( tile, in, wt, bias );
+        conv2d_direct_half_avx2<C_IN, H, W>( tile + 8, in, wt + 8, bias + 8 );
+}
+
+#endif  // defined( __x86_64__ )
+
+/* Select the fastest block kernel for the shape and the running CPU. */
+DirectBlockFn
+conv2d_direct_select( u32 c_in, u32 h, u32 w, u32 ks )
+{
+#if defined( __x86_64__ )
+        static const int has_avx512 = __builtin_cpu_supports( "avx512f" );
+        static const int has_avx2 =
+            __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+
+        if ( ks == DIRECT_KS && h == 6 && w == 7 ) {
+                if ( has_avx512 ) {
+                        if ( c_in == 128 )
+                                return conv2d_direct_block_avx512<128, 6, 7>;
+                        if ( c_in == 3 )
+                                return conv2d_direct_block_avx512<3, 6, 7>;
+                }
+                if ( has_avx2 ) {
+                        if ( c_in == 128 )
+                                return conv2d_direct_block_avx2<128, 6, 7>;
+                        if ( c_in == 3 )
+                                return conv2d_direct_block_avx2<3, 6, 7>;
+                }
+        }
+#else
+        (void)c_in, (void)h, (void)w, (void)ks;
+#endif
+        return conv2d_direct_block_generic;
+}
+
+/* Zero pad one input sample (c_in, h, w) into (c_in, h+2*pad, w+2*pad). */
+void
+conv2d_direct_pad( f32 *dst, const f32 *src, u32 c_in, u32 h, u32 w, u32 pad )
+{
+        u32 ph = h + 2 * pad;
+        u32 pw = w + 2 * pad;
+        memset( dst, 0, sizeof( f32 ) * c_in * ph * pw );
+        for ( u32 c = 0; c < c_in; c++ ) {
+                for ( u32 y = 0; y < h; y++ ) {
+                        memcpy( dst + ( c * ph + y + pad ) * pw + pad,
+                                src + ( c * h + y ) * w, sizeof( f32 ) * w );
+                }
+        }
+}
+
+/* A parallel conv2d_direct splits (block, sample) items, see
+ * conv2d_direct_task_run. */
+typedef struct {
+        DirectBlockFn       fn;
+        u32                 batch, c_in, c_out, h, w, ks;
+        u32                 padded_size;
+        const f32          *padded; /* All padded samples. */
+        f32                *tiles;  /* One tile per chunk. */
+        const f32          *weight;
+        const f32          *bias;
+        const ConvEpilogue *ep;
+        f32                *out;
+} DirectTask;
+
+void
+conv2d_direct_task_run( void *ctx, u32 chunk, u32 begin, u32 end )
+{
+        DirectTask *t    = (DirectTask *)ctx;
+        const u32   B    = CONV2D_DIRECT_BLOCK;
+        const u32   hw   = t->h * t->w;
+        f32        *tile = t->tiles + chunk * hw * B;
+
+        /* Items are block major, so the packed kernel of one block stays in
+         * cache for the whole batch. */
+        for ( u32 i = begin; i < end; i++ ) {
+                u32        ob = i / t->batch;
+                u32        b  = i % t->batch;
+                const f32 *wt = t->weight + ob * t->c_in * t->ks * t->ks * B;
+                t->fn( tile, t->padded + b * t->padded_size, wt,
+                       t->bias + ob * B, t->c_in, t->h, t->w, t->ks );
+
+                /* Transpose (h*w, B) tile into NCHW output, with the
+                 * epilogue. */
+                u32 offset = ( b * t->c_out + ob * B ) * hw;
+                for ( u32 j = 0; j < B; j++ ) {
+                        conv2d_epilogue( t->out + offset + j * hw, tile + j, B,
+                                         hw, ob * B + j, offset + j * hw,
+                                         t->ep );
+                }
+        }
+}
+
+}  // namespace
+
+int
+conv2d_direct_packable( Tensor *weight )
+{
+        return weight->dim == 4 &&
+               weight->shape[0] % CONV2D_DIRECT_BLOCK == 0 &&
+               weight->shape[2] == weight->shape[3] &&
+               weight->shape[2] % 2 == 1;
+}
+
+void
+conv2d_direct_pack_weight( Tensor *weight )
+{
+        assert( conv2d_direct_packable( weight ) );
+        const u32 B     = CONV2D_DIRECT_BLOCK;
+        u32       c_out = weight->shape[0];
+        u32       taps  = weight->ele_total / c_out; /* C_in * KH * KW */
+
+        f32 *packed = (f32 *)malloc( sizeof( f32 ) * weight->ele_total );
+        assert( packed != NULL );
+
+        /* (C_out, taps) -> (C_out/B, taps, B) */
+        for ( u32 o = 0; o < c_out; o++ ) {
+                f32 *dst = packed + ( o / B ) * taps * B + o % B;
+                f32 *src = weight->data + o * taps;
+                for ( u32 t = 0; t < taps; t++ ) {
+                        dst[t * B] = src[t];
+                }
+        }
+        memcpy( weight->data, packed, sizeof( f32 ) * weight->ele_total );
+        free( packed );
+}
+
+void
+conv2d_direct( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+               Tensor *scratch, const ConvEpilogue *ep )
+{
+        if ( !conv2d_direct_packable( weight ) ) {
+                conv2d_naive( dst, input, weight, bias, scratch, ep );
+                return;
+        }
+
+        assert( input->dim == 4 );
+        assert( bias->dim == 1 );
+        assert( input->shape[1] == weight->shape[1] );
+        assert( weight->shape[0] == bias->shape[0] );
+
+        const u32 B     = CONV2D_DIRECT_BLOCK;
+        u32       batch = input->shape[0];
+        u32       c_in  = input->shape[1];
+        u32       c_out = weight->shape[0];
+        u32       h     = input->shape[2];
+        u32       w     = input->shape[3];
+        u32       ks    = weight->shape[2];
+        u32       pad   = ( ks - 1 ) / 2;
+
+        u32 shape[] = { batch, c_out, h, w };
+        prepare_tensor( dst, 4, shape );
+
+        /* Scratch holds all padded samples followed by one tile per chunk. */
+        u32     padded_size = c_in * ( h + 2 * pad ) * ( w + 2 * pad );
+        Tensor *buf         = scratch;
+        u32     buf_shape[] = { batch * padded_size +
+                                POOL_MAX_THREADS * h * w * B };
+        prepare_tensor( &buf, 1, buf_shape );
+
+        for ( u32 b = 0; b < batch; b++ ) {
+                conv2d_direct_pad( buf->data + b * padded_size,
+                                   input->data + b * c_in * h * w, c_in, h, w,
+                                   pad );
+        }
+
+        DirectTask task = {
+            conv2d_direct_select( c_in, h, w, ks ),
+            batch,
+            c_in,
+            c_out,
+            h,
+            w,
+            ks,
+            padded_size,
+            buf->data,
+            buf->data + batch * padded_size,
+            weight->data,
+            bias->data,
+            ep,
+            ( *dst )->data,
+        };
+        pool_run( c_out / B * batch, conv2d_direct_task_run, &task );
+
+        if ( scratch == NULL ) free_tensor( buf );
+}
+
+}  // namespace hermes
@@ -0,0 +1,416 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nn.h"
+#include "pool.h"
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+/* === INT8 conv2d ------------------------------------------------------------
+ *
+ * The conv2d is computed as im2col plus an INT8 matmul as follows
+ *
+ * - The kernel is quantised once (offline or at load time) to INT8 with one
+ *   symmetric scale per output channel, see qconv_quantize. Each row (C_in *
+ *   KH * KW) is zero padded to k_pad, a multiple of QCONV_K_ALIGN.
+ * - The input must be non-negative, which holds for the model as all conv2d
+ *   inputs are either the board planes (0 or 1) or relu outputs. So each
+ *   sample is quantised to UINT8 with one scale (max/255), without zero point.
+ * - The UINT8 im2col rows and INT8 kernel rows are multiplied with INT32
+ *   accumulation, in tiles of QCONV_TILE_O output channels x QCONV_TILE_P
+ *   pixels (VNNI vpdpbusd, AVX2 vpmaddwd or scalar, dispatched at runtime).
+ * - Each accumulator is requantised to f32 by the two scales and the bias,
+ *   into a span of up to QCONV_SPAN pixels of one sample per output channel,
+ *   and the epilogue is applied to each span at once. So the output and all
+ *   other layers stay in f32.
+ *
+ * The INT8 kernel of a 128x128x5x5 conv2d is 400KB, vs 1.6MB in f32, so the
+ * kernels of the resnet blocks stay in L2.
+ */
+
+#define QCONV_TILE_O 4 /* Output channels per tile. */
+#define QCONV_TILE_P 3 /* Pixels (im2col rows) per tile. */
+#define QCONV_SPAN   ( 21 * QCONV_TILE_P ) /* Pixels per epilogue call. */
+
+namespace hermes {
+
+namespace {
+
+/* Computes the tile acc (QCONV_TILE_O, QCONV_TILE_P) of INT32 dot products.
+ *
+ * - wt:   QCONV_TILE_O kernel rows, each k_pad INT8 and ldw apart.
+ * - rows: QCONV_TILE_P im2col rows, each k_pad UINT8.
+ */
+typedef void ( *QConvTileFn )( i32 *acc, const i8 *wt, u32 ldw,
+                               const u8 *const *rows, u32 k_pad );
+
+void
+qconv_tile_generic( i32 *acc, const i8 *wt, u32 ldw, const u8 *const *rows,
+                    u32 k_pad )
+{
+        for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        const i8 *w = wt + o * ldw;
+                        const u8 *r = rows[p];
+                        i32       s = 0;
+                        for ( u32 k = 0; k < k_pad; k++ ) {
+                                s += (i32)r[k] * (i32)w[k];
+                        }
+                        acc[o * QCONV_TILE_P + p] = s;
+                }
+        }
+}
+
+#if defined( __x86_64__ )
+
+/* VNNI: vpdpbusd multiplies 4 UINT8 x INT8 pairs and accumulates into INT32,
+ * 64 bytes per instruction. */
+__attribute__( ( target( "avx512f,avx512bw,avx512vnni" ) ) ) void
+qconv_tile_vnni( i32 *acc, const i8 *wt, u32 ldw, const u8 *const *rows,
+                 u32 k_pad )
+{
+        __m512i s[QCONV_TILE_O][QCONV_TILE_P];
+        for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        s[o][p] = _mm512_setzero_si512( );
+                }
+        }
+
+        for ( u32 k = 0; k < k_pad; k += 64 ) {
+                __m512i a[QCONV_TILE_P];
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        a[p] = _mm512_loadu_si512( rows[p] + k );
+                }
+                for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                        __m512i w = _mm512_loadu_si512( wt + o * ldw + k );
+                        for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                                s[o][p] = _mm512_dpbusd_epi32( s[o][p], a[p],
+                                                               w );
+                        }
+                }
+        }
+
+        for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        acc[o * QCONV_TILE_P + p] =
+                            _mm512_reduce_add_epi32( s[o][p] );
+                }
+        }
+}
+
+/* AVX2: Both operands are widened to INT16 and vpmaddwd accumulates pairs into
+ * INT32, 16 bytes per instruction. vpmaddubsw is not used as its INT16
+ * saturation is hit by 255 x 127 x 2. */
+__attribute__( ( target( "avx2" ) ) ) void
+qconv_tile_avx2( i32 *acc, const i8 *wt, u32 ldw, const u8 *const *rows,
+                 u32 k_pad )
+{
+        __m256i s[QCONV_TILE_O][QCONV_TILE_P];
+        for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        s[o][p] = _mm256_setzero_si256( );
+                }
+        }
+
+        for ( u32 k = 0; k < k_pad; k += 16 ) {
+                __m256i a[QCONV_TILE_P];
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        a[p] = _mm256_cvtepu8_epi16( _mm_loadu_si128(
+                            (const __m128i *)( rows[p] + k ) ) );
+                }
+                for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                        __m256i w = _mm256_cvtepi8_epi16( _mm_loadu_si128(
+                            (const __m128i *)( wt + o * ldw + k ) ) );
+                        for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                                s[o][p] = _mm256_add_epi32(
+                                    s[o][p], _mm256_madd_epi16( a[p], w ) );
+                        }
+                }
+        }
+
+        for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        __m128i v = _mm_add_epi32(
+                            _mm256_castsi256_si128( s[o][p] ),
+                            _mm256_extracti128_si256( s[o][p], 1 ) );
+                        v = _mm_add_epi32( v, _mm_shuffle_epi32( v, 0x4e ) );
+                        v = _mm_add_epi32( v, _mm_shuffle_epi32( v, 0xb1 ) );
+                        acc[o * QCONV_TILE_P + p] = _mm_cvtsi128_si32( v );
+                }
+        }
+}
+
+#endif  // defined( __x86_64__ )
+
+/* Select the tile kernel for the running CPU. */
+QConvTileFn
+qconv_select( void )
+{
+#if defined( __x86_64__ )
+        static const int has_vnni = __builtin_cpu_supports( "avx512vnni" ) &&
+                                    __builtin_cpu_supports( "avx512bw" );
+        static const int has_avx2 = __builtin_cpu_supports( "avx2" );
+        if ( has_vnni ) return qconv_tile_vnni;
+        if ( has_avx2 ) return qconv_tile_avx2;
+#endif
+        return qconv_tile_generic;
+}
+
+/* Quantise one input sample (c_in, h, w) to UINT8 and fill its im2col rows
+ * (h*w, k_pad). Returns the scale.
+ *
+ * qin is the temporary space for the quantised sample.
+ */
+f32
+qconv_im2col( u8 *col, u8 *qin, const f32 *in, u32 c_in, u32 h, u32 w,
+              u32 kh, u32 kw, u32 k_pad )
+{
+        u32 size = c_in * h * w;
+        f32 max  = 0.f;
+        for ( u32 i = 0; i < size; i++ ) {
+                assert( in[i] >= 0.f );
+                if ( in[i] > max ) max = in[i];
+        }
+        f32 scale = max > 0.f ? max / 255.f : 1.f;
+        f32 inv   = 1.f / scale;
+        for ( u32 i = 0; i < size; i++ ) {
+                f32 v  = in[i] * inv + 0.5f;
+                qin[i] = v >= 255.f ? (u8)255 : (u8)v;
+        }
+
+        i32 half_kh = (i32)( kh - 1 ) / 2;
+        i32 half_kw = (i32)( kw - 1 ) / 2;
+        for ( u32 y = 0; y < h; y++ ) {
+                for ( u32 x = 0; x < w; x++ ) {
+                        u8 *row = col + ( y * w + x ) * k_pad;
+                        memset( row, 0, k_pad );
+                        for ( u32 c = 0; c < c_in; c++ ) {
+                                for ( i32 ky = -half_kh; ky <= half_kh; ky++ ) {
+                                        i32 iy = (i32)y + ky;
+                                        if ( iy < 0 || iy >= (i32)h ) {
+                                                row += kw;
+                                                continue;
+                                        }
+                                        for ( i32 kx = -half_kw; kx <= half_kw;
+                                              kx++ ) {
+                                                i32 ix = (i32)x + kx;
+                                                if ( ix >= 0 && ix < (i32)w )
+                                                        *row = qin[( c * h +
+                                                                     (u32)iy ) *
+                                                                       w +
+                                                                   (u32)ix];
+                                                row++;
+                                        }
+                                }
+                        }
+                }
+        }
+        return scale;
+}
+
+/* A parallel conv2d_int8 splits the tiles of QCONV_TILE_O output channels, see
+ * qconv_task_run. */
+typedef struct {
+        QConvTileFn         fn;
+        QConv              *q;
+        const f32          *bias;
+        const ConvEpilogue *ep;
+        const u8           *col;     /* im2col matrix (rows, k_pad). */
+        const f32          *a_scale; /* Scale of each sample. */
+        u32                 rows;    /* N * hw. */
+        u32                 hw;
+        f32                *out;
+} QConvTask;
+
+/* Compute n (<= QCONV_SPAN) pixels from s0 of sample b for the QCONV_TILE_O
+ * output channels from o0, requantised with the bias into span.
+ */
+void
+qconv_span( QConvTask *t, u32 o0, u32 b, u32 s0, u32 n,
+            f32 span[QCONV_TILE_O][QCONV_SPAN] )
+{
+        QConv    *q     = t->q;
+        u32       k_pad = q->k_pad;
+        u32       hw    = t->hw;
+        const i8 *wt    = q->weight + (size_t)o0 * k_pad;
+        const u8 *col   = t->col + (size_t)b * hw * k_pad;
+        i32       acc[QCONV_TILE_O * QCONV_TILE_P];
+
+        f32 scale[QCONV_TILE_O];
+        for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                scale[o] = t->a_scale[b] * q->scale[o0 + o];
+        }
+
+        for ( u32 p0 = 0; p0 < n; p0 += QCONV_TILE_P ) {
+                /* The last tile of the sample repeats its last row, and drops
+                 * the result. */
+                const u8 *r[QCONV_TILE_P];
+                for ( u32 p = 0; p < QCONV_TILE_P; p++ ) {
+                        u32 pix = s0 + p0 + p < hw ? s0 + p0 + p : hw - 1;
+                        r[p]    = col + (size_t)pix * k_pad;
+                }
+                t->fn( acc, wt, k_pad, r, k_pad );
+
+                u32 cnt = n - p0 < QCONV_TILE_P ? n - p0 : QCONV_TILE_P;
+                for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                        for ( u32 p = 0; p < cnt; p++ ) {
+                                span[o][p0 + p] =
+                                    (f32)acc[o * QCONV_TILE_P + p] * scale[o] +
+                                    t->bias[o0 + o];
+                        }
+                }
+        }
+}
+
+void
+qconv_task_run( void *ctx, u32 chunk, u32 begin, u32 end )
+{
+        (void)chunk;
+        QConvTask *t     = (QConvTask *)ctx;
+        u32        c_out = t->q->c_out;
+        u32        hw    = t->hw;
+        u32        batch = t->rows / hw;
+        f32        span[QCONV_TILE_O][QCONV_SPAN];
+
+        for ( u32 o0 = begin * QCONV_TILE_O; o0 < end * QCONV_TILE_O;
+              o0 += QCONV_TILE_O ) {
+                for ( u32 b = 0; b < batch; b++ ) {
+                        for ( u32 s0 = 0; s0 < hw; s0 += QCONV_SPAN ) {
+                                u32 n = hw - s0 < QCONV_SPAN ? hw - s0
+                                                             : QCONV_SPAN;
+                                qconv_span( t, o0, b, s0, n, span );
+
+                                /* Into the NCHW output, with the epilogue. */
+                                for ( u32 o = 0; o < QCONV_TILE_O; o++ ) {
+                                        size_t offset =
+                                            ( (size_t)b * c_out + o0 + o ) *
+                                                hw +
+                                            s0;
+                                        conv2d_epilogue( t->out + offset,
+                                                         span[o], 1, n, o0 + o,
+                                                         offset, t->ep );
+                                }
+                        }
+                }
+        }
+}
+
+}  // namespace
+
+int
+qconv_quantizable( Tensor *weight )
+{
+        return weight->dim == 4 && weight->shape[0] >= QCONV_MIN_C_OUT &&
+               weight->shape[0] % QCONV_TILE_O == 0 &&
+               weight->shape[2] % 2 == 1 && weight->shape[3] % 2 == 1;
+}
+
+QConv *
+qconv_new( u32 c_out, u32 c_in, u32 kh, u32 kw )
+{
+        QConv *q = (QConv *)malloc( sizeof( *q ) );
+        assert( q != NULL );
+        q->c_out = c_out;
+        q->c_in  = c_in;
+        q->kh    = kh;
+        q->kw    = kw;
+        u32 k    = c_in * kh * kw;
+        q->k_pad = ( k + QCONV_K_ALIGN - 1 ) / QCONV_K_ALIGN * QCONV_K_ALIGN;
+
+        q->weight = (i8 *)calloc( (size_t)c_out * q->k_pad, sizeof( i8 ) );
+        q->scale  = (f32 *)calloc( c_out, sizeof( f32 ) );
+        assert( q->weight != NULL && q->scale != NULL );
+        return q;
+}
+
+void
+qconv_free( QConv *q )
+{
+        if ( q == NULL ) return;
+        free( q->weight );
+        free( q->scale );
+        free( q );
+}
+
+QConv *
+qconv_quantize( Tensor *weight )
+{
+        assert( qconv_quantizable( weight ) );
+        QConv *q = qconv_new( weight->shape[0], weight->shape[1],
+                              weight->shape[2], weight->shape[3] );
+        u32    k = q->c_in * q->kh * q->kw;
+
+        for ( u32 o = 0; o < q->c_out; o++ ) {
+                const f32 *src = weight->data + o * k;
+                f32        max = 0.f;
+                for ( u32 i = 0; i < k; i++ ) {
+                        if ( fabsf( src[i] ) > max ) max = fabsf( src[i] );
+                }
+                f32 scale   = max > 0.f ? max / 127.f : 1.f;
+                q->scale[o] = scale;
+
+                i8 *dst = q->weight + o * q->k_pad;
+                for ( u32 i = 0; i < k; i++ ) {
+                        f32 v = roundf( src[i] / scale );
+                        if ( v > 127.f ) v = 127.f;
+                        if ( v < -127.f ) v = -127.f;
+                        dst[i] = (i8)v;
+                }
+        }
+        return q;
+}
+
+void
+conv2d_int8( Tensor **dst, Tensor *input, QConv *q, Tensor *bias,
+             Tensor *scratch, const ConvEpilogue *ep )
+{
+        assert( input->dim == 4 );
+        assert( bias->dim == 1 );
+        assert( input->shape[1] == q->c_in );
+        assert( q->c_out == bias->shape[0] );
+        assert( q->c_out % QCONV_TILE_O == 0 );
+
+        u32 batch = input->shape[0];
+        u32 c_in  = q->c_in;
+        u32 c_out = q->c_out;
+        u32 h     = input->shape[2];
+        u32 w     = input->shape[3];
+        u32 hw    = h * w;
+        u32 k_pad = q->k_pad;
+
+        u32 shape[] = { batch, c_out, h, w };
+        prepare_tensor( dst, 4, shape );
+
+        /* Scratch layout: batch f32 scales, then the quantised sample (c_in *
+         * hw UINT8), then the im2col matrix (batch * hw, k_pad) UINT8. */
+        size_t  bytes = (size_t)c_in * hw + (size_t)batch * hw * k_pad;
+        u32     total = batch + (u32)( ( bytes + sizeof( f32 ) - 1 ) /
+                                       sizeof( f32 ) );
+        Tensor *buf   = scratch;
+        u32     buf_shape[] = { total };
+        prepare_tensor( &buf, 1, buf_shape );
+
+        f32 *a_scale = buf->data;
+        u8  *qin     = (u8 *)( buf->data + batch );
+        u8  *col     = qin + c_in * hw;
+
+        for ( u32 b = 0; b < batch; b++ ) {
+                a_scale[b] = qconv_im2col( col + (size_t)b * hw * k_pad, qin,
+                                           input->data + b * c_in * hw, c_in,
+                                           h, w, q->kh, q->kw, k_pad );
+        }
+
+        QConvTask task = {
+            qconv_select( ), q, bias->data, ep, col, a_scale, batch * hw, hw,
+            ( *dst )->data,
+        };
+        pool_run( c_out / QCONV_TILE_O, qconv_task_run, &task );
+
+        if ( scratch == NULL ) free_tensor( buf );
+}
+
+}  // namespace hermes
@@ -0,0 +1,299 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "nn.h"
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+/* === Elementwise ops --------------------------------------------------------
+ *
+ * relu, add, softmax, tanh and the conv2d epilogue.
+ *
+ * - relu, add and the epilogue are branch free loops, which the compiler
+ *   vectorises.
+ * - exp (softmax and tanh) is approximated by range reduction and a polynomial
+ *   rather than calling expf, see exp_generic. The same approximation runs on
+ *   8 lanes with AVX2, dispatched at runtime, and the scalar one handles the
+ *   tails and other CPUs.
+ */
+
+/* exp(x) = 2^k * exp(r), with k = round(x * log2(e)) and r = x - k * ln(2) in
+ * [-ln(2)/2, ln(2)/2]. ln(2) is split into EXP_LN2_HI (exact in a few bits)
+ * and EXP_LN2_LO, so r has no cancellation error. exp(r) is the Cephes
+ * polynomial, whose relative error is about 1e-7. x is clamped so 2^k stays a
+ * normal f32.
+ */
+#define EXP_MIN    -87.f
+#define EXP_MAX    88.f
+#define EXP_LOG2E  1.44269504088896341f
+#define EXP_LN2_HI 0.693359375f
+#define EXP_LN2_LO -2.12194440e-4f
+#define EXP_P0     1.9875691500e-4f
+#define EXP_P1     1.3981999507e-3f
+#define EXP_P2     8.3334519073e-3f
+#define EXP_P3     4.1665795894e-2f
+#define EXP_P4     1.6666665459e-1f
+#define EXP_P5     5.0000001201e-1f
+
+namespace hermes {
+
+namespace {
+
+f32
+exp_generic( f32 x )
+{
+        x = fminf( fmaxf( x, EXP_MIN ), EXP_MAX );
+
+        f32 k = floorf( x * EXP_LOG2E + 0.5f );
+        f32 r = x - k * EXP_LN2_HI - k * EXP_LN2_LO;
+
+        f32 p = EXP_P0;
+        p     = p * r + EXP_P1;
+        p     = p * r + EXP_P2;
+        p     = p * r + EXP_P3;
+        p     = p * r + EXP_P4;
+        p     = p * r + EXP_P5;
+        p     = p * r * r + r + 1.f;
+
+        /* 2^k by the exponent bits. */
+        i32 bits = ( (i32)k + 127 ) << 23;
+        f32 scale;
+        memcpy( &scale, &bits, sizeof( scale ) );
+        return p * scale;
+}
+
+/* tanh(x) = sign(x) * (1 - t) / (1 + t), with t = exp(-2|x|) in (0, 1]. The
+ * absolute error is about 1e-7.
+ */
+f32
+tanh_generic( f32 x )
+{
+        f32 t = exp_generic( -2.f * fabsf( x ) );
+        return copysignf( ( 1.f - t ) / ( 1.f + t ), x );
+}
+
+void
+softmax_row_generic( f32 *ptr, u32 n )
+{
+        f32 max = ptr[0];
+        for ( u32 i = 1; i < n; i++ ) {
+                if ( ptr[i] > max ) max = ptr[i];
+        }
+        f32 total = 0.f;
+        for ( u32 i = 0; i < n; i++ ) {
+                ptr[i] = exp_generic( ptr[i] - max );
+                total += ptr[i];
+        }
+        f32 inv = 1.f / total;
+        for ( u32 i = 0; i < n; i++ ) {
+                ptr[i] *= inv;
+        }
+}
+
+void
+tanh_generic_n( f32 *ptr, u32 n )
+{
+        for ( u32 i = 0; i < n; i++ ) {
+                ptr[i] = tanh_generic( ptr[i] );
+        }
+}
+
+#if defined( __x86_64__ )
+
+/* The same steps as exp_generic on 8 lanes. */
+__attribute__( ( target( "avx2,fma" ) ) ) __m256
+exp_avx2( __m256 x )
+{
+        x = _mm256_min_ps( _mm256_max_ps( x, _mm256_set1_ps( EXP_MIN ) ),
+                           _mm256_set1_ps( EXP_MAX ) );
+
+        __m256 k = _mm256_floor_ps( _mm256_fmadd_ps(
+            x, _mm256_set1_ps( EXP_LOG2E ), _mm256_set1_ps( 0.5f ) ) );
+        __m256 r = _mm256_fnmadd_ps( k, _mm256_set1_ps( EXP_LN2_HI ), x );
+        r        = _mm256_fnmadd_ps( k, _mm256_set1_ps( EXP_LN2_LO ), r );
+
+        __m256 p = _mm256_set1_ps( EXP_P0 );
+
+        p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( EXP_P1 ) );
+        p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( EXP_P2 ) );
+        p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( EXP_P3 ) );
+        p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( EXP_P4 ) );
+        p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( EXP_P5 ) );
+        p = _mm256_fmadd_ps( p, _mm256_mul_ps( r, r ),
+                             _mm256_add_ps( r, _mm256_set1_ps( 1.f ) ) );
+
+        __m256i e    = _mm256_add_epi32( _mm256_cvtps_epi32( k ),
+                                         _mm256_set1_epi32( 127 ) );
+        __m256i bits = _mm256_slli_epi32( e, 23 );
+        return _mm256_mul_ps( p, _mm256_castsi256_ps( bits ) );
+}
+
+__attribute__( ( target( "avx2,fma" ) ) ) void
+softmax_row_avx2( f32 *ptr, u32 n )
+{
+        u32 n8 = n / 8 * 8;
+
+        __m256 vmax = _mm256_set1_ps( ptr[0] );
+        for ( u32 i = 0; i < n8; i += 8 ) {
+                vmax = _mm256_max_ps( vmax, _mm256_loadu_ps( ptr + i ) );
+        }
+        f32 lanes[8];
+        _mm256_storeu_ps( lanes, vmax );
+        f32 max = lanes[0];
+        for ( u32 i = 1; i < 8; i++ ) {
+                if ( lanes[i] > max ) max = lanes[i];
+        }
+        for ( u32 i = n8; i < n; i++ ) {
+                if ( ptr[i] > max ) max = ptr[i];
+        }
+
+        __m256 vsum = _mm256_setzero_ps( );
+        vmax        = _mm256_set1_ps( max );
+        for ( u32 i = 0; i < n8; i += 8 ) {
+                __m256 v = exp_avx2(
+                    _mm256_sub_ps( _mm256_loadu_ps( ptr + i ), vmax ) );
+                _mm256_storeu_ps( ptr + i, v );
+                vsum = _mm256_add_ps( vsum, v );
+        }
+        _mm256_storeu_ps( lanes, vsum );
+        f32 total = 0.f;
+        for ( u32 i = 0; i < 8; i++ ) {
+                total += lanes[i];
+        }
+        for ( u32 i = n8; i < n; i++ ) {
+                ptr[i] = exp_generic( ptr[i] - max );
+                total += ptr[i];
+        }
+
+        f32    inv  = 1.f / total;
+        __m256 vinv = _mm256_set1_ps( inv );
+        for ( u32 i = 0; i < n8; i += 8 ) {
+                _mm256_storeu_ps( ptr + i,
+                                  _mm256_mul_ps( _mm256_loadu_ps( ptr + i ),
+                                                 vinv ) );
+        }
+        for ( u32 i = n8; i < n; i++ ) {
+                ptr[i] *= inv;
+        }
+}
+
+__attribute__( ( target( "avx2,fma" ) ) ) void
+tanh_avx2( f32 *ptr, u32 n )
+{
+        const __m256 sign = _mm256_set1_ps( -0.f );
+        const __m256 one  = _mm256_set1_ps( 1.f );
+
+        u32 n8 = n / 8 * 8;
+        for ( u32 i = 0; i < n8; i += 8 ) {
+                __m256 x   = _mm256_loadu_ps( ptr + i );
+                __m256 abs = _mm256_andnot_ps( sign, x );
+                __m256 t   = exp_avx2(
+                    _mm256_mul_ps( abs, _mm256_set1_ps( -2.f ) ) );
+                __m256 y   = _mm256_div_ps( _mm256_sub_ps( one, t ),
+                                            _mm256_add_ps( one, t ) );
+                _mm256_storeu_ps(
+                    ptr + i, _mm256_or_ps( y, _mm256_and_ps( sign, x ) ) );
+        }
+        tanh_generic_n( ptr + n8, n - n8 );
+}
+
+#endif  // defined( __x86_64__ )
+
+typedef void ( *RowFn )( f32 *ptr, u32 n );
+
+/* Select the softmax (per row) and tanh kernels for the running CPU. */
+void
+elementwise_select( RowFn *softmax_row, RowFn *tanh_n )
+{
+#if defined( __x86_64__ )
+        static const int has_avx2 =
+            __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+        if ( has_avx2 ) {
+                *softmax_row = softmax_row_avx2;
+                *tanh_n      = tanh_avx2;
+                return;
+        }
+#endif
+        *softmax_row = softmax_row_generic;
+        *tanh_n      = tanh_generic_n;
+}
+
+}  // namespace
+
+void
+relu_inplace( Tensor *t )
+{
+        u32  size = t->ele_total;
+        f32 *ptr  = t->data;
+        for ( u32 i = 0; i < size; i++ ) {
+                ptr[i] = ptr[i] > 0.f ? ptr[i] : 0.f;
+        }
+}
+
+void
+add_inplace( Tensor *dst, Tensor *src )
+{
+        assert( dst->ele_total == src->ele_total );
+        u32        size = dst->ele_total;
+        f32       *d    = dst->data;
+        const f32 *s    = src->data;
+        for ( u32 i = 0; i < size; i++ ) {
+                d[i] += s[i];
+        }
+}
+
+void
+softmax_inplace( Tensor *dst )
+{
+        assert( dst->dim == 2 );
+        RowFn softmax_row, tanh_n;
+        elementwise_select( &softmax_row, &tanh_n );
+
+        u32 ele_cnt = dst->shape[1];
+        for ( u32 b = 0; b < dst->shape[0]; b++ ) {
+                softmax_row( dst->data + b * ele_cnt, ele_cnt );
+        }
+}
+
+void
+tanh_inplace( Tensor *dst )
+{
+        RowFn softmax_row, tanh_n;
+        elementwise_select( &softmax_row, &tanh_n );
+        tanh_n( dst->data, dst->ele_total );
+}
+
+void
+conv2d_epilogue( f32 *dst, const f32 *src, u32 stride, u32 n, u32 c,
+                 size_t offset, const ConvEpilogue *ep )
+{
+        if ( ep == NULL ) {
+                if ( dst == src ) return;
+                for ( u32 i = 0; i < n; i++ ) {
+                        dst[i] = src[i * stride];
+                }
+                return;
+        }
+
+        f32        scale = ep->scale != NULL ? ep->scale[c] : 1.f;
+        f32        shift = ep->scale != NULL ? ep->shift[c] : 0.f;
+        int        relu  = ep->relu;
+        const f32 *res   = ep->residual != NULL ? ep->residual + offset : NULL;
+
+        if ( res != NULL ) {
+                for ( u32 i = 0; i < n; i++ ) {
+                        f32 v  = src[i * stride] * scale + shift + res[i];
+                        dst[i] = relu && v < 0.f ? 0.f : v;
+                }
+        } else {
+                for ( u32 i = 0; i < n; i++ ) {
+                        f32 v  = src[i * stride] * scale + shift;
+                        dst[i] = relu && v < 0.f ? 0.f : v;
+                }
+        }
+}
+
+}  // namespace hermes
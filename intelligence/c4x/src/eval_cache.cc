@@ -0,0 +1,122 @@
+#include "eval_cache.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+namespace hermes {
+
+namespace {
+
+typedef struct {
+        u64  key; /* 0 if empty, as game_key is never 0. */
+        Eval eval;
+} EvalEntry;
+
+/* Slots i with i % EVAL_CACHE_SHARDS == s belong to shard s. */
+typedef struct {
+        pthread_mutex_t mu;
+        EvalCacheStats  stats;
+} EvalShard;
+
+/* Mix the bits of the key (splitmix64 finalizer), as game_key packs the
+ * columns into the low bits and most positions differ in a few of them.
+ */
+u64
+eval_cache_hash( u64 key )
+{
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        key ^= key >> 31;
+        return key;
+}
+
+}  // namespace
+
+struct EvalCache {
+        u32        mask; /* Number of slots - 1. */
+        EvalEntry *entries;
+        EvalShard  shards[EVAL_CACHE_SHARDS];
+};
+
+EvalCache *
+eval_cache_new( u32 size )
+{
+        u32 cap = EVAL_CACHE_SHARDS;
+        while ( cap < size ) cap <<= 1;
+
+        EvalCache *c = (EvalCache *)malloc( sizeof( *c ) );
+        assert( c != NULL );
+        c->mask    = cap - 1;
+        c->entries = (EvalEntry *)calloc( cap, sizeof( EvalEntry ) );
+        assert( c->entries != NULL );
+        for ( u32 i = 0; i < EVAL_CACHE_SHARDS; i++ ) {
+                pthread_mutex_init( &c->shards[i].mu, NULL );
+                c->shards[i].stats = EvalCacheStats{ };
+        }
+        return c;
+}
+
+void
+eval_cache_free( EvalCache *c )
+{
+        if ( c == NULL ) return;
+        for ( u32 i = 0; i < EVAL_CACHE_SHARDS; i++ ) {
+                pthread_mutex_destroy( &c->shards[i].mu );
+        }
+        free( c->entries );
+        free( c );
+}
+
+int
+eval_cache_get( EvalCache *c, u64 key, Eval *out )
+{
+        assert( key != 0 );
+        u32        slot  = (u32)eval_cache_hash( key ) & c->mask;
+        EvalShard *shard = &c->shards[slot % EVAL_CACHE_SHARDS];
+        EvalEntry *e     = &c->entries[slot];
+
+        pthread_mutex_lock( &shard->mu );
+        int hit = e->key == key;
+        if ( hit ) *out = e->eval;
+        shard->stats.lookups++;
+        if ( hit ) shard->stats.hits++;
+        pthread_mutex_unlock( &shard->mu );
+        return hit;
+}
+
+void
+eval_cache_put( EvalCache *c, u64 key, const Eval *eval )
+{
+        assert( key != 0 );
+        u32        slot  = (u32)eval_cache_hash( key ) & c->mask;
+        EvalShard *shard = &c->shards[slot % EVAL_CACHE_SHARDS];
+        EvalEntry *e     = &c->entries[slot];
+
+        pthread_mutex_lock( &shard->mu );
+        if ( e->key != 0 && e->key != key ) shard->stats.evictions++;
+        e->key  = key;
+        e->eval = *eval;
+        shard->stats.stores++;
+        pthread_mutex_unlock( &shard->mu );
+}
+
+EvalCacheStats
+eval_cache_stats( EvalCache *c )
+{
+        EvalCacheStats s = { };
+        for ( u32 i = 0; i < EVAL_CACHE_SHARDS; i++ ) {
+                EvalShard *shard = &c->shards[i];
+                pthread_mutex_lock( &shard->mu );
+                s.lookups += shard->stats.lookups;
+                s.hits += shard->stats.hits;
+                s.stores += shard->stats.stores;
+                s.evictions += shard->stats.evictions;
+                pthread_mutex_unlock( &shard->mu );
+        }
+        return s;
+}
+
+}  // namespace hermes
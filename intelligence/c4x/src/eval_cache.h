@@ -0,0 +1,54 @@
+// vim: ft=cpp
+// forge:v1
+// hermes:v1
+#pragma once
+
+#include "game.h"
+#include "tensor.h"
+
+#define EVAL_CACHE_SHARDS 64 /* Number of locks, a power of 2. */
+
+namespace hermes {
+
+/* === --- Evaluation Cache --------------------------------------------- === */
+
+/* The NN outputs of one position, as consumed by MCTS. */
+typedef struct {
+        f32 value;        /* Value head output. */
+        f32 policy[COLS]; /* Policy of the legal move in each column, or 0. */
+} Eval;
+
+typedef struct {
+        u64 lookups;
+        u64 hits;
+        u64 stores;
+        u64 evictions; /* Stores which replaced another position. */
+} EvalCacheStats;
+
+/* A fixed size hash table from position key (game_key) to Eval, shared by all
+ * MCTS trees (across moves and games) using the same NN.
+ *
+ * - The table is direct mapped: each key has one slot and a store always
+ *   replaces the old entry. Hits are exact as the full key is stored.
+ * - Slots are split into EVAL_CACHE_SHARDS shards, each guarded by its own
+ *   mutex, so concurrent searches rarely contend.
+ * - No heap allocation happens after eval_cache_new.
+ */
+typedef struct EvalCache EvalCache;
+
+/* Creates a cache with size slots, rounded up to a power of 2 and at least
+ * EVAL_CACHE_SHARDS.
+ */
+EvalCache *eval_cache_new( u32 size );
+void       eval_cache_free( EvalCache *c );
+
+/* Returns non-zero and fills out if key is in the cache. */
+int eval_cache_get( EvalCache *c, u64 key, Eval *out );
+
+/* Stores e for key, replacing the entry in its slot if any. */
+void eval_cache_put( EvalCache *c, u64 key, const Eval *e );
+
+/* Returns the statistics accumulated since eval_cache_new. */
+EvalCacheStats eval_cache_stats( EvalCache *c );
+
+}  // namespace hermes
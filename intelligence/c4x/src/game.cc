@@ -148,6 +148,116 @@ game_winner( Game *g )
         return -1;
 }
 
+int
+game_play( Game *g, int col )
+{
+        int row = game_legal_row( g, col );
+        assert( row != -1 );
+        g->board[COL_ROW_TO_IDX( col, row )] = g->next_player;
+        g->next_player = g->next_player == BLACK ? WHITE : BLACK;
+        return row;
+}
+
+void
+game_unplay( Game *g, int col, int row )
+{
+        assert( g->board[COL_ROW_TO_IDX( col, row )] != NA );
+        g->board[COL_ROW_TO_IDX( col, row )] = NA;
+        g->next_player = g->next_player == BLACK ? WHITE : BLACK;
+}
+
+int
+game_winner_at( Game *g, int col, int row )
+{
+        /* The directions of the lines through (col, row): right, down, down
+         * right and up right. Each line is walked both ways from the stone.
+         */
+        static const int dcol[4] = { 1, 0, 1, 1 };
+        static const int drow[4] = { 0, 1, 1, -1 };
+
+        Color *board = g->board;
+        Color  c     = board[COL_ROW_TO_IDX( col, row )];
+        assert( c != NA );
+        for ( int d = 0; d < 4; d++ ) {
+                int cnt = 1;
+                for ( int sign = -1; sign <= 1; sign += 2 ) {
+                        int x = col + sign * dcol[d];
+                        int y = row + sign * drow[d];
+                        while ( x >= 0 && x < COLS && y >= 0 && y < ROWS &&
+                                board[COL_ROW_TO_IDX( x, y )] == c ) {
+                                cnt++;
+                                x += sign * dcol[d];
+                                y += sign * drow[d];
+                        }
+                }
+                if ( cnt >= 4 ) return (int)c;
+        }
+
+        /* Tie if the top row is full. */
+        for ( int x = 0; x < COLS; x++ ) {
+                if ( board[COL_ROW_TO_IDX( x, 0 )] == NA ) return -1;
+        }
+        return 0;
+}
+
+u64
+game_key( Game *g )
+{
+        static_assert( ( ROWS + 1 ) * COLS < 64, "key must fit in u64" );
+        u64 key = 0;
+        for ( int col = 0; col < COLS; col++ ) {
+                u64 bits = 0;
+                int h    = 0; /* Stones in the column, from the bottom. */
+                for ( int row = ROWS - 1; row >= 0; row-- ) {
+                        Color c = g->board[COL_ROW_TO_IDX( col, row )];
+                        if ( c == NA ) break;
+                        if ( c == BLACK ) bits |= (u64)1 << h;
+                        h++;
+                }
+                bits |= (u64)1 << h; /* Sentinel. */
+                key |= bits << ( col * ( ROWS + 1 ) );
+        }
+        if ( g->next_player == WHITE ) key |= (u64)1 << ( ( ROWS + 1 ) * COLS );
+        return key;
+}
+
+void
+game_from_key( u64 key, Game *g )
+{
+        for ( int col = 0; col < COLS; col++ ) {
+                u64 bits = ( key >> ( col * ( ROWS + 1 ) ) ) &
+                           ( ( (u64)1 << ( ROWS + 1 ) ) - 1 );
+                int h    = 63 - __builtin_clzll( bits ); /* Sentinel. */
+                for ( int i = 0; i < ROWS; i++ ) {
+                        Color c = NA;
+                        if ( i < h ) c = ( bits >> i ) & 1 ? BLACK : WHITE;
+                        g->board[COL_ROW_TO_IDX( col, ROWS - 1 - i )] = c;
+                }
+        }
+        g->next_player = game_key_next_player( key );
+        g->nn_player   = NA;
+}
+
+Color
+game_key_next_player( u64 key )
+{
+        return ( key >> ( ( ROWS + 1 ) * COLS ) ) & 1 ? WHITE : BLACK;
+}
+
+void
+game_mirror( Game *g )
+{
+        for ( int row = 0; row < ROWS; row++ ) {
+                for ( int col = 0; col < COLS / 2; col++ ) {
+                        int   l     = COL_ROW_TO_IDX( col, row );
+                        int   r     = COL_ROW_TO_IDX( COLS - 1 - col, row );
+                        Color c     = g->board[l];
+                        g->board[l] = g->board[r];
+                        g->board[r] = c;
+                }
+        }
+}
+
 void
 convert_game_to_tensor_input( Tensor **dst, Game *g )
 {
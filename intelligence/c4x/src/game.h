@@ -37,6 +37,38 @@ int game_legal_row( Game *g, int col );
 /// ongoing.
 int game_winner( Game *g );
 
+/// Place a stone of the next player in column (col), which must be legal, and
+/// pass the turn. Return the row of the stone, for game_unplay and
+/// game_winner_at.
+int game_play( Game *g, int col );
+
+/// Undo game_play( g, col ), which placed its stone at (row).
+void game_unplay( Game *g, int col, int row );
+
+/// Same as game_winner, but only checks the lines through the stone at (col,
+/// row). It is exact if the position had no winner before that stone.
+int game_winner_at( Game *g, int col, int row );
+
+/// Return a key identifying the position (stones and next player) exactly,
+/// i.e., two positions have the same key iff they are equal, no matter the
+/// move order. The key is never 0.
+///
+/// Each column is encoded by ROWS+1 bits from the bottom: the black stones
+/// plus a sentinel bit on top of the highest stone. The next player is the bit
+/// after the last column.
+u64 game_key( Game *g );
+
+/// Fill the stones and next player of g from key (see game_key), i.e., the
+/// inverse of game_key. The nn_player of g is set to NA.
+void game_from_key( u64 key, Game *g );
+
+/// Return the next player of the position of key (see game_key).
+Color game_key_next_player( u64 key );
+
+/// Mirror the board in place around the centre column. The rules are
+/// symmetric, so the mirrored position has the mirrored best moves.
+void game_mirror( Game *g );
+
 /// Convert game board to feature input.
 ///
 /// The input tensor specification:
@@ -2,9 +2,16 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include "log.h"
+#include "prof.h"
+
 #define MCTS_PROB_LOW_LIMIT \
         0.05f /* The low limit we allow for each MCTS node. */
 
@@ -14,23 +21,395 @@
                 ( t ) = NULL;     \
         } while ( 0 )
 
+/* The NN stem of a new node is updated from its parent, see mcts_node_new. */
+#if defined( MCTS_STEM_DENSE ) || defined( EVAL_SYMMETRY_AVERAGE )
+#define MCTS_STEM 0
+#else
+#define MCTS_STEM 1
+#endif
+
+/* Planes of the NN input, see convert_game_to_tensor_input. */
+#define INPUT_PLANE_BLACK      0
+#define INPUT_PLANE_WHITE      1
+#define INPUT_PLANE_NEXT_BLACK 2
+
+/* Alignment of the node arena allocations, a cache line. */
+#define MCTS_ARENA_ALIGN 64
+
+/* Nodes are addressed in the arena by index (block << MCTS_SLOT_BITS | slot),
+ * with slots of MCTS_ARENA_ALIGN bytes. */
+#define MCTS_SLOT_BITS        14
+#define MCTS_ARENA_MAX_BLOCKS ( 1 << 14 ) /* 16 GB per tree. */
+
+/* Buckets of the transposition table of a graph. */
+#define MCTS_TABLE_BITS    16
+#define MCTS_TABLE_BUCKETS ( 1 << MCTS_TABLE_BITS )
+
 namespace hermes {
 
+/* === Node arena -------------------------------------------------------------
+ *
+ * The nodes of one tree, with their positions and stem accumulators, are bump
+ * allocated from blocks of MCTS_ARENA_BLOCK bytes, and freed all at once with
+ * the tree, or a block at a time when the root moves down (see
+ * mcts_arena_reroot).
+ *
+ * - Each search thread allocates by an MCTSAlloc, i.e., from a block of its
+ *   own. The arena lock is only taken for a new block.
+ * - The unused tail of a block a thread stops allocating from is kept as the
+ *   spare, and handed out before a new block is.
+ * - The blocks are aligned to their size and listed in the block table of the
+ *   arena. The first MCTS_ARENA_ALIGN bytes of each block (an MCTSBlock) point
+ *   back to the arena, so a node finds the arena from its own address.
+ * - A node refers to other nodes and to its stem accumulator by u32 index
+ *   (block in the table, and slot of MCTS_ARENA_ALIGN bytes in the block), see
+ *   mcts_arena_at. Index 0, the header of the first block, means none.
+ *
+ * The arena of a graph (see mcts_set_dag) also holds its transposition table,
+ * MCTS_TABLE_BUCKETS lists of nodes linked by MCTSNode::next. A node is pushed
+ * onto its list by compare and swap and never removed, so lookups take no
+ * lock.
+ */
+typedef struct MCTSCrew MCTSCrew;
+
+struct MCTSArena {
+        pthread_mutex_t mu;
+        char          **blocks; /* MCTS_ARENA_MAX_BLOCKS, NULL if freed. */
+        u32             block_cnt; /* Blocks below are in use or freed. */
+        u32             free_id;   /* No block below is freed. */
+        char           *spare; /* Unused tail of a block, or NULL. */
+        char           *spare_end;
+        MCTSNode      **table; /* Transposition table of a graph, or NULL. */
+        MCTSTreeStats   stats;
+        NN             *nn;    /* Unowned, see mcts_node_new. */
+        EvalCache      *cache; /* Unowned, may be NULL. */
+        MCTSCrew       *crew;  /* Search threads, NULL before the 1st search. */
+        MCTSNode       *root;
+};
+
 namespace {
+
+/* The header of each arena block. */
+typedef struct {
+        MCTSArena *arena;
+        u32        id; /* Index in the block table. */
+} MCTSBlock;
+
+static_assert( sizeof( MCTSBlock ) <= MCTS_ARENA_ALIGN, "one slot" );
+static_assert( MCTS_ARENA_BLOCK == MCTS_ARENA_ALIGN << MCTS_SLOT_BITS,
+               "slots of a block" );
+
+void mcts_crew_free( MCTSCrew *crew );
+
+/* One thread allocating from an arena. */
+typedef struct {
+        MCTSArena *arena;
+        char      *ptr; /* Next free byte of the block it allocates from. */
+        char      *end;
+        u64        nodes; /* Added to the arena stats by mcts_alloc_release. */
+        u64        bytes;
+} MCTSAlloc;
+
+/* Creates an arena of a tree searched by nn and cache, with a transposition
+ * table if dag is non-zero.
+ */
+MCTSArena *
+mcts_arena_new( int dag, NN *nn, EvalCache *cache )
+{
+        MCTSArena *arena = (MCTSArena *)calloc( 1, sizeof( *arena ) );
+        assert( arena != NULL );
+        pthread_mutex_init( &arena->mu, NULL );
+        arena->nn     = nn;
+        arena->cache  = cache;
+        size_t size   = sizeof( char * ) * MCTS_ARENA_MAX_BLOCKS;
+        arena->blocks = (char **)calloc( 1, size );
+        assert( arena->blocks != NULL );
+        arena->stats.reserved += size;
+        if ( dag ) {
+                size         = sizeof( MCTSNode * ) * MCTS_TABLE_BUCKETS;
+                arena->table = (MCTSNode **)calloc( 1, size );
+                assert( arena->table != NULL );
+                arena->stats.reserved += size;
+        }
+        return arena;
+}
+
+void
+mcts_arena_free( MCTSArena *arena )
+{
+        for ( u32 i = 0; i < arena->block_cnt; i++ ) {
+                free( arena->blocks[i] );
+        }
+        free( arena->blocks );
+        if ( arena->crew != NULL ) mcts_crew_free( arena->crew );
+        free( arena->table );
+        pthread_mutex_destroy( &arena->mu );
+        free( arena );
+}
+
+/* Returns the memory at idx (see MCTSBlock) of arena, or NULL for 0. */
+void *
+mcts_arena_at( MCTSArena *arena, u32 idx )
+{
+        if ( idx == 0 ) return NULL;
+        return arena->blocks[idx >> MCTS_SLOT_BITS] +
+               (size_t)( idx & ( ( 1u << MCTS_SLOT_BITS ) - 1 ) ) *
+                   MCTS_ARENA_ALIGN;
+}
+
+/* Returns the header of the block holding p, allocated from an arena. */
+MCTSBlock *
+mcts_block_of( const void *p )
+{
+        uintptr_t mask = ~(uintptr_t)( MCTS_ARENA_BLOCK - 1 );
+        return (MCTSBlock *)( (uintptr_t)p & mask );
+}
+
+/* Returns the arena of n. */
+MCTSArena *
+mcts_arena_of( const MCTSNode *n )
+{
+        return mcts_block_of( n )->arena;
+}
+
+/* Returns the index of p, allocated from an arena, see mcts_arena_at. */
+u32
+mcts_arena_index( const void *p )
+{
+        MCTSBlock *b = mcts_block_of( p );
+        return b->id << MCTS_SLOT_BITS |
+               (u32)( ( (const char *)p - (const char *)b ) /
+                      MCTS_ARENA_ALIGN );
+}
+
+MCTSNode **
+mcts_table_bucket( MCTSArena *arena, u64 key )
+{
+        /* Fibonacci hashing, as game_key packs the columns into the low
+         * bits. */
+        u64 hash = key * 0x9e3779b97f4a7c15ULL;
+        return &arena->table[hash >> ( 64 - MCTS_TABLE_BITS )];
+}
+
+/* Returns the node of the position key in the table of arena, or NULL. */
+MCTSNode *
+mcts_table_find( MCTSArena *arena, u64 key )
+{
+        MCTSNode *n = __atomic_load_n( mcts_table_bucket( arena, key ),
+                                       __ATOMIC_ACQUIRE );
+        while ( n != NULL && n->key != key ) {
+                n = (MCTSNode *)mcts_arena_at( arena, n->next );
+        }
+        return n;
+}
+
+/* Insert node (evaluated) into the table of arena, unless the table has a node
+ * of its position already. Returns the node in the table.
+ */
+MCTSNode *
+mcts_table_insert( MCTSArena *arena, MCTSNode *node )
+{
+        MCTSNode **bucket = mcts_table_bucket( arena, node->key );
+        MCTSNode  *head   = __atomic_load_n( bucket, __ATOMIC_ACQUIRE );
+        do {
+                MCTSNode *n = head;
+                while ( n != NULL && n->key != node->key ) {
+                        n = (MCTSNode *)mcts_arena_at( arena, n->next );
+                }
+                if ( n != NULL ) return n;
+                node->next = head != NULL ? mcts_arena_index( head ) : 0;
+        } while ( !__atomic_compare_exchange_n( bucket, &head, node,
+                                                /*weak=*/false,
+                                                __ATOMIC_RELEASE,
+                                                __ATOMIC_ACQUIRE ) );
+        return node;
+}
+
+/* Keep [ptr, end) as the spare if it is larger. Called with the lock held. */
+void
+mcts_arena_keep_spare( MCTSArena *arena, char *ptr, char *end )
+{
+        if ( end - ptr > arena->spare_end - arena->spare ) {
+                arena->spare     = ptr;
+                arena->spare_end = end;
+        }
+}
+
+void
+mcts_alloc_init( MCTSAlloc *a, MCTSArena *arena )
+{
+        *a = MCTSAlloc{ arena, NULL, NULL, 0, 0 };
+}
+
+/* Switch a to the spare if it has size bytes, otherwise to a new block. */
+void
+mcts_alloc_block( MCTSAlloc *a, size_t size )
+{
+        assert( size <= MCTS_ARENA_BLOCK - MCTS_ARENA_ALIGN );
+        MCTSArena *arena = a->arena;
+        char      *ptr   = a->ptr;
+        char      *end   = a->end;
+        pthread_mutex_lock( &arena->mu );
+        if ( (size_t)( arena->spare_end - arena->spare ) >= size ) {
+                a->ptr           = arena->spare;
+                a->end           = arena->spare_end;
+                arena->spare     = ptr;
+                arena->spare_end = end;
+        } else {
+                u32 id = arena->free_id;
+                while ( id < arena->block_cnt && arena->blocks[id] != NULL ) {
+                        id++;
+                }
+                if ( id == MCTS_ARENA_MAX_BLOCKS )
+                        PANIC( "MCTS tree is out of arena blocks" );
+                char *b = (char *)aligned_alloc( MCTS_ARENA_BLOCK,
+                                                 MCTS_ARENA_BLOCK );
+                assert( b != NULL );
+                MCTSBlock *h = (MCTSBlock *)b;
+                h->arena     = arena;
+                h->id        = id;
+                arena->blocks[id] = b;
+                if ( id == arena->block_cnt ) arena->block_cnt++;
+                arena->free_id = id + 1;
+                arena->stats.reserved += MCTS_ARENA_BLOCK;
+                a->ptr = b + MCTS_ARENA_ALIGN;
+                a->end = b + MCTS_ARENA_BLOCK;
+                mcts_arena_keep_spare( arena, ptr, end );
+        }
+        pthread_mutex_unlock( &arena->mu );
+}
+
+/* Returns size rounded up to MCTS_ARENA_ALIGN, the bytes mcts_alloc takes. */
+size_t
+mcts_alloc_size( size_t size )
+{
+        const size_t align = MCTS_ARENA_ALIGN;
+        return ( size + align - 1 ) / align * align;
+}
+
+/* Returns size bytes, aligned to MCTS_ARENA_ALIGN and not zeroed. */
+void *
+mcts_alloc( MCTSAlloc *a, size_t size )
+{
+        size = mcts_alloc_size( size );
+        if ( (size_t)( a->end - a->ptr ) < size ) mcts_alloc_block( a, size );
+        void *p = a->ptr;
+        a->ptr += size;
+        a->bytes += size;
+        return p;
+}
+
+/* Stop allocating by a: keep the rest of its block as the spare and add its
+ * counts to the arena stats.
+ */
+void
+mcts_alloc_release( MCTSAlloc *a )
+{
+        MCTSArena *arena = a->arena;
+        pthread_mutex_lock( &arena->mu );
+        mcts_arena_keep_spare( arena, a->ptr, a->end );
+        arena->stats.nodes += a->nodes;
+        arena->stats.bytes += a->bytes;
+        pthread_mutex_unlock( &arena->mu );
+        mcts_alloc_init( a, arena );
+}
+
+/* A stem accumulator in the arena, see MCTSNode::stem. */
+typedef struct {
+        Tensor acc;
+        int    mirrored; /* Non-zero if acc is of the mirror image. */
+} MCTSStem;
+
+/* Returns a stem accumulator (1, C_out, ROWS, COLS) of nn, see nn_stem_new,
+ * with the data not filled.
+ */
+MCTSStem *
+mcts_alloc_stem( MCTSAlloc *a, NN *nn )
+{
+        u32       c_out = nn->stem_kernel->shape[0];
+        MCTSStem *stem  = (MCTSStem *)mcts_alloc( a, sizeof( *stem ) );
+        Tensor   *t     = &stem->acc;
+        t->dim          = 4;
+        t->shape[0]     = 1;
+        t->shape[1]     = c_out;
+        t->shape[2]     = ROWS;
+        t->shape[3]     = COLS;
+        t->ele_total    = c_out * ROWS * COLS;
+        t->ele_cap      = t->ele_total;
+        t->data = (f32 *)mcts_alloc( a, sizeof( f32 ) * t->ele_total );
+        return stem;
+}
+
+u32 mcts_threads = MCTS_THREADS; /* See mcts_set_thread_cnt. */
+u32 mcts_batch   = MCTS_BATCH;   /* See mcts_set_batch_size. */
+int mcts_graph   = MCTS_DAG;     /* See mcts_set_dag. */
+
+/* Node statistics are shared by the search threads. Relaxed order is enough,
+ * as they only steer the selection until the search is done.
+ */
+int
+stat_load( const int *p )
+{
+        return __atomic_load_n( p, __ATOMIC_RELAXED );
+}
+
+u32
+stat_load( const u32 *p )
+{
+        return __atomic_load_n( p, __ATOMIC_RELAXED );
+}
+
+f32
+stat_load( const f32 *p )
+{
+        f32 v;
+        __atomic_load( p, &v, __ATOMIC_RELAXED );
+        return v;
+}
+
+void
+stat_add( int *p, int delta )
+{
+        __atomic_fetch_add( p, delta, __ATOMIC_RELAXED );
+}
+
+void
+stat_add( u32 *p, int delta )
+{
+        __atomic_fetch_add( p, (u32)delta, __ATOMIC_RELAXED );
+}
+
+/* There is no fetch add for f32, so compare and swap until it sticks. */
+void
+stat_add( f32 *p, f32 delta )
+{
+        f32 old = stat_load( p );
+        f32 sum;
+        do {
+                sum = old + delta;
+        } while ( !__atomic_compare_exchange( p, &old, &sum, /*weak=*/true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED ) );
+}
+
 /// Select the next column to evaluate during simulation.  Read AlphaGoZero
 /// paper (2017, "Methods" section, "Select" paragraph) for details.
+///
+/// The edge selected takes vl lost visits until mcts_node_backup_reward.
 int
-mcts_node_select_next_col_to_evaluate( MCTSNode *node )
+mcts_node_select_next_col_to_evaluate( MCTSNode *node, int vl )
 {
+        const int total_count      = stat_load( &node->total_count );
         const f32 c                = 1.0f;
-        const f32 sqrt_total_count = sqrtf( (f32)node->total_count );
+        const f32 sqrt_total_count = sqrtf( (f32)total_count );
         int       col_to_evaluate  = -1;
         f32       best_q           = 0;
         for ( int col = 0; col < COLS; col++ ) {
-                int n = node->n[col];
-                if ( n == -1 ) continue; /* illegal col. */
-                f32 q = node->w[col] / ( n > 0 ? (f32)n : 1.f );
-                q += c * node->p[col] * sqrt_total_count / ( 1.0f + (f32)n );
+                u32 n = stat_load( &node->n[col] );
+                if ( n == MCTS_N_ILLEGAL ) continue; /* illegal col. */
+                f32 q = stat_load( &node->w[col] ) / ( n > 0 ? (f32)n : 1.f );
+                q += c * f16_to_f32( node->p[col] ) * sqrt_total_count /
+                     ( 1.0f + (f32)n );
 
                 if ( col_to_evaluate == -1 || q > best_q ) {
                         col_to_evaluate = col;
@@ -38,59 +417,285 @@ mcts_node_select_next_col_to_evaluate( MCTSNode *node )
                 }
         }
         assert( col_to_evaluate != -1 );
+        if ( vl > 0 ) {
+                stat_add( &node->total_count, vl );
+                stat_add( &node->n[col_to_evaluate], vl );
+                stat_add( &node->w[col_to_evaluate], -(f32)vl );
+        }
         return col_to_evaluate;
 }
 
+/* Back up one visit with reward, and revert the vl lost visits taken by the
+ * selection.
+ */
 void
-mcts_node_backup_reward( MCTSNode *n, int col, f32 reward )
+mcts_node_backup_reward( MCTSNode *n, int col, f32 reward, int vl )
 {
-        assert( n->n[col] != -1 );
-        n->total_count++;
-        n->n[col] += 1;
-        n->w[col] += reward;
+        assert( stat_load( &n->n[col] ) != MCTS_N_ILLEGAL );
+        stat_add( &n->total_count, 1 - vl );
+        stat_add( &n->n[col], 1 - vl );
+        stat_add( &n->w[col], reward + (f32)vl );
 }
 
 #define MAX_MCTS_SIMULATE_PATH_LEN ( ROWS * COLS )
 
 void
 mcts_backup_rewards( f32 black_reward, f32 white_reward, int count,
-                     MCTSNode **simulate_path_node, int *simulate_path_col )
+                     MCTSNode **simulate_path_node, int *simulate_path_col,
+                     int vl )
 {
         for ( int i = 0; i < count; i++ ) {
                 MCTSNode *n = simulate_path_node[i];
-                if ( n->game_snapshot->next_player == BLACK ) {
+                if ( game_key_next_player( n->key ) == BLACK ) {
                         mcts_node_backup_reward( n, simulate_path_col[i],
-                                                 black_reward );
+                                                 black_reward, vl );
                 } else {
                         mcts_node_backup_reward( n, simulate_path_col[i],
-                                                 white_reward );
+                                                 white_reward, vl );
                 }
         }
 }
-}  // namespace
 
-MCTSNode *
-mcts_node_new( /*moved_in*/ Game *game_snapshot, NN *nn )
+/* Keep the policy of the legal move in each column of g, from the policy
+ * output (ROWS*COLS) of g.
+ */
+void
+mcts_eval_policy( Game *g, const f32 *policy, f32 *out )
+{
+        for ( int col = 0; col < COLS; col++ ) {
+                int row  = game_legal_row( g, col );
+                out[col] = row == -1 ? 0.f /* illegal column. */
+                                     : policy[COL_ROW_TO_IDX( col, row )];
+        }
+}
+
+/* A new node being evaluated, see mcts_eval. */
+typedef struct {
+        MCTSNode *node;
+        MCTSNode *parent; /* NULL for the root, otherwise node is its child. */
+        int       col;    /* Move from parent to node. */
+        MCTSNode *grand;  /* Parent of parent on the path, or NULL. */
+        int       grand_col; /* Move from grand to parent. */
+        Game      game;   /* Position of node. */
+        Game      mirror; /* Mirror image of the position of node. */
+        Game     *canon;  /* Position evaluated, game or mirror. */
+        int       mirrored;
+        u64       key;       /* game_key of canon, with the cache. */
+        int       evaluated; /* Non-zero if NN runs, i.e., not cached. */
+        Eval      eval;
+} MCTSLeaf;
+
+/* Fill acc with the stem accumulator of position g, or of its mirror image if
+ * mirrored. If from (may be NULL) holds the accumulator of the same orientation
+ * for the position before the move in col, only the stone placed by the move
+ * and the next player plane change. Otherwise, it is computed from scratch.
+ */
+void
+mcts_stem_fill( NN *nn, Tensor *acc, Game *g, int mirrored, MCTSNode *from,
+                int col )
+{
+        MCTSStem *stem = NULL;
+        if ( from != NULL )
+                stem = (MCTSStem *)mcts_arena_at(
+                    mcts_arena_of( from ),
+                    __atomic_load_n( &from->stem, __ATOMIC_ACQUIRE ) );
+        if ( stem == NULL || stem->mirrored != mirrored ) {
+                Game    m = *g;
+                Tensor *in;
+                if ( mirrored ) game_mirror( &m );
+                convert_game_to_tensor_input( &in, &m );
+                nn_stem_new( nn, &acc, in );
+                RESET_TENSOR( in );
+                return;
+        }
+
+        /* The stone placed is the top one of its column, the one above the
+         * legal row (-1 if the column is full). */
+        Color mover = g->next_player == BLACK ? WHITE : BLACK;
+        int   row   = game_legal_row( g, col ) + 1;
+        assert( g->board[COL_ROW_TO_IDX( col, row )] == mover );
+        if ( mirrored ) col = COLS - 1 - col;
+        assert( stem->acc.ele_total == acc->ele_total );
+        memcpy( acc->data, stem->acc.data, sizeof( f32 ) * acc->ele_total );
+        nn_stem_add( nn, acc,
+                     mover == BLACK ? INPUT_PLANE_BLACK : INPUT_PLANE_WHITE,
+                     (u32)row, (u32)col, 1.f );
+        nn_stem_add_plane( nn, acc, INPUT_PLANE_NEXT_BLACK,
+                           mover == BLACK ? -1.f : 1.f );
+}
+
+/* Fill the stem accumulator of node, allocated from a, from the accumulator of
+ * from (its parent by the move in col, or NULL) unless it has one. Only the
+ * nodes whose children are evaluated by nn hold one.
+ */
+void
+mcts_node_stem( NN *nn, MCTSAlloc *a, MCTSNode *node, MCTSNode *from, int col )
+{
+        if ( __atomic_load_n( &node->stem, __ATOMIC_ACQUIRE ) != 0 ) return;
+
+        /* In the orientation evaluated, see mcts_eval_begin. */
+        Game g;
+        mcts_node_game( node, &g );
+        int mirrored = 0;
+#ifndef EVAL_SYMMETRY_NONE
+        Game m = g;
+        game_mirror( &m );
+        mirrored = game_key( &m ) < node->key;
+#endif
+        MCTSStem *stem = mcts_alloc_stem( a, nn );
+        stem->mirrored = mirrored;
+        mcts_stem_fill( nn, &stem->acc, &g, mirrored, from, col );
+
+        /* Unless another thread filled it meanwhile. Then this one is dropped,
+         * and stays in the arena until the tree is freed. */
+        u32 none = 0;
+        __atomic_compare_exchange_n( &node->stem, &none,
+                                     mcts_arena_index( stem ),
+                                     /*weak=*/false, __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED );
+}
+
+/* Pick the position to evaluate for the leaf and look it up in the cache. If
+ * nn runs on it, its parent gets its stem accumulator (see mcts_node_stem).
+ *
+ * Unless EVAL_SYMMETRY_NONE, a position and its mirror image share one
+ * evaluation: the one with the smaller key (canonical) is evaluated and
+ * cached, and the policy is mirrored back if the position is not canonical.
+ */
+void
+mcts_eval_begin( NN *nn, MCTSAlloc *a, MCTSLeaf *l )
 {
-        MCTSNode *node = (MCTSNode *)calloc( 1, sizeof( *node ) );
-        assert( node != NULL );
-        node->game_snapshot = game_snapshot; /* owned now */
-        node->nn            = nn;
+        EvalCache *cache = a->arena->cache;
+        Game      *g     = &l->game;
+        l->canon         = g;
+        l->mirrored      = 0;
+#ifndef EVAL_SYMMETRY_NONE
+        l->mirror = *g;
+        game_mirror( &l->mirror );
+        if ( game_key( &l->mirror ) < game_key( g ) ) {
+                l->canon    = &l->mirror;
+                l->mirrored = 1;
+        }
+#endif
 
-        Tensor *in;
-        Tensor *policy_out;
-        Tensor *value_out;
-        convert_game_to_tensor_input( &in, game_snapshot );
-        nn_forward( nn, in, &policy_out, &value_out );
+        l->key       = cache != NULL ? game_key( l->canon ) : 0;
+        l->evaluated = cache == NULL || !eval_cache_get( cache, l->key,
+                                                         &l->eval );
+        if ( l->evaluated && l->parent != NULL && MCTS_STEM &&
+             nn_stem_incremental( nn ) )
+                mcts_node_stem( nn, a, l->parent, l->grand, l->grand_col );
+}
+
+/* Run nn on the canonical positions of the leaves not cached, in one batch,
+ * and keep the outputs MCTS needs. With the incremental stem, nn starts from
+ * the stem accumulators, updated from the ones of their parents.
+ *
+ * With EVAL_SYMMETRY_AVERAGE, each position is followed by its mirror image in
+ * the batch and their outputs (mirrored back) are averaged.
+ */
+void
+mcts_eval_run( NN *nn, MCTSLeaf *leaves, int cnt )
+{
+#ifdef EVAL_SYMMETRY_AVERAGE
+        const u32 per = 2; /* Samples per position. */
+#else
+        const u32 per = 1;
+#endif
+        MCTSLeaf *run[MCTS_MAX_BATCH];
+        u32       run_cnt = 0;
+        for ( int i = 0; i < cnt; i++ ) {
+                if ( leaves[i].evaluated ) run[run_cnt++] = &leaves[i];
+        }
+        if ( run_cnt == 0 ) return;
+
+        Tensor *batch = NULL;
+        Tensor *policy_out; /* Owned by nn. */
+        Tensor *value_out;  /* Owned by nn. */
+        if ( MCTS_STEM && nn_stem_incremental( nn ) ) {
+                u32 c_out   = nn->stem_kernel->shape[0];
+                u32 size    = c_out * ROWS * COLS;
+                u32 shape[] = { run_cnt, c_out, ROWS, COLS };
+                alloc_tensor( &batch, 4, shape );
+                for ( u32 i = 0; i < run_cnt; i++ ) {
+                        MCTSLeaf *l   = run[i];
+                        Tensor    acc = { };
+                        acc.dim       = 4;
+                        acc.shape[0]  = 1;
+                        acc.shape[1]  = c_out;
+                        acc.shape[2]  = ROWS;
+                        acc.shape[3]  = COLS;
+                        acc.ele_total = size;
+                        acc.ele_cap   = size;
+                        acc.data      = batch->data + i * size;
+                        mcts_stem_fill( nn, &acc, &l->game, l->mirrored,
+                                        l->parent, l->col );
+                }
+                nn_forward_stem( nn, batch, &policy_out, &value_out );
+        } else {
+                u32 size    = 3 * ROWS * COLS;
+                u32 shape[] = { run_cnt * per, 3, ROWS, COLS };
+                alloc_tensor( &batch, 4, shape );
+                for ( u32 i = 0; i < run_cnt * per; i++ ) {
+                        Game    g = *run[i / per]->canon;
+                        Tensor *in;
+                        if ( i % per == 1 ) game_mirror( &g );
+                        convert_game_to_tensor_input( &in, &g );
+                        memcpy( batch->data + i * size, in->data,
+                                sizeof( f32 ) * size );
+                        RESET_TENSOR( in );
+                }
+                nn_forward_batch( nn, batch, &policy_out, &value_out );
+        }
+        RESET_TENSOR( batch );
+
+        for ( u32 i = 0; i < run_cnt; i++ ) {
+                Eval      *eval   = &run[i]->eval;
+                const f32 *policy = policy_out->data + i * per * ROWS * COLS;
+                eval->value       = value_out->data[i * per];
+                mcts_eval_policy( run[i]->canon, policy, eval->policy );
+#ifdef EVAL_SYMMETRY_AVERAGE
+                Game m = *run[i]->canon;
+                game_mirror( &m );
+                f32 policy_m[COLS];
+                mcts_eval_policy( &m, policy + ROWS * COLS, policy_m );
+                eval->value =
+                    0.5f * ( eval->value + value_out->data[i * per + 1] );
+                for ( int col = 0; col < COLS; col++ ) {
+                        eval->policy[col] = 0.5f * ( eval->policy[col] +
+                                                     policy_m[COLS - 1 - col] );
+                }
+#endif
+        }
+}
+
+/* Fill the node of the leaf from its evaluation, and cache it in the cache of
+ * the tree.
+ */
+void
+mcts_eval_end( EvalCache *cache, MCTSLeaf *l )
+{
+        MCTSNode *node = l->node;
+        Eval     *eval = &l->eval;
+        if ( l->evaluated && cache != NULL )
+                eval_cache_put( cache, l->key, eval );
+        PROF_MCTS_NODE( l->evaluated );
+
+        if ( l->mirrored ) {
+                for ( int i = 0; i < COLS / 2; i++ ) {
+                        f32 p                      = eval->policy[i];
+                        eval->policy[i]            = eval->policy[COLS - 1 - i];
+                        eval->policy[COLS - 1 - i] = p;
+                }
+        }
 
         /* Fill predicated_reward from the value header output. */
-        node->predicated_reward = value_out->data[0];
+        node->predicated_reward = eval->value;
 
         /* Fill prior probabilities from the policy header output. */
         for ( int col = 0; col < COLS; col++ ) {
-                int row = game_legal_row( game_snapshot, col );
+                int row = game_legal_row( &l->game, col );
                 if ( row == -1 ) { /* illegal column. */
-                        node->n[col] = -1;
+                        node->n[col] = MCTS_N_ILLEGAL;
                         continue;
                 }
                 /* The NN might predict the probability as low as 0.f even it
@@ -99,136 +704,600 @@ mcts_node_new( /*moved_in*/ Game *game_snapshot, NN *nn )
                  *
                  * NOTE: I did not tune this number well for different
                  * simulation count MCTS_ITER_CNT. */
-                f32 p = policy_out->data[COL_ROW_TO_IDX( col, row )];
+                f32 p = eval->policy[col];
                 if ( p < MCTS_PROB_LOW_LIMIT ) p = MCTS_PROB_LOW_LIMIT;
-                node->p[col] = p;
+                node->p[col] = f32_to_f16( p );
         }
-        RESET_TENSOR( in );
-        RESET_TENSOR( policy_out );
-        RESET_TENSOR( value_out );
-        return node;
+}
+
+/* Evaluate the nodes of the leaves by the cache if possible, otherwise by nn
+ * (the NN of the tree or its fork) in one batch. The stem accumulators are
+ * allocated from a.
+ */
+void
+mcts_eval( NN *nn, MCTSAlloc *a, MCTSLeaf *leaves, int cnt )
+{
+        for ( int i = 0; i < cnt; i++ ) mcts_eval_begin( nn, a, &leaves[i] );
+        mcts_eval_run( nn, leaves, cnt );
+        for ( int i = 0; i < cnt; i++ )
+                mcts_eval_end( a->arena->cache, &leaves[i] );
+}
+
+/* Allocate the node for the leaf from a, to be filled by mcts_eval. */
+void
+mcts_node_alloc( MCTSAlloc *a, MCTSLeaf *l )
+{
+        static_assert( offsetof( MCTSNode, p ) == MCTS_ARENA_ALIGN,
+                       "statistics in the first cache line" );
+        static_assert( sizeof( MCTSNode ) == 2 * MCTS_ARENA_ALIGN,
+                       "two cache lines" );
+        MCTSNode *node = (MCTSNode *)mcts_alloc( a, sizeof( *node ) );
+        memset( node, 0, sizeof( *node ) );
+        node->key = game_key( &l->game );
+        l->node   = node;
+        a->nodes++;
+}
+}  // namespace
+
+MCTSNode *
+mcts_node_new( /*moved_in*/ Game *game_snapshot, NN *nn, EvalCache *cache )
+{
+        MCTSArena *arena = mcts_arena_new( mcts_graph, nn, cache );
+        MCTSAlloc  a;
+        mcts_alloc_init( &a, arena );
+
+        MCTSLeaf l = { };
+        l.game     = *game_snapshot;
+        l.col      = -1;
+        mcts_node_alloc( &a, &l );
+        game_free( game_snapshot );
+        mcts_eval( nn, &a, &l, 1 );
+        mcts_alloc_release( &a );
+        if ( arena->table != NULL ) mcts_table_insert( arena, l.node );
+        arena->root = l.node;
+        return l.node;
+}
+
+void
+mcts_node_game( MCTSNode *n, Game *g )
+{
+        game_from_key( n->key, g );
+}
+
+MCTSNode *
+mcts_node_child( MCTSNode *n, int col )
+{
+        return (MCTSNode *)mcts_arena_at(
+            mcts_arena_of( n ),
+            __atomic_load_n( &n->c[col], __ATOMIC_ACQUIRE ) );
+}
+
+f32
+mcts_node_prior( MCTSNode *n, int col )
+{
+        return f16_to_f32( n->p[col] );
 }
 
 void
 mcts_node_free( MCTSNode *n )
 {
         if ( n == NULL ) return;
-        game_free( n->game_snapshot );
-        for ( int i = 0; i < COLS; i++ ) {
-                mcts_node_free( n->c[i] );
-        }
-        free( n );
+        assert( mcts_arena_of( n )->root == n ); /* Not a root. */
+        mcts_arena_free( mcts_arena_of( n ) );
 }
 
-void
-mcts_run_simulation( MCTSNode *root, int iterations )
+MCTSTreeStats
+mcts_tree_stats( MCTSNode *root )
 {
+        MCTSArena *arena = mcts_arena_of( root );
+        assert( arena->root == root );
+        pthread_mutex_lock( &arena->mu );
+        MCTSTreeStats stats = arena->stats;
+        pthread_mutex_unlock( &arena->mu );
+        return stats;
+}
+
+namespace {
+
+/* One search, shared by the threads of mcts_run_simulation. */
+typedef struct {
+        MCTSNode *root;
+        int       iterations;
+        int       batch; /* Simulations per NN batch. */
+        int       vl;    /* Virtual loss, 0 for one thread and batch of 1. */
+        int       next;  /* Next simulation to claim. */
+        int       done;  /* Number of simulations finished. */
+        int      *stop;  /* If not NULL, stops claiming once *stop is set. */
+} MCTSSearch;
+
+/* One search thread, which evaluates new nodes by nn and allocates them by
+ * alloc.
+ */
+typedef struct {
+        MCTSSearch *search;
+        NN         *nn;
+        int         report; /* Non-zero if it reports the progress. */
+        MCTSAlloc   alloc;
+        Game        board; /* Scratch position of its descents. */
+} MCTSWorker;
+
+/* One simulation, see mcts_simulate. */
+typedef struct {
         /* Record path of the simulation for backing up rewards. */
-        int       simulate_len;
-        MCTSNode *simulate_path_node[MAX_MCTS_SIMULATE_PATH_LEN];
-        int       simulate_path_col[MAX_MCTS_SIMULATE_PATH_LEN];
+        int       len;
+        MCTSNode *node[MAX_MCTS_SIMULATE_PATH_LEN];
+        int       col[MAX_MCTS_SIMULATE_PATH_LEN];
+        int       leaf; /* The leaf it ends at, or -1. */
+        Game      game; /* Position after the last edge, if expanded. */
 
-        /* Progress report */
-        time_t last_report_progress = time( NULL );
-
-        for ( int it = 0; it < iterations; it++ ) {
-                MCTSNode *node = root;
-
-                simulate_len = 0;
-
-                while ( 1 ) {
-                        int col = mcts_node_select_next_col_to_evaluate( node );
-                        int row = game_legal_row( node->game_snapshot, col );
-                        assert( row != -1 );
-                        simulate_path_node[simulate_len] = node;
-                        simulate_path_col[simulate_len]  = col;
-                        simulate_len++;
-
-                        Color next_player =
-                            node->game_snapshot->next_player == BLACK ? WHITE
-                                                                      : BLACK;
-                        Game *dup_game =
-                            game_dup_snapshot( node->game_snapshot );
-                        dup_game->board[COL_ROW_TO_IDX( col, row )] =
-                            dup_game->next_player;
-                        dup_game->next_player = next_player;
-
-                        int winner = game_winner( dup_game );
-
-                        /* Found winner */
-                        if ( winner >= 0 ) {
-                                f32 black_reward;
-                                f32 white_reward;
-                                if ( winner == 0 ) {
-                                        black_reward = 0.f;
-                                } else if ( winner == BLACK ) {
-                                        black_reward = 1.f;
-                                } else {
-                                        black_reward = -1.f;
-                                }
-                                white_reward = -1 * black_reward;
-                                mcts_backup_rewards(
-                                    black_reward, white_reward, simulate_len,
-                                    simulate_path_node, simulate_path_col );
-                                game_free( dup_game );
-                                break; /* End of this iteration. */
-                        }
+        /* In a graph, the node it ends at if its position is in the table,
+         * otherwise NULL. Then leaf is -1.
+         */
+        MCTSNode *link;
+} MCTSPath;
+
+/* Descend from root into path, taking vl lost visits at each edge, until a
+ * winner is found or the edge has no child yet. Returns non-zero if the
+ * position after the edge is to be expanded, which is then copied to
+ * path->game, or 0 if the game result is backed up.
+ *
+ * The moves are played on board, the position of root, and undone before
+ * returning, so a descent copies no position unless it expands one.
+ */
+int
+mcts_descend( MCTSNode *root, Game *board, int vl, MCTSPath *path )
+{
+        MCTSArena *arena = mcts_arena_of( root );
+        MCTSNode  *node  = root;
+        int        row[MAX_MCTS_SIMULATE_PATH_LEN];
+        int        expand = 0;
+        path->len         = 0;
+        while ( 1 ) {
+                int col = mcts_node_select_next_col_to_evaluate( node, vl );
+                path->node[path->len] = node;
+                path->col[path->len]  = col;
+                row[path->len]        = game_play( board, col );
+                path->len++;
 
-                        /* Expand new leaf */
-                        if ( node->c[col] == NULL ) {
-                                MCTSNode *expanded_node = mcts_node_new(
-                                    /*moved_in*/ dup_game, node->nn );
-                                node->c[col] =
-                                    expanded_node; /* owned by node */
-                                f32 black_reward;
-                                f32 white_reward;
-                                black_reward = expanded_node->predicated_reward;
-                                if ( expanded_node->game_snapshot
-                                         ->next_player == WHITE )
-                                        black_reward *= -1.f;
-                                white_reward = -1 * black_reward;
-                                mcts_backup_rewards(
-                                    black_reward, white_reward, simulate_len,
-                                    simulate_path_node, simulate_path_col );
-                                break; /* End of this iteration. */
+                int winner =
+                    game_winner_at( board, col, row[path->len - 1] );
+
+                /* Found winner */
+                if ( winner >= 0 ) {
+                        f32 black_reward;
+                        f32 white_reward;
+                        if ( winner == 0 ) {
+                                black_reward = 0.f;
+                        } else if ( winner == BLACK ) {
+                                black_reward = 1.f;
+                        } else {
+                                black_reward = -1.f;
                         }
+                        white_reward = -1 * black_reward;
+                        mcts_backup_rewards( black_reward, white_reward,
+                                             path->len, path->node, path->col,
+                                             vl );
+                        break; /* End of this iteration. */
+                }
 
-                        game_free( dup_game );
-                        /* Keeps playing in this iteration. */
-                        node = node->c[col];
+                /* Expand new leaf */
+                MCTSNode *child = (MCTSNode *)mcts_arena_at(
+                    arena, __atomic_load_n( &node->c[col], __ATOMIC_ACQUIRE ) );
+                if ( child == NULL ) {
+                        path->game = *board;
+                        expand     = 1;
+                        break;
                 }
 
+                /* Keeps playing in this iteration. */
+                node = child;
+        }
+        for ( int i = path->len - 1; i >= 0; i-- ) {
+                game_unplay( board, path->col[i], row[i] );
+        }
+        return expand;
+}
+
+/* Returns the mean value of node for its next player: its predicated_reward
+ * and the rewards backed up below it, see mcts_node_backup_reward.
+ */
+f32
+mcts_node_value( MCTSNode *node )
+{
+        f32 w   = node->predicated_reward;
+        int cnt = 1;
+        for ( int col = 0; col < COLS; col++ ) {
+                u32 n = stat_load( &node->n[col] );
+                if ( n == 0 || n == MCTS_N_ILLEGAL ) continue;
+                w += stat_load( &node->w[col] );
+                cnt += n;
+        }
+        return w / (f32)cnt;
+}
+
+/* Run cnt (at most MCTS_MAX_BATCH) simulations from root, whose position is
+ * board, see mcts_run_simulation. The new nodes of all simulations are
+ * allocated from a and evaluated by nn in one batch, and simulations ending at
+ * the same edge share its new node.
+ *
+ * In a graph, a simulation ending at a position in the table links the edge to
+ * its node instead, and simulations ending at the same position share its new
+ * node.
+ */
+void
+mcts_simulate( MCTSNode *root, Game *board, NN *nn, MCTSAlloc *a, int vl,
+               int cnt )
+{
+        MCTSArena *arena = a->arena;
+        int        dag   = arena->table != NULL;
+        MCTSPath   paths[MCTS_MAX_BATCH];
+        MCTSLeaf   leaves[MCTS_MAX_BATCH];
+        int        leaf_cnt = 0;
+        for ( int i = 0; i < cnt; i++ ) {
+                MCTSPath *p = &paths[i];
+                p->leaf     = -1;
+                p->link     = NULL;
+                if ( !mcts_descend( root, board, vl, p ) ) continue;
+
+                MCTSNode *parent = p->node[p->len - 1];
+                int       col    = p->col[p->len - 1];
+                u64       key    = dag ? game_key( &p->game ) : 0;
+                if ( dag ) {
+                        p->link = mcts_table_find( arena, key );
+                        if ( p->link != NULL ) continue;
+                }
+                for ( int j = 0; j < leaf_cnt && p->leaf == -1; j++ ) {
+                        MCTSLeaf *l = &leaves[j];
+                        if ( dag ? l->node->key == key
+                                 : l->parent == parent && l->col == col )
+                                p->leaf = j;
+                }
+                if ( p->leaf != -1 ) continue;
+                p->leaf      = leaf_cnt++;
+                MCTSLeaf *l  = &leaves[p->leaf];
+                l->parent    = parent;
+                l->col       = col;
+                l->grand     = p->len > 1 ? p->node[p->len - 2] : NULL;
+                l->grand_col = p->len > 1 ? p->col[p->len - 2] : -1;
+                l->game      = p->game;
+                mcts_node_alloc( a, l );
+        }
+        mcts_eval( nn, a, leaves, leaf_cnt );
+
+        /* In a graph, another thread may have inserted a node of the same
+         * position meanwhile. Then that one is used. */
+        for ( int j = 0; dag && j < leaf_cnt; j++ ) {
+                leaves[j].node = mcts_table_insert( arena, leaves[j].node );
+        }
+
+        for ( int i = 0; i < cnt; i++ ) {
+                MCTSPath *p = &paths[i];
+                PROF_MCTS_SIMULATION( (u32)p->len );
+                if ( p->leaf == -1 && p->link == NULL ) continue;
+
+                /* Installed in the parent, unless another thread installed its
+                 * node for the same edge meanwhile. Then this one is dropped,
+                 * and stays in the arena until the tree is freed. */
+                MCTSNode *child = p->leaf != -1 ? leaves[p->leaf].node
+                                                : p->link;
+                u32       none  = 0;
+                __atomic_compare_exchange_n(
+                    &p->node[p->len - 1]->c[p->col[p->len - 1]], &none,
+                    mcts_arena_index( child ), /*weak=*/false,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED );
+
+                f32 black_reward;
+                f32 white_reward;
+                black_reward = p->leaf != -1 ? child->predicated_reward
+                                             : mcts_node_value( child );
+                if ( game_key_next_player( child->key ) == WHITE )
+                        black_reward *= -1.f;
+                white_reward = -1 * black_reward;
+                mcts_backup_rewards( black_reward, white_reward, p->len,
+                                     p->node, p->col, vl );
+        }
+}
+
+void
+mcts_report_progress( int done, int iterations )
+{
+        float progress = (f32)done / (f32)iterations * 100.f;
+        printf( "MCTS Simulation Progress [#%d]: [%5.1f%%]\n", iterations,
+                progress );
+}
+
+/* Claim and run simulations, a batch at a time, until the search has run all
+ * of them.
+ */
+void *
+mcts_worker( void *arg )
+{
+        MCTSWorker *w = (MCTSWorker *)arg;
+        MCTSSearch *s = w->search;
+
+        /* Progress report */
+        time_t last_report_progress = 0;
+
+        while ( 1 ) {
+                if ( s->stop != NULL &&
+                     __atomic_load_n( s->stop, __ATOMIC_RELAXED ) )
+                        break;
+                int it = __atomic_fetch_add( &s->next, s->batch,
+                                             __ATOMIC_RELAXED );
+                if ( it >= s->iterations ) break;
+                int cnt = s->iterations - it < s->batch ? s->iterations - it
+                                                        : s->batch;
+                mcts_simulate( s->root, &w->board, w->nn, &w->alloc, s->vl,
+                               cnt );
+                int done =
+                    __atomic_add_fetch( &s->done, cnt, __ATOMIC_RELAXED );
+
                 /* Report the progress.
                  *
                  * To avoid over-spamming, the condition is
                  * - First iteration
-                 * - Last iteration
+                 * - Last iteration, see mcts_run_simulation
                  * - at least 2 seconds have passed.
                  */
+                if ( !w->report || done == s->iterations ) continue;
                 time_t now = time( NULL );
-                if ( it == 0 || now - last_report_progress >= 2 ||
-                     it == iterations - 1 ) {
+                if ( last_report_progress == 0 ||
+                     now - last_report_progress >= 2 ) {
                         last_report_progress = now;
-                        float progress =
-                            (f32)( it + 1 ) / (f32)iterations * 100.f;
-                        printf( "MCTS Simulation Progress [#%d]: [%5.1f%%]\n",
-                                (int)iterations, progress );
+                        mcts_report_progress( done, s->iterations );
+                }
+        }
+        mcts_alloc_release( &w->alloc );
+        return NULL;
+}
+
+}  // namespace
+
+/* === Search crew ------------------------------------------------------------
+ *
+ * The search threads of a tree and their forks of its NN are kept by its arena
+ * across searches, and handed over to the next root (see mcts_session_root),
+ * so a search neither spawns threads nor forks the NN.
+ *
+ * As in the pool (see pool.cc), each search publishes its workers and bumps
+ * the generation. Thread i (1-based, the caller is worker 0) wakes up, runs
+ * worker i and decrements pending. The caller runs worker 0 and waits for
+ * pending to drop to 0.
+ */
+
+/* One thread of a crew. */
+typedef struct {
+        MCTSCrew *crew;
+        u32       id;
+} MCTSCrewThread;
+
+struct MCTSCrew {
+        pthread_mutex_t mu;      /* Guards gen, pending, stop and workers. */
+        pthread_cond_t  work_cv; /* Signaled when a search is published. */
+        pthread_cond_t  done_cv; /* Signaled when pending drops to 0. */
+
+        u64         gen;     /* Generation of the current search. */
+        u64         gen0;    /* Generation when the threads were started. */
+        u32         pending; /* Threads not done with the current search. */
+        int         stop;    /* Set to stop all threads. */
+        MCTSWorker *workers; /* Of the current search. */
+
+        u32            thread_cnt; /* Including the caller. */
+        u32            fork_cnt;   /* nn[1, fork_cnt) are owned forks. */
+        NN            *nn[MCTS_MAX_THREADS]; /* nn[0] is the NN of the tree. */
+        pthread_t      threads[MCTS_MAX_THREADS];
+        MCTSCrewThread ids[MCTS_MAX_THREADS];
+};
+
+namespace {
+
+void *
+mcts_crew_thread( void *arg )
+{
+        MCTSCrewThread *t    = (MCTSCrewThread *)arg;
+        MCTSCrew       *crew = t->crew;
+        /* Not crew->gen, as a search might have been published already. */
+        u64 seen = crew->gen0;
+
+        pthread_mutex_lock( &crew->mu );
+        while ( 1 ) {
+                while ( crew->gen == seen && !crew->stop ) {
+                        pthread_cond_wait( &crew->work_cv, &crew->mu );
                 }
+                if ( crew->stop ) break;
+                seen          = crew->gen;
+                MCTSWorker *w = &crew->workers[t->id];
+                pthread_mutex_unlock( &crew->mu );
+
+                mcts_worker( w );
+
+                pthread_mutex_lock( &crew->mu );
+                if ( --crew->pending == 0 )
+                        pthread_cond_signal( &crew->done_cv );
+        }
+        pthread_mutex_unlock( &crew->mu );
+        return NULL;
+}
+
+/* Creates the crew of a tree searched by nn, with the caller only. */
+MCTSCrew *
+mcts_crew_new( NN *nn )
+{
+        MCTSCrew *crew = (MCTSCrew *)calloc( 1, sizeof( *crew ) );
+        assert( crew != NULL );
+        pthread_mutex_init( &crew->mu, NULL );
+        pthread_cond_init( &crew->work_cv, NULL );
+        pthread_cond_init( &crew->done_cv, NULL );
+        crew->thread_cnt = 1;
+        crew->fork_cnt   = 1;
+        crew->nn[0]      = nn;
+        return crew;
+}
+
+/* Stop and join all threads of crew. */
+void
+mcts_crew_stop( MCTSCrew *crew )
+{
+        if ( crew->thread_cnt <= 1 ) return;
+        pthread_mutex_lock( &crew->mu );
+        crew->stop = 1;
+        pthread_cond_broadcast( &crew->work_cv );
+        pthread_mutex_unlock( &crew->mu );
+        for ( u32 i = 1; i < crew->thread_cnt; i++ ) {
+                pthread_join( crew->threads[i], NULL );
+        }
+        crew->stop       = 0;
+        crew->thread_cnt = 1;
+}
+
+/* Restart crew with cnt threads (including the caller) unless it has them. A
+ * fork of the NN is kept for each thread ever started.
+ */
+void
+mcts_crew_resize( MCTSCrew *crew, u32 cnt )
+{
+        assert( cnt >= 1 && cnt <= MCTS_MAX_THREADS );
+        if ( crew->thread_cnt == cnt ) return;
+        mcts_crew_stop( crew );
+        for ( ; crew->fork_cnt < cnt; crew->fork_cnt++ ) {
+                crew->nn[crew->fork_cnt] = nn_fork( crew->nn[0] );
+        }
+        crew->gen0 = crew->gen;
+        for ( u32 i = 1; i < cnt; i++ ) {
+                crew->ids[i] = MCTSCrewThread{ crew, i };
+                if ( pthread_create( &crew->threads[i], NULL,
+                                     mcts_crew_thread, &crew->ids[i] ) != 0 )
+                        PANIC( "failed to create search thread %u", i );
+        }
+        crew->thread_cnt = cnt;
+}
+
+/* Run workers (one per thread of crew) until the search is done. */
+void
+mcts_crew_run( MCTSCrew *crew, MCTSWorker *workers )
+{
+        pthread_mutex_lock( &crew->mu );
+        crew->workers = workers;
+        crew->pending = crew->thread_cnt - 1;
+        crew->gen++;
+        pthread_cond_broadcast( &crew->work_cv );
+        pthread_mutex_unlock( &crew->mu );
+
+        mcts_worker( &workers[0] );
+
+        pthread_mutex_lock( &crew->mu );
+        while ( crew->pending != 0 ) {
+                pthread_cond_wait( &crew->done_cv, &crew->mu );
+        }
+        crew->workers = NULL;
+        pthread_mutex_unlock( &crew->mu );
+}
+
+void
+mcts_crew_free( MCTSCrew *crew )
+{
+        mcts_crew_stop( crew );
+        for ( u32 i = 1; i < crew->fork_cnt; i++ ) {
+                nn_free( crew->nn[i] );
         }
+        pthread_cond_destroy( &crew->work_cv );
+        pthread_cond_destroy( &crew->done_cv );
+        pthread_mutex_destroy( &crew->mu );
+        free( crew );
+}
+
+}  // namespace
+
+int
+mcts_search( MCTSNode *root, int iterations, int *stop, int report )
+{
+        PROF_BEGIN( t_search );
+        u32        cnt    = mcts_threads;
+        int        batch  = (int)mcts_batch;
+        MCTSSearch search = {
+            root, iterations, batch,
+            cnt > 1 || batch > 1 ? MCTS_VIRTUAL_LOSS : 0, 0, 0, stop };
+
+        /* The caller is worker 0 and evaluates by the NN of the tree, the
+         * other workers by the forks of the crew.
+         */
+        MCTSArena *arena = mcts_arena_of( root );
+        assert( arena->root == root );
+        if ( arena->crew == NULL ) arena->crew = mcts_crew_new( arena->nn );
+        MCTSCrew *crew = arena->crew;
+        mcts_crew_resize( crew, cnt );
+        MCTSWorker workers[MCTS_MAX_THREADS];
+        for ( u32 i = 0; i < cnt; i++ ) {
+                workers[i] = MCTSWorker{ &search, crew->nn[i],
+                                         report && i == 0, { }, { } };
+                mcts_alloc_init( &workers[i].alloc, arena );
+                mcts_node_game( root, &workers[i].board );
+        }
+        mcts_crew_run( crew, workers );
+
+        if ( report && iterations > 0 )
+                mcts_report_progress( iterations, iterations );
+        PROF_MCTS_SEARCH( t_search );
+        return search.done;
+}
+
+void
+mcts_run_simulation( MCTSNode *root, int iterations )
+{
+        mcts_search( root, iterations, /*stop=*/NULL, /*report=*/1 );
+}
+
+void
+mcts_set_thread_cnt( u32 cnt )
+{
+        assert( cnt >= 1 );
+        mcts_threads = cnt < MCTS_MAX_THREADS ? cnt : MCTS_MAX_THREADS;
+}
+
+u32
+mcts_thread_cnt( void )
+{
+        return mcts_threads;
+}
+
+void
+mcts_set_batch_size( u32 size )
+{
+        assert( size >= 1 );
+        mcts_batch = size < MCTS_MAX_BATCH ? size : MCTS_MAX_BATCH;
+}
+
+u32
+mcts_batch_size( void )
+{
+        return mcts_batch;
+}
+
+void
+mcts_set_dag( int on )
+{
+        mcts_graph = on;
+}
+
+int
+mcts_dag( void )
+{
+        return mcts_graph;
 }
 
 int
 mcts_node_select_next_col_to_play( MCTSNode *node )
 {
         int col_to_evaluate = -1;
-        int best_n          = 0;
+        u32 best_n          = 0;
         for ( int col = 0; col < COLS; col++ ) {
-                int n = node->n[col];
-                if ( n == -1 ) continue; /* illegal col. */
+                u32 n = node->n[col];
+                if ( n == MCTS_N_ILLEGAL ) continue; /* illegal col. */
 
                 // DEBUG info
-                printf( "col %d n %4d p %7.3f avg(w) %7.3f \n", col + 1, n,
-                        node->p[col], node->w[col] / (f32)( n > 0 ? n : 1 ) );
+                printf( "col %d n %4u p %7.3f avg(w) %7.3f \n", col + 1, n,
+                        mcts_node_prior( node, col ),
+                        node->w[col] / (f32)( n > 0 ? n : 1 ) );
                 if ( col_to_evaluate == -1 || n > best_n ) {
                         col_to_evaluate = col;
                         best_n          = n;
@@ -238,4 +1307,233 @@ mcts_node_select_next_col_to_play( MCTSNode *node )
         return col_to_evaluate;
 }
 
+struct MCTSSession {
+        NN        *nn;
+        EvalCache *cache;
+        MCTSNode  *root; /* NULL before the first search. */
+
+        /* Pondering, see mcts_session_ponder_start. */
+        pthread_t ponder;
+        int       pondering;  /* Non-zero if ponder is running. */
+        int       ponder_max; /* Simulations to run at most. */
+        int       ponder_done;
+        int       ponder_stop;
+};
+
+namespace {
+
+/* Returns the node of the position key at most plies below n, or NULL. */
+MCTSNode *
+mcts_node_find( MCTSNode *n, u64 key, int plies )
+{
+        if ( n->key == key ) return n;
+        if ( plies == 0 ) return NULL;
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = mcts_node_child( n, col );
+                if ( c == NULL ) continue;
+                MCTSNode *found = mcts_node_find( c, key, plies - 1 );
+                if ( found != NULL ) return found;
+        }
+        return NULL;
+}
+
+/* Copy the subtree at n into a, without the stem accumulators, which are
+ * filled again once children are evaluated. In a graph, each node is copied
+ * once and inserted into the table of a.
+ */
+MCTSNode *
+mcts_node_copy( MCTSAlloc *a, MCTSNode *n )
+{
+        MCTSArena *arena = a->arena;
+        if ( arena->table != NULL ) {
+                MCTSNode *copied = mcts_table_find( arena, n->key );
+                if ( copied != NULL ) return copied;
+        }
+
+        MCTSNode *node = (MCTSNode *)mcts_alloc( a, sizeof( *node ) );
+        *node          = *n;
+        node->next     = 0;
+        node->stem     = 0;
+        memset( node->c, 0, sizeof( node->c ) );
+        if ( arena->table != NULL ) mcts_table_insert( arena, node );
+        a->nodes++;
+
+        MCTSArena *from = mcts_arena_of( n );
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = (MCTSNode *)mcts_arena_at( from, n->c[col] );
+                if ( c != NULL )
+                        node->c[col] =
+                            mcts_arena_index( mcts_node_copy( a, c ) );
+        }
+        return node;
+}
+
+/* Mark the blocks of arena holding the subtree at n or its stem accumulators
+ * in live, and count them in kept. In a graph, each node is inserted into the
+ * table of arena (cleared first), which tells the nodes marked already.
+ */
+void
+mcts_arena_mark( MCTSArena *arena, MCTSNode *n, u8 *live, MCTSTreeStats *kept )
+{
+        if ( arena->table != NULL ) {
+                if ( mcts_table_find( arena, n->key ) != NULL ) return;
+                mcts_table_insert( arena, n );
+        }
+        live[mcts_block_of( n )->id] = 1;
+        kept->nodes++;
+        kept->bytes += mcts_alloc_size( sizeof( *n ) );
+
+        MCTSStem *stem = (MCTSStem *)mcts_arena_at( arena, n->stem );
+        if ( stem != NULL ) {
+                live[mcts_block_of( stem )->id]          = 1;
+                live[mcts_block_of( stem->acc.data )->id] = 1;
+                kept->bytes += mcts_alloc_size( sizeof( *stem ) ) +
+                               mcts_alloc_size( sizeof( f32 ) *
+                                                stem->acc.ele_total );
+        }
+        for ( int col = 0; col < COLS; col++ ) {
+                MCTSNode *c = (MCTSNode *)mcts_arena_at( arena, n->c[col] );
+                if ( c != NULL ) mcts_arena_mark( arena, c, live, kept );
+        }
+}
+
+/* Make node, below the root of arena, the root, see mcts_session_root. The
+ * subtree at node stays in place and the blocks holding none of it are freed.
+ * If it still fills less than a quarter of the blocks left, it is copied into
+ * a new arena instead (see mcts_node_copy), which takes the search threads,
+ * and arena is freed. Returns the root.
+ */
+MCTSNode *
+mcts_arena_reroot( MCTSArena *arena, MCTSNode *node )
+{
+        u8 *live = (u8 *)calloc( arena->block_cnt, 1 );
+        assert( live != NULL );
+        if ( arena->table != NULL )
+                memset( arena->table, 0,
+                        sizeof( MCTSNode * ) * MCTS_TABLE_BUCKETS );
+        MCTSTreeStats kept = { };
+        mcts_arena_mark( arena, node, live, &kept );
+
+        u64 live_cnt = 0;
+        for ( u32 i = 0; i < arena->block_cnt; i++ ) live_cnt += live[i];
+        if ( kept.bytes * 4 < live_cnt * MCTS_ARENA_BLOCK ) {
+                free( live );
+                MCTSArena *to = mcts_arena_new( arena->table != NULL,
+                                                arena->nn, arena->cache );
+                MCTSAlloc  a;
+                mcts_alloc_init( &a, to );
+                to->root = mcts_node_copy( &a, node );
+                mcts_alloc_release( &a );
+                to->crew    = arena->crew;
+                arena->crew = NULL;
+                mcts_arena_free( arena );
+                return to->root;
+        }
+
+        for ( u32 i = 0; i < arena->block_cnt; i++ ) {
+                if ( live[i] || arena->blocks[i] == NULL ) continue;
+                free( arena->blocks[i] );
+                arena->blocks[i] = NULL;
+                arena->stats.reserved -= MCTS_ARENA_BLOCK;
+                if ( i < arena->free_id ) arena->free_id = i;
+        }
+        char *spare = arena->spare;
+        if ( spare != NULL && !live[mcts_block_of( spare )->id] ) {
+                arena->spare     = NULL;
+                arena->spare_end = NULL;
+        }
+        free( live );
+        arena->stats.nodes = kept.nodes;
+        arena->stats.bytes = kept.bytes;
+        arena->root        = node;
+        return node;
+}
+
+/* Search the root of a pondering session, see mcts_session_ponder_start. */
+void *
+mcts_session_ponder( void *arg )
+{
+        MCTSSession *s = (MCTSSession *)arg;
+        s->ponder_done = mcts_search( s->root, s->ponder_max, &s->ponder_stop,
+                                      /*report=*/0 );
+        return NULL;
+}
+
+}  // namespace
+
+MCTSSession *
+mcts_session_new( NN *nn, EvalCache *cache )
+{
+        MCTSSession *s = (MCTSSession *)calloc( 1, sizeof( *s ) );
+        assert( s != NULL );
+        s->nn    = nn;
+        s->cache = cache;
+        return s;
+}
+
+void
+mcts_session_free( MCTSSession *s )
+{
+        if ( s == NULL ) return;
+        if ( s->pondering ) mcts_session_ponder_stop( s );
+        mcts_node_free( s->root );
+        free( s );
+}
+
+MCTSNode *
+mcts_session_root( MCTSSession *s, Game *g )
+{
+        assert( !s->pondering );
+        MCTSNode *old  = s->root;
+        MCTSNode *node = NULL;
+        if ( old != NULL )
+                node = mcts_node_find( old, game_key( g ), MCTS_SESSION_PLIES );
+        if ( node != NULL && node == old ) return old;
+
+        if ( node == NULL ) {
+                s->root = mcts_node_new( game_dup_snapshot( g ), s->nn,
+                                         s->cache );
+                if ( old != NULL ) {
+                        /* The search threads go on with the new root. */
+                        MCTSArena *from                = mcts_arena_of( old );
+                        mcts_arena_of( s->root )->crew = from->crew;
+                        from->crew                     = NULL;
+                        mcts_node_free( old );
+                }
+        } else {
+                s->root = mcts_arena_reroot( mcts_arena_of( old ), node );
+        }
+        return s->root;
+}
+
+void
+mcts_session_ponder_start( MCTSSession *s, Game *g, int max_iterations )
+{
+        assert( !s->pondering );
+        mcts_session_root( s, g );
+        s->ponder_max  = max_iterations;
+        s->ponder_done = 0;
+        s->ponder_stop = 0;
+        if ( pthread_create( &s->ponder, NULL, mcts_session_ponder, s ) != 0 )
+                PANIC( "failed to create ponder thread" );
+        s->pondering = 1;
+}
+
+int
+mcts_session_ponder_stop( MCTSSession *s )
+{
+        assert( s->pondering );
+        __atomic_store_n( &s->ponder_stop, 1, __ATOMIC_RELAXED );
+        return mcts_session_ponder_wait( s );
+}
+
+int
+mcts_session_ponder_wait( MCTSSession *s )
+{
+        assert( s->pondering );
+        pthread_join( s->ponder, NULL );
+        s->pondering = 0;
+        return s->ponder_done;
+}
+
 }  // namespace hermes
@@ -3,49 +3,159 @@
 // hermes:v1
 #pragma once
 
+#include "eval_cache.h"
 #include "game.h"
 #include "nn.h"
 #include "tensor.h"
 
+#ifndef MCTS_THREADS
+#define MCTS_THREADS 1 /* Default number of search threads, see Makefile. */
+#endif
+
+#ifndef MCTS_BATCH
+#define MCTS_BATCH 1 /* Default simulations per NN batch, see Makefile. */
+#endif
+
+#ifndef MCTS_DAG
+#define MCTS_DAG 0 /* Non-zero to search graphs by default, see Makefile. */
+#endif
+
+#define MCTS_MAX_THREADS  64 /* Max number of search threads. */
+#define MCTS_MAX_BATCH    64 /* Max simulations per NN batch. */
+#define MCTS_VIRTUAL_LOSS 1  /* Lost visits added to an edge being searched. */
+
+#define MCTS_N_ILLEGAL 0xffffffffu /* MCTSNode::n of an illegal column. */
+
+#define MCTS_ARENA_BLOCK ( 1 << 20 ) /* Bytes of each node arena block. */
+
+/* Max plies from the root of a session to the next position searched, for the
+ * subtree of the position to be reused. See mcts_session_root.
+ */
+#define MCTS_SESSION_PLIES 2
+
 namespace hermes {
 
 /* === MCTS node and tree --------------------------------------------------- */
 
+/* Memory of the nodes of one tree, see mcts_node_new. */
+typedef struct MCTSArena MCTSArena;
+
+typedef struct {
+        u64 nodes;    /* Nodes allocated, including ones lost to a race. */
+        u64 bytes;    /* Bytes of nodes and stem accumulators. */
+        /* Both count the kept subtree only once mcts_session_root moved the
+         * root down. */
+        u64 reserved; /* Bytes of the arena blocks. */
+} MCTSTreeStats;
+
 /* The node data structure for MCTS tree. All simulation rewards information is
  * backed up and recorded in the node.
  *
  * - During evaluation, multi-armed bandit is leveraged to select the next
  *   state to try.
  * - During inference (play), the state with strongest chance is selected.
+ *
+ * During mcts_run_simulation, the search threads update total_count, n and w
+ * by atomic ops and install children by compare and swap. All other fields
+ * are immutable once the node is created.
+ *
+ * In a graph (see mcts_set_dag), a node is shared by all parents whose move
+ * leads to its position. The statistics of an edge (n and w of the parent) then
+ * count the visits through that edge only, while total_count counts the visits
+ * of the node through any edge.
  */
 typedef struct MCTSNode {
-        Game *game_snapshot; /* Owned */
-        NN   *nn;            /* Unowned */
+        /* The statistics each visit updates fill the first cache line, and
+         * the fields the selection reads with them, which are written once,
+         * the second (the arena aligns nodes to a cache line).
+         */
 
         /* Total number of visits during multi-armed bandit. */
         int total_count;
+        /* Visited count for each legal move, MCTS_N_ILLEGAL for an illegal
+         * column.
+         */
+        u32 n[COLS];
+        /* Backed up total value for each legal move. */
+        f32 w[COLS];
 
         /* The chance current player will win, between -1 and 1. */
         f32 predicated_reward;
 
-        /* Owned children for each legal move. NULL means unexpanded yet. */
-        struct MCTSNode *c[COLS];
+        /* Prior probability for each legal move, in f16 (see f16_to_f32 or
+         * mcts_node_prior).
+         */
+        alignas( 64 ) u16 p[COLS];
 
-        /* Visited count for each legal move. -1 for illegal column. */
-        int n[COLS];
-        /* Backed up total value for each legal move. */
-        f32 w[COLS];
-        /* Prior probability for each legal move. */
-        f32 p[COLS];
+        /* Children for each legal move, as indices into the arena (see
+         * mcts_node_child). 0 means unexpanded yet.
+         */
+        u32 c[COLS];
+
+        /* game_key of the position, the only copy of it, see mcts_node_game.
+         * The search rebuilds the positions on its way down instead.
+         */
+        u64 key;
+
+        /* Next node in the same bucket of the transposition table of a graph
+         * (see mcts_set_dag), as an index into the arena, or 0.
+         */
+        u32 next;
+
+        /* Accumulator of the NN stem (see nn_stem_new) of the position
+         * evaluated for this node, as an index into the arena. Children
+         * evaluated by the NN update it by their move, and it is filled when
+         * the first one is. 0 until then, or if MCTS_STEM_DENSE or the stem
+         * is not incremental.
+         */
+        u32 stem;
 } MCTSNode;
 
 /// During creating, NN is invoked to provide predicated_reward (chance to win)
 /// and prior probabilities for all legal moves.
-MCTSNode *mcts_node_new( /*moved_in*/ Game *game_snapshot, NN *nn );
+///
+/// If cache is not NULL, it is consulted first and NN is invoked only for
+/// positions not seen before (by any tree sharing the cache). All nodes
+/// expanded from this node share the cache.
+///
+/// A position and its mirror image share one evaluation, see the Makefile knob
+/// EVAL_SYMMETRY:
+/// - By default, the one with the smaller game_key (canonical) is evaluated
+///   (and cached), and the policy is mirrored back.
+/// - EVAL_SYMMETRY_NONE: Each position is evaluated as is.
+/// - EVAL_SYMMETRY_AVERAGE: The canonical position and its mirror image are
+///   evaluated in one batch of 2 and the outputs are averaged.
+///
+/// The NN stem is not run for the position but updated from the accumulator of
+/// the parent by the one stone placed (see nn_stem_add), unless the parent
+/// evaluated the other orientation. The knob MCTS_STEM_DENSE (and
+/// EVAL_SYMMETRY_AVERAGE) runs the full NN instead.
+///
+/// The node is the root of a new tree, which keeps nn and cache. All nodes of
+/// the tree, with their stem accumulators, are bump allocated from an arena of
+/// blocks of MCTS_ARENA_BLOCK bytes owned by the root. Each search thread
+/// allocates from a block of its own, so only taking a new block takes a
+/// lock.
+MCTSNode *mcts_node_new( /*moved_in*/ Game *game_snapshot, NN *nn,
+                         EvalCache *cache );
 
-/// Recursively free the entire MCTS tree rooted at n.
+/// Free the entire MCTS tree rooted at n, which must be a root returned by
+/// mcts_node_new. Only the arena blocks are freed, not each node.
 void mcts_node_free( MCTSNode *n );
 
+/// Fill g with the position of n (see game_from_key).
+void mcts_node_game( MCTSNode *n, Game *g );
+
+/// Returns the child of n for the move in col, or NULL if not expanded yet.
+MCTSNode *mcts_node_child( MCTSNode *n, int col );
+
+/// Returns the prior probability of the move in col of n.
+f32 mcts_node_prior( MCTSNode *n, int col );
+
+/// Returns the memory used by the tree rooted at n (a root returned by
+/// mcts_node_new), as of the end of the last mcts_run_simulation.
+MCTSTreeStats mcts_tree_stats( MCTSNode *root );
+
 /// Run iterations number of simulations for the MCTS tree at root. Backup all
 /// reward information.
 ///
@@ -56,10 +166,105 @@ void mcts_node_free( MCTSNode *n );
 ///
 /// The larger iterations number is the deeper MCTS tree can see the future.
 /// Then the result is better.
+///
+/// With more than one thread (see mcts_set_thread_cnt), the simulations run
+/// tree parallel: each thread descends the shared tree with its own fork of
+/// the NN (see nn_fork). Each edge on the way down takes MCTS_VIRTUAL_LOSS
+/// lost visits until the simulation backs up, which steers the other threads
+/// to other paths. If two threads expand the same leaf, the first node
+/// installed is kept and the other is dropped (it stays in the arena until the
+/// tree is freed). The threads and forks are started by the first search of a
+/// tree and parked between searches, until the tree is freed or the thread
+/// count changes.
+///
+/// With a batch size above one (see mcts_set_batch_size), each thread descends
+/// the tree batch size times (taking the virtual loss, so the paths differ)
+/// before it evaluates the new nodes of all paths in one NN batch, then
+/// expands and backs up all of them. Paths ending at the same edge share its
+/// new node. A single thread with batch size one searches without virtual
+/// loss.
 void mcts_run_simulation( MCTSNode *root, int iterations );
 
+/// Run iterations simulations from root as mcts_run_simulation does, or fewer
+/// if *stop (stop may be NULL) is set meanwhile. The progress is printed if
+/// report is non-zero. Returns the number of simulations run.
+///
+/// With zero iterations, it only starts the search threads and NN forks of the
+/// tree, e.g., so a timed search does not include them.
+int mcts_search( MCTSNode *root, int iterations, int *stop, int report );
+
+/// Set the number of threads (including the caller) of mcts_run_simulation,
+/// at most MCTS_MAX_THREADS. The default is MCTS_THREADS.
+void mcts_set_thread_cnt( u32 cnt );
+
+/// Returns the number of threads of mcts_run_simulation.
+u32 mcts_thread_cnt( void );
+
+/// Set the number of simulations per NN batch of each thread in
+/// mcts_run_simulation, at most MCTS_MAX_BATCH. The default is MCTS_BATCH.
+void mcts_set_batch_size( u32 size );
+
+/// Returns the number of simulations per NN batch of mcts_run_simulation.
+u32 mcts_batch_size( void );
+
+/// Set whether the trees created afterwards (by mcts_node_new) are searched as
+/// graphs. The default is MCTS_DAG.
+///
+/// In a graph, each position has one node, found by its game_key in a
+/// transposition table of the tree. A new edge to a position already in the
+/// table links to its node rather than evaluating the position again, and the
+/// simulation backs up the mean value of the node (its predicated_reward and
+/// the rewards backed up below it). The next visits of the edge descend into
+/// the shared node.
+void mcts_set_dag( int on );
+
+/// Returns non-zero if the trees created afterwards are searched as graphs.
+int mcts_dag( void );
+
 // Select the next column to play. Currently, choose the one with most visited
 // count.
 ///
 int mcts_node_select_next_col_to_play( MCTSNode *node );
+
+/* === MCTS session --------------------------------------------------------- */
+
+/* The search of one game, which keeps the tree of the last move so the next
+ * move starts from the subtree of its position, with all its statistics.
+ */
+typedef struct MCTSSession MCTSSession;
+
+/// Creates a session searching with nn and cache (may be NULL), see
+/// mcts_node_new.
+MCTSSession *mcts_session_new( NN *nn, EvalCache *cache );
+
+/// Free the session and its tree.
+void mcts_session_free( MCTSSession *s );
+
+/// Returns the root (owned by the session) to search position g from.
+///
+/// If g is the position of a node at most MCTS_SESSION_PLIES plies below the
+/// last root, e.g., after the move played from it and the reply, the subtree
+/// of that node becomes the root and keeps its visits. The subtree stays in
+/// the arena, which frees the blocks holding none of it, unless it fills so
+/// few of them that it is cheaper to copy it (without the stem accumulators)
+/// into a new arena. Otherwise, a new tree is created by mcts_node_new.
+///
+/// The root stays valid until the next call. Its total_count is the number of
+/// simulations reused. The search threads of the last root (see
+/// mcts_run_simulation) go on with the new one.
+MCTSNode *mcts_session_root( MCTSSession *s, Game *g );
+
+/// Start searching the root of position g (see mcts_session_root) on a
+/// background thread, e.g., while the opponent thinks, until
+/// mcts_session_ponder_stop or max_iterations simulations. The session and its
+/// NN must not be used meanwhile. The pondered visits of the reply played are
+/// reused by the next mcts_session_root.
+void mcts_session_ponder_start( MCTSSession *s, Game *g, int max_iterations );
+
+/// Stop pondering, and return the number of simulations pondered.
+int mcts_session_ponder_stop( MCTSSession *s );
+
+/// Wait until pondering has run all its max_iterations simulations, and return
+/// the number of simulations pondered.
+int mcts_session_ponder_wait( MCTSSession *s );
 }  // namespace hermes
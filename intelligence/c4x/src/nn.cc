@@ -3,22 +3,20 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "log.h"
+#include "pool.h"
+#include "prof.h"
+#include "sgemm.h"
 
-/* === BLAS related header and kernels -------------------------------------- */
-
-#ifdef MACOS_ACCELERATE
-#include <Accelerate/Accelerate.h>
-#endif
-
-#ifdef BLAS
-#include <cblas.h>
-#endif
-
-#define BN_EPS 0.001f /* EPS for Batch norm. */
+#define BN_EPS          0.001f /* EPS for Batch norm. */
 
 #define RESET_TENSOR( t )         \
         do {                      \
@@ -39,7 +37,43 @@ namespace hermes {
 namespace {
 /* === Utils to read tensor data file --------------------------------------- */
 
-/* Tensor data file specification.
+void
+write_bytes( int fd, const void *buf, size_t size )
+{
+        ssize_t c = write( fd, buf, size );
+        if ( c < 0 || (size_t)c != size )
+                PANIC( "failed to write bytes to data file" );
+}
+
+void
+read_bytes( int fd, void *buf, size_t size )
+{
+        ssize_t c = read( fd, buf, size );
+        if ( c < 0 || (size_t)c != size )
+                PANIC( "failed to read bytes from data file" );
+}
+
+/* Allocate cnt weights (and their INT8 kernels and batchnorm2d affines) of
+ * nn. The count comes from the file, so it must not exceed max, the number of
+ * tensors the rest of the file can describe at least.
+ */
+void
+nn_alloc_weights( NN *nn, u32 cnt, u64 max )
+{
+        if ( cnt == 0 ) PANIC( "no tensor in data file" );
+        if ( cnt > max )
+                PANIC( "data file is too short for %u tensors", cnt );
+        nn->weight_cnt = cnt;
+        nn->weights    = (Tensor *)calloc( cnt, sizeof( Tensor ) );
+        nn->qconv      = (QConv **)calloc( cnt, sizeof( QConv * ) );
+        nn->bn_affine  = (f32 **)calloc( cnt, sizeof( f32 * ) );
+        if ( nn->weights == NULL || nn->qconv == NULL ||
+             nn->bn_affine == NULL )
+                PANIC( "failed to allocate %u tensors", cnt );
+        DEBUG( "tensor count %u\n", cnt );
+}
+
+/* Tensor data file specification (v1).
  *
  * The file contains tensors only, no operation graphs/dags.
  * - The first 4 bytes is little endian unsigned int32 (u32), which indicates
@@ -52,25 +86,19 @@ namespace {
  * - Immediately after last section, all tensor data are stored as float32 (f32)
  *   bytes, without any delimiters. This makes mmap easier during file loading.
  *
- * Read read_tensor_data function for details.
+ * As all sections are made of 4-byte words, every tensor data is 4-byte
+ * aligned in the file. This is all f32 loads need (SIMD kernels use unaligned
+ * loads), so tensors can point into the mapping directly.
+ *
+ * See nn_new for the v2 format, which read_tensor_data reads as well.
  */
 
-void
-read_tensor_cnt( int fd, u32 *cnt )
-{
-        ssize_t c = read( fd, cnt, 4 );
-        if ( c < 0 ) PANIC( "failed to read bytes for a u32" );
-        assert( *cnt <= MAX_TENSOR_LIMIT );
-        DEBUG( "tensor count %u\n", *cnt );
-}
-
 void
 read_shape( int fd, Tensor *t )
 {
-        u32     dim;
-        ssize_t c = read( fd, &dim, 4 );
-        if ( c < 0 ) PANIC( "failed to read bytes for a u32" );
-        assert( dim <= MAX_DIM_LIMIT );
+        u32 dim;
+        read_bytes( fd, &dim, 4 );
+        if ( dim > MAX_DIM_LIMIT ) PANIC( "tensor dim %u is too large", dim );
         DEBUG( "dim %u\n", dim );
         t->dim = dim;
 
@@ -78,14 +106,13 @@ read_shape( int fd, Tensor *t )
         u32 ele;
         DEBUG( "shape <" );
         for ( u32 i = 0; i < dim; i++ ) {
-                ssize_t c = read( fd, &ele, 4 );
-                if ( c < 0 ) PANIC( "failed to read bytes for a u32" );
-
+                read_bytes( fd, &ele, 4 );
                 DEBUG( "%u, ", ele );
                 t->shape[i] = ele;
                 ele_total *= ele;
         }
         t->ele_total = ele_total;
+        t->ele_cap   = ele_total;
         DEBUG( ">\n" );
         DEBUG( "ele_total: %u\n", ele_total );
 }
@@ -104,109 +131,1411 @@ read_tensor( int fd, Tensor *t )
         show_tensor( t, "tensor data" );
 }
 
-void
-read_tensor_data( const char *file_name, u32 *tensor_cnt, Tensor *weights )
+/* Point all tensors into the read only mapping of the file (fd). The shapes
+ * have been read, so the file offset is at the start of the data section.
+ * Returns 0 if the file cannot be mapped.
+ */
+int
+map_tensor_data( int fd, u32 tensor_cnt, Tensor *weights, NN *nn )
 {
-        int fd = open( file_name, O_RDONLY );
-        if ( fd == -1 ) PANIC( "failed to open tensor data file" );
+        off_t offset = lseek( fd, 0, SEEK_CUR );
+        if ( offset < 0 ) return 0;
+        assert( offset % sizeof( f32 ) == 0 );
+
+        struct stat st;
+        if ( fstat( fd, &st ) != 0 || st.st_size == 0 ) return 0;
+
+        size_t size = 0;
+        for ( u32 i = 0; i < tensor_cnt; i++ ) {
+                size += sizeof( f32 ) * weights[i].ele_total;
+        }
+        if ( (size_t)offset + size > (size_t)st.st_size )
+                PANIC( "failed to read full tensor" );
 
-        read_tensor_cnt( fd, tensor_cnt );
+        void *map = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd,
+                          0 );
+        if ( map == MAP_FAILED ) return 0;
+
+        f32 *data = (f32 *)( (char *)map + offset );
+        for ( u32 i = 0; i < tensor_cnt; i++ ) {
+                weights[i].data = data;
+                data += weights[i].ele_total;
+        }
+        nn->map      = map;
+        nn->map_size = (size_t)st.st_size;
+        return 1;
+}
+
+/* Read the v1 file (fd) after its tensor count. */
+void
+read_tensor_data_v1( int fd, NN *nn )
+{
+        u32     tensor_cnt = nn->weight_cnt;
+        Tensor *weights    = nn->weights;
 
         /* Pass 1: Read shapes */
-        for ( u32 i = 0; i < *tensor_cnt; i++ ) {
+        for ( u32 i = 0; i < tensor_cnt; i++ ) {
                 read_shape( fd, &weights[i] );
         }
-        /* Pass 2: Read tensor data */
-        for ( u32 i = 0; i < *tensor_cnt; i++ ) {
+
+        /* Pass 2: Map tensor data, or read it if mmap is not possible. */
+        if ( !( nn->flags & NN_FLAG_NO_MMAP ) &&
+             map_tensor_data( fd, tensor_cnt, weights, nn ) )
+                return;
+        for ( u32 i = 0; i < tensor_cnt; i++ ) {
                 read_tensor( fd, &weights[i] );
         }
+}
+
+/* === Utils of the v2 data file -------------------------------------------- */
+
+/* The table of nn_crc32, built at compile time. */
+typedef struct {
+        u32 v[256];
+} NNCrcTable;
+
+constexpr NNCrcTable
+nn_crc32_table( void )
+{
+        NNCrcTable t = { };
+        for ( u32 i = 0; i < 256; i++ ) {
+                u32 c = i;
+                for ( int k = 0; k < 8; k++ ) {
+                        c = c & 1 ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1;
+                }
+                t.v[i] = c;
+        }
+        return t;
+}
+
+constexpr NNCrcTable nn_crc32_tab = nn_crc32_table( );
+
+/* CRC-32 (IEEE 802.3, reflected, as zlib computes it) of size bytes. */
+u32
+nn_crc32( const void *buf, size_t size )
+{
+        const u32 *table = nn_crc32_tab.v;
+        const u8  *p     = (const u8 *)buf;
+        u32        crc   = 0xFFFFFFFFu;
+        for ( size_t i = 0; i < size; i++ ) {
+                crc = table[( crc ^ p[i] ) & 0xFF] ^ ( crc >> 8 );
+        }
+        return crc ^ 0xFFFFFFFFu;
+}
+
+f32
+bf16_to_f32( u16 h )
+{
+        u32 bits = (u32)h << 16;
+        f32 v;
+        memcpy( &v, &bits, sizeof( v ) );
+        return v;
+}
+
+/* Round to nearest even. */
+u16
+f32_to_bf16( f32 v )
+{
+        u32 bits;
+        memcpy( &bits, &v, sizeof( bits ) );
+        if ( ( bits & 0x7FFFFFFF ) > 0x7F800000 ) /* NaN stays NaN. */
+                return (u16)( ( bits >> 16 ) | 0x40 );
+        bits += 0x7FFF + ( ( bits >> 16 ) & 1 );
+        return (u16)( bits >> 16 );
+}
+
+/* Bytes of the payload of t in dtype. */
+size_t
+nn_payload_size( u32 dtype, Tensor *t )
+{
+        switch ( dtype ) {
+        case NN_DTYPE_F32:
+                return sizeof( f32 ) * (size_t)t->ele_total;
+        case NN_DTYPE_F16:
+        case NN_DTYPE_BF16:
+                return sizeof( u16 ) * (size_t)t->ele_total;
+        case NN_DTYPE_I8:
+                return sizeof( f32 ) * (size_t)t->shape[0] + t->ele_total;
+        }
+        return 0;
+}
+
+/* Convert the payload src in dtype into t->data. */
+void
+nn_decode( u32 dtype, Tensor *t, const void *src )
+{
+        u32  n   = t->ele_total;
+        f32 *dst = t->data;
+        switch ( dtype ) {
+        case NN_DTYPE_F32:
+                memcpy( dst, src, sizeof( f32 ) * n );
+                break;
+        case NN_DTYPE_F16: {
+                const u16 *h = (const u16 *)src;
+                for ( u32 i = 0; i < n; i++ ) dst[i] = f16_to_f32( h[i] );
+                break;
+        }
+        case NN_DTYPE_BF16: {
+                const u16 *h = (const u16 *)src;
+                for ( u32 i = 0; i < n; i++ ) dst[i] = bf16_to_f32( h[i] );
+                break;
+        }
+        case NN_DTYPE_I8: {
+                u32        rows  = t->shape[0];
+                u32        cols  = n / rows;
+                const f32 *scale = (const f32 *)src;
+                const i8  *q     = (const i8 *)( scale + rows );
+                for ( u32 i = 0; i < n; i++ ) {
+                        dst[i] = (f32)q[i] * scale[i / cols];
+                }
+                break;
+        }
+        }
+}
+
+/* Encode t in dtype into a new payload. Returns its size. */
+size_t
+nn_encode( u32 dtype, Tensor *t, void **payload )
+{
+        u32    n    = t->ele_total;
+        size_t size = nn_payload_size( dtype, t );
+        *payload    = calloc( 1, size );
+        assert( *payload != NULL );
+        switch ( dtype ) {
+        case NN_DTYPE_F32:
+                memcpy( *payload, t->data, size );
+                break;
+        case NN_DTYPE_F16: {
+                u16 *h = (u16 *)*payload;
+                for ( u32 i = 0; i < n; i++ ) h[i] = f32_to_f16( t->data[i] );
+                break;
+        }
+        case NN_DTYPE_BF16: {
+                u16 *h = (u16 *)*payload;
+                for ( u32 i = 0; i < n; i++ ) h[i] = f32_to_bf16( t->data[i] );
+                break;
+        }
+        case NN_DTYPE_I8: {
+                u32  rows  = t->shape[0];
+                u32  cols  = n / rows;
+                f32 *scale = (f32 *)*payload;
+                i8  *q     = (i8 *)( scale + rows );
+                for ( u32 r = 0; r < rows; r++ ) {
+                        const f32 *w   = t->data + r * cols;
+                        f32        max = 0.f;
+                        for ( u32 j = 0; j < cols; j++ ) {
+                                if ( fabsf( w[j] ) > max ) max = fabsf( w[j] );
+                        }
+                        scale[r] = max / 127.f;
+                        f32 inv  = max > 0.f ? 127.f / max : 0.f;
+                        for ( u32 j = 0; j < cols; j++ ) {
+                                q[r * cols + j] = (i8)lrintf( w[j] * inv );
+                        }
+                }
+                break;
+        }
+        }
+        return size;
+}
+
+/* Read the v2 file (fd, of st) after its magic. See nn_new for the format. */
+void
+read_tensor_data_v2( int fd, const struct stat *st, NN *nn )
+{
+        u32 header[3]; /* Version, count of tensors and CRC-32 of the table. */
+        read_bytes( fd, header, sizeof( header ) );
+        if ( header[0] != NN_DATA_VERSION )
+                PANIC( "unsupported data file version %u", header[0] );
+        u64 rest = (u64)st->st_size - sizeof( u32 ) - sizeof( header );
+        nn_alloc_weights( nn, header[1], rest / sizeof( NNDataEntry ) );
+
+        u32          cnt   = nn->weight_cnt;
+        NNDataEntry *table = (NNDataEntry *)malloc( sizeof( *table ) * cnt );
+        assert( table != NULL );
+        read_bytes( fd, table, sizeof( *table ) * cnt );
+        if ( nn_crc32( table, sizeof( *table ) * cnt ) != header[2] )
+                PANIC( "data file table is corrupted" );
+
+        void *map = NULL;
+        if ( !( nn->flags & NN_FLAG_NO_MMAP ) ) {
+                map = mmap( NULL, (size_t)st->st_size, PROT_READ, MAP_SHARED,
+                            fd, 0 );
+                if ( map == MAP_FAILED ) map = NULL;
+        }
+
+        nn->names = (char( * )[NN_DATA_NAME_LEN])malloc( NN_DATA_NAME_LEN *
+                                                         (size_t)cnt );
+        assert( nn->names != NULL );
+        u32 mapped = 0;
+        for ( u32 i = 0; i < cnt; i++ ) {
+                NNDataEntry *e = &table[i];
+                Tensor      *t = &nn->weights[i];
+                memcpy( nn->names[i], e->name, NN_DATA_NAME_LEN );
+                nn->names[i][NN_DATA_NAME_LEN - 1] = '\0';
+                if ( e->dim > MAX_DIM_LIMIT || e->dtype > NN_DTYPE_I8 ||
+                     ( e->dtype == NN_DTYPE_I8 && e->dim == 0 ) )
+                        PANIC( "tensor %s has unsupported dim or dtype",
+                               nn->names[i] );
+
+                /* The product is checked before it can wrap, as each factor
+                 * and the product so far are below 2^32. */
+                u64 total = 1;
+                t->dim    = e->dim;
+                for ( u32 j = 0; j < e->dim; j++ ) {
+                        t->shape[j] = e->shape[j];
+                        total *= e->shape[j];
+                        if ( total == 0 || total > UINT32_MAX )
+                                PANIC( "tensor %s has an invalid shape",
+                                       nn->names[i] );
+                }
+                t->ele_total = (u32)total;
+                t->ele_cap   = t->ele_total;
+                if ( e->size != nn_payload_size( e->dtype, t ) ||
+                     e->offset % NN_DATA_ALIGN != 0 ||
+                     e->offset > (u64)st->st_size ||
+                     e->size > (u64)st->st_size - e->offset )
+                        PANIC( "tensor %s is out of the data file",
+                               nn->names[i] );
+
+                const void *src = NULL;
+                void       *buf = NULL;
+                if ( map != NULL ) {
+                        src = (const char *)map + e->offset;
+                } else {
+                        buf = malloc( e->size );
+                        assert( buf != NULL );
+                        ssize_t c = pread( fd, buf, e->size, (off_t)e->offset );
+                        if ( c < 0 || (u64)c != e->size )
+                                PANIC( "failed to read full tensor" );
+                        src = buf;
+                }
+                /* A payload mapped in place is only paged in by the layers
+                 * using it, so it is checked on request. The others are read
+                 * or decoded in full here anyway. */
+                int check = buf != NULL || e->dtype != NN_DTYPE_F32 ||
+                            ( nn->flags & NN_FLAG_CRC32 );
+                if ( check && nn_crc32( src, e->size ) != e->crc )
+                        PANIC( "tensor %s is corrupted", nn->names[i] );
+
+                if ( map != NULL && e->dtype == NN_DTYPE_F32 ) {
+                        t->data = (f32 *)src;
+                        mapped++;
+                } else {
+                        t->data = (f32 *)malloc( sizeof( f32 ) * t->ele_total );
+                        assert( t->data != NULL );
+                        nn_decode( e->dtype, t, src );
+                }
+                free( buf );
+        }
+        free( table );
+
+        if ( map != NULL && mapped == 0 ) {
+                munmap( map, (size_t)st->st_size );
+        } else if ( map != NULL ) {
+                nn->map      = map;
+                nn->map_size = (size_t)st->st_size;
+        }
+}
+
+void
+read_tensor_data( const char *file_name, NN *nn )
+{
+        int fd = open( file_name, O_RDONLY );
+        if ( fd == -1 ) PANIC( "failed to open tensor data file" );
+
+        struct stat st;
+        if ( fstat( fd, &st ) != 0 ) PANIC( "failed to stat data file" );
+
+        /* The magic of v2, or the tensor count of v1. */
+        u32 word;
+        read_bytes( fd, &word, sizeof( word ) );
+        if ( word == NN_DATA_MAGIC ) {
+                read_tensor_data_v2( fd, &st, nn );
+        } else {
+                /* Each v1 tensor has a shape of one u32 at least. */
+                u64 rest = (u64)st.st_size - sizeof( word );
+                nn_alloc_weights( nn, word, rest / sizeof( u32 ) );
+                read_tensor_data_v1( fd, nn );
+        }
         close( fd );
 }
 
+/* Returns non-zero if the tensor data points into the mapped file. */
+int
+nn_weight_mapped( NN *nn, Tensor *t )
+{
+        char *ptr = (char *)t->data;
+        return nn->map != NULL && ptr >= (char *)nn->map &&
+               ptr < (char *)nn->map + nn->map_size;
+}
+
+/* Make a private heap copy of a mapped weight, so it can be modified in
+ * place. Shared pages stay shared for all other weights.
+ */
+void
+nn_own_weight( NN *nn, Tensor *t )
+{
+        if ( !nn_weight_mapped( nn, t ) ) return;
+        f32 *data = (f32 *)malloc( sizeof( f32 ) * t->ele_total );
+        assert( data != NULL );
+        memcpy( data, t->data, sizeof( f32 ) * t->ele_total );
+        t->data = data;
+}
+
+/* === Memory plan ---------------------------------------------------------- */
+
+/* Init a plan tensor as a view of cap f32s in buf (1-D, filled by layers). */
+f32 *
+nn_plan_init_tensor( Tensor *t, f32 *buf, u32 cap )
+{
+        t->dim       = 1;
+        t->shape[0]  = cap;
+        t->ele_total = cap;
+        t->ele_cap   = cap;
+        t->data      = buf;
+        return buf + cap;
+}
+
+/* Make sure the plan buffer can hold batch samples. The buffer only grows, so
+ * once the largest batch has been seen, nn_forward does no heap traffic.
+ */
+void
+nn_plan_reserve( NNPlan *plan, u32 batch )
+{
+        if ( batch <= plan->batch_cap ) return;
+
+        size_t total = ( NN_PLAN_ACT_CNT * (size_t)plan->act_cap +
+                         plan->scratch_cap + 2 * (size_t)plan->out_cap ) *
+                           batch +
+                       plan->tile_cap;
+        free( plan->buf );
+        plan->buf = (f32 *)malloc( sizeof( f32 ) * total );
+        assert( plan->buf != NULL );
+        plan->batch_cap = batch;
+
+        f32 *ptr = plan->buf;
+        for ( u32 i = 0; i < NN_PLAN_ACT_CNT; i++ ) {
+                ptr = nn_plan_init_tensor( &plan->act[i], ptr,
+                                           batch * plan->act_cap );
+        }
+        ptr = nn_plan_init_tensor( &plan->scratch, ptr,
+                                   batch * plan->scratch_cap +
+                                       plan->tile_cap );
+        ptr = nn_plan_init_tensor( &plan->policy, ptr, batch * plan->out_cap );
+        ptr = nn_plan_init_tensor( &plan->value, ptr, batch * plan->out_cap );
+        assert( ptr == plan->buf + total );
+        DEBUG( "memory plan: %zu f32s for batch %u\n", total, batch );
+}
+
+/* Compute the memory plan from the weight shapes.
+ *
+ * All conv2d layers use same padding, so every activation has the same number
+ * of pixels (H*W). It is revealed by the first linear layer (policy head),
+ * whose in_features is C*H*W with C being the C_out of the conv before it.
+ */
+void
+nn_plan_new( NNPlan *plan, u32 weight_cnt, Tensor *weights )
+{
+        u32 hw          = 0;
+        u32 last_c_out  = 0;
+        u32 act_cap     = 0;
+        u32 scratch_cap = 0;
+        u32 tile_cap    = 0;
+        u32 out_cap     = 0;
+
+        for ( u32 i = 0; i < weight_cnt; i++ ) {
+                Tensor *t = &weights[i];
+                if ( t->dim == 4 ) { /* conv2d */
+                        last_c_out = t->shape[0];
+                        continue;
+                }
+                if ( t->dim == 2 && hw == 0 ) { /* first linear */
+                        assert( last_c_out > 0 );
+                        hw = t->shape[1] / last_c_out;
+                }
+        }
+        assert( hw > 0 );
+
+        for ( u32 i = 0; i < weight_cnt; i++ ) {
+                Tensor *t = &weights[i];
+                if ( t->dim == 4 ) { /* conv2d */
+                        u32 c_out = t->shape[0];
+                        u32 k = t->shape[1] * t->shape[2] * t->shape[3];
+                        /* im2col matrix plus the batched matmul output per
+                         * sample, and the conv2d_direct tiles of all pool
+                         * threads once. */
+                        u32 sc = ( k + c_out ) * hw;
+                        u32 tc = POOL_MAX_THREADS * CONV2D_DIRECT_BLOCK * hw;
+                        if ( c_out * hw > act_cap ) act_cap = c_out * hw;
+                        if ( sc > scratch_cap ) scratch_cap = sc;
+                        if ( tc > tile_cap ) tile_cap = tc;
+                } else if ( t->dim == 2 ) { /* linear */
+                        u32 out_dim = t->shape[0];
+                        if ( out_dim > act_cap ) act_cap = out_dim;
+                        if ( out_dim > out_cap ) out_cap = out_dim;
+                }
+        }
+
+        plan->buf         = NULL;
+        plan->batch_cap   = 0;
+        plan->act_cap     = act_cap;
+        plan->scratch_cap = scratch_cap;
+        plan->tile_cap    = tile_cap;
+        plan->out_cap     = out_cap;
+        nn_plan_reserve( plan, 1 );
+}
+
+/* === Layer graph ---------------------------------------------------------- */
+
+/* Names of the weights in each layer, after the PyTorch modules. */
+const char *const nn_stem_weights[] = {
+    "conv.weight", "conv.bias",       "bn.weight",
+    "bn.bias",     "bn.running_mean", "bn.running_var",
+};
+const char *const nn_block_weights[] = {
+    "conv1.weight", "conv1.bias",       "bn1.weight",
+    "bn1.bias",     "bn1.running_mean", "bn1.running_var",
+    "conv2.weight", "conv2.bias",       "bn2.weight",
+    "bn2.bias",     "bn2.running_mean", "bn2.running_var",
+};
+const char *const nn_policy_head_weights[] = {
+    "conv.weight", "conv.bias",       "bn.weight",
+    "bn.bias",     "bn.running_mean", "bn.running_var",
+    "fc.weight",   "fc.bias",
+};
+const char *const nn_value_head_weights[] = {
+    "conv.weight", "conv.bias",       "bn.weight",
+    "bn.bias",     "bn.running_mean", "bn.running_var",
+    "fc1.weight",  "fc1.bias",        "fc2.weight",
+    "fc2.bias",
+};
+
+/* Name, weight count and weight names of each NNLayerKind, indexed by the
+ * kind.
+ */
+typedef struct {
+        const char        *name;
+        u32                weight_cnt;
+        const char *const *weights;
+} NNLayerSpec;
+
+const NNLayerSpec nn_layer_specs[] = {
+    { "stem", 6, nn_stem_weights },
+    { "block", 12, nn_block_weights },
+    { "policy_head", 8, nn_policy_head_weights },
+    { "value_head", 10, nn_value_head_weights },
+};
+
+#define NN_LAYER_KIND_CNT ( sizeof( nn_layer_specs ) / sizeof( NNLayerSpec ) )
+
+void
+nn_add_layer( NN *nn, NNLayerKind kind )
+{
+        if ( nn->layer_cnt == NN_MAX_LAYERS )
+                PANIC( "too many layers in the layer graph" );
+        nn->layers[nn->layer_cnt++].kind = kind;
+}
+
+/* Read the layer graph from graph_file, see nn_new for the format. Returns 0
+ * if the file does not exist.
+ */
+int
+nn_read_graph( NN *nn, const char *graph_file )
+{
+        FILE *f = fopen( graph_file, "r" );
+        if ( f == NULL ) return 0;
+
+        char line[256];
+        while ( fgets( line, sizeof( line ), f ) != NULL ) {
+                char *comment = strchr( line, '#' );
+                if ( comment != NULL ) *comment = '\0';
+
+                char name[32];
+                u32  cnt = 1;
+                if ( sscanf( line, "%31s %u", name, &cnt ) < 1 ) continue;
+
+                u32 kind = 0;
+                while ( kind < NN_LAYER_KIND_CNT &&
+                        strcmp( nn_layer_specs[kind].name, name ) != 0 )
+                        kind++;
+                if ( kind == NN_LAYER_KIND_CNT )
+                        PANIC( "unknown layer in %s: %s", graph_file, name );
+                for ( u32 i = 0; i < cnt; i++ ) {
+                        nn_add_layer( nn, (NNLayerKind)kind );
+                }
+        }
+        fclose( f );
+        return 1;
+}
+
+/* Kind of the layer named name, i.e., its name without the trailing index.
+ * Returns NN_LAYER_KIND_CNT if unknown.
+ */
+u32
+nn_layer_kind( const char *name, size_t len )
+{
+        while ( len > 0 && name[len - 1] >= '0' && name[len - 1] <= '9' )
+                len--;
+        u32 kind = 0;
+        while ( kind < NN_LAYER_KIND_CNT &&
+                ( strlen( nn_layer_specs[kind].name ) != len ||
+                  strncmp( nn_layer_specs[kind].name, name, len ) != 0 ) )
+                kind++;
+        return kind;
+}
+
+/* Read the layer graph from the weight names of a v2 data file, i.e., a new
+ * layer starts whenever the layer name (before the first '.') changes.
+ * Returns 0 if there are no names.
+ */
+int
+nn_names_graph( NN *nn )
+{
+        if ( nn->names == NULL ) return 0;
+        for ( u32 i = 0; i < nn->weight_cnt; ) {
+                const char *name = nn->names[i];
+                const char *dot  = strchr( name, '.' );
+                size_t      len  = dot != NULL ? (size_t)( dot - name ) : 0;
+                u32         kind = nn_layer_kind( name, len );
+                if ( kind == NN_LAYER_KIND_CNT )
+                        PANIC( "unknown layer of weight %s", name );
+                nn_add_layer( nn, (NNLayerKind)kind );
+                do {
+                        i++;
+                } while ( i < nn->weight_cnt &&
+                          strncmp( nn->names[i], name, len + 1 ) == 0 );
+        }
+        return 1;
+}
+
+/* The graph of the reference model (see etc/reference_model.py): the stem, as
+ * many blocks as the weights hold, and both heads.
+ */
+void
+nn_default_graph( NN *nn )
+{
+        u32 fixed = nn_layer_specs[NN_LAYER_STEM].weight_cnt +
+                    nn_layer_specs[NN_LAYER_POLICY_HEAD].weight_cnt +
+                    nn_layer_specs[NN_LAYER_VALUE_HEAD].weight_cnt;
+        u32 block = nn_layer_specs[NN_LAYER_BLOCK].weight_cnt;
+        if ( nn->weight_cnt < fixed || ( nn->weight_cnt - fixed ) % block != 0 )
+                PANIC( "weights do not match the default layer graph" );
+
+        nn_add_layer( nn, NN_LAYER_STEM );
+        for ( u32 i = 0; i < ( nn->weight_cnt - fixed ) / block; i++ ) {
+                nn_add_layer( nn, NN_LAYER_BLOCK );
+        }
+        nn_add_layer( nn, NN_LAYER_POLICY_HEAD );
+        nn_add_layer( nn, NN_LAYER_VALUE_HEAD );
+}
+
+void
+nn_emit( NN *nn, NNOpType type, u32 weight, NNBuf dst, NNBuf src,
+         NNBuf residual, int relu )
+{
+        if ( nn->op_cnt == NN_MAX_OPS )
+                PANIC( "too many ops in the layer graph" );
+        nn->ops[nn->op_cnt++] = NNOp{ type, weight, dst, src, residual, relu };
+}
+
+/* Check the conv2d and batchnorm2d weights at w for c_in input channels.
+ * Returns C_out.
+ */
+u32
+nn_check_conv2d( NN *nn, u32 w, u32 c_in )
+{
+        Tensor *k = &nn->weights[w];
+        if ( k->dim != 4 || k->shape[1] != c_in )
+                PANIC( "conv2d weight %u does not match the layer graph", w );
+        for ( u32 i = 1; i < 6; i++ ) {
+                Tensor *t = &nn->weights[w + i];
+                if ( t->dim != 1 || t->shape[0] != k->shape[0] )
+                        PANIC( "conv2d weight %u does not match the layer "
+                               "graph",
+                               w + i );
+        }
+        return k->shape[0];
+}
+
+/* Check the linear weights at w for in_features. Returns out_features. */
+u32
+nn_check_linear( NN *nn, u32 w, u32 in_features )
+{
+        Tensor *t = &nn->weights[w];
+        Tensor *b = &nn->weights[w + 1];
+        if ( t->dim != 2 || t->shape[1] != in_features || b->dim != 1 ||
+             b->shape[0] != t->shape[0] )
+                PANIC( "linear weight %u does not match the layer graph", w );
+        return t->shape[0];
+}
+
+/* Compile the layers into ops, checked against the weight shapes.
+ *
+ * The trunk output ping-pongs between act[0] and act[1], and act[2] holds the
+ * intermediate activation of a layer. So a block reads its residual input
+ * from the trunk output while writing the other one, and both heads read the
+ * same trunk output.
+ */
+void
+nn_compile( NN *nn )
+{
+        NNBuf cur   = NN_BUF_IN; /* Trunk output. */
+        NNBuf other = NN_BUF_ACT1;
+        u32   c     = 0; /* Channels of the trunk output. */
+        u32   hw    = 0; /* Pixels, revealed by the first linear. */
+        u32   w     = 0;
+        u32   heads[NN_LAYER_KIND_CNT] = { };
+
+        for ( u32 l = 0; l < nn->layer_cnt; l++ ) {
+                NNLayer *layer    = &nn->layers[l];
+                layer->weight     = w;
+                layer->weight_cnt = nn_layer_specs[layer->kind].weight_cnt;
+                layer->op_begin   = nn->op_cnt;
+                if ( ( layer->kind == NN_LAYER_STEM ) != ( cur == NN_BUF_IN ) )
+                        PANIC( "layer %u: stem must be the first layer", l );
+                if ( layer->kind <= NN_LAYER_BLOCK &&
+                     heads[NN_LAYER_POLICY_HEAD] + heads[NN_LAYER_VALUE_HEAD] )
+                        PANIC( "layer %u: heads must be the last layers", l );
+                if ( w + layer->weight_cnt > nn->weight_cnt )
+                        PANIC( "layer graph needs more weights than %u",
+                               nn->weight_cnt );
+
+                switch ( layer->kind ) {
+                case NN_LAYER_STEM:
+                        c = nn_check_conv2d( nn, w, nn->weights[w].shape[1] );
+                        nn_emit( nn, NN_OP_CONV2D, w, NN_BUF_ACT0, cur,
+                                 NN_BUF_NONE, 1 );
+                        cur = NN_BUF_ACT0;
+                        break;
+                case NN_LAYER_BLOCK: {
+                        u32 mid = nn_check_conv2d( nn, w, c );
+                        if ( nn_check_conv2d( nn, w + 6, mid ) != c )
+                                PANIC( "layer %u: block changes the channels",
+                                       l );
+                        nn_emit( nn, NN_OP_CONV2D, w, NN_BUF_ACT2, cur,
+                                 NN_BUF_NONE, 1 );
+                        nn_emit( nn, NN_OP_CONV2D, w + 6, other, NN_BUF_ACT2,
+                                 cur, 1 );
+                        NNBuf t = cur;
+                        cur     = other;
+                        other   = t;
+                        break;
+                }
+                case NN_LAYER_POLICY_HEAD:
+                case NN_LAYER_VALUE_HEAD: {
+                        u32 hc  = nn_check_conv2d( nn, w, c );
+                        u32 in  = nn->weights[w + 6].shape[1];
+                        if ( hw == 0 && hc > 0 && in % hc == 0 ) hw = in / hc;
+                        u32 out = nn_check_linear( nn, w + 6, hc * hw );
+                        nn_emit( nn, NN_OP_CONV2D, w, NN_BUF_ACT2, cur,
+                                 NN_BUF_NONE, 1 );
+                        if ( layer->kind == NN_LAYER_POLICY_HEAD ) {
+                                nn_emit( nn, NN_OP_LINEAR, w + 6,
+                                         NN_BUF_POLICY, NN_BUF_ACT2,
+                                         NN_BUF_NONE, 0 );
+                                nn_emit( nn, NN_OP_SOFTMAX, 0, NN_BUF_POLICY,
+                                         NN_BUF_POLICY, NN_BUF_NONE, 0 );
+                        } else {
+                                nn_check_linear( nn, w + 8, out );
+                                nn_emit( nn, NN_OP_LINEAR, w + 6, other,
+                                         NN_BUF_ACT2, NN_BUF_NONE, 0 );
+                                nn_emit( nn, NN_OP_RELU, 0, other, other,
+                                         NN_BUF_NONE, 0 );
+                                nn_emit( nn, NN_OP_LINEAR, w + 8,
+                                         NN_BUF_VALUE, other, NN_BUF_NONE,
+                                         0 );
+                                nn_emit( nn, NN_OP_TANH, 0, NN_BUF_VALUE,
+                                         NN_BUF_VALUE, NN_BUF_NONE, 0 );
+                        }
+                        heads[layer->kind]++;
+                        break;
+                }
+                }
+                w += layer->weight_cnt;
+                layer->op_end = nn->op_cnt;
+        }
+
+        if ( heads[NN_LAYER_POLICY_HEAD] != 1 ||
+             heads[NN_LAYER_VALUE_HEAD] != 1 )
+                PANIC( "layer graph needs one policy_head and one value_head" );
+        if ( w != nn->weight_cnt )
+                PANIC( "layer graph uses %u of %u weights", w,
+                       nn->weight_cnt );
+}
+
+/* Read the layer graph of data_file (see nn_new) and compile it. */
+void
+nn_load_graph( NN *nn, const char *data_file )
+{
+        char graph_file[4096];
+        snprintf( graph_file, sizeof( graph_file ), "%s.graph", data_file );
+        if ( !nn_read_graph( nn, graph_file ) && !nn_names_graph( nn ) )
+                nn_default_graph( nn );
+        nn_compile( nn );
+}
+
+/* Name weight i after its layer (see nn_compile), e.g., "block0.conv1.weight".
+ */
+void
+nn_weight_name( NN *nn, u32 i, char *name )
+{
+        u32 blocks = 0;
+        for ( u32 l = 0; l < nn->layer_cnt; l++ ) {
+                NNLayer           *layer = &nn->layers[l];
+                const NNLayerSpec *spec  = &nn_layer_specs[layer->kind];
+                if ( i >= layer->weight + layer->weight_cnt ) {
+                        if ( layer->kind == NN_LAYER_BLOCK ) blocks++;
+                        continue;
+                }
+                const char *w = spec->weights[i - layer->weight];
+                if ( layer->kind == NN_LAYER_BLOCK ) {
+                        snprintf( name, NN_DATA_NAME_LEN, "%s%u.%s",
+                                  spec->name, blocks, w );
+                } else {
+                        snprintf( name, NN_DATA_NAME_LEN, "%s.%s", spec->name,
+                                  w );
+                }
+                return;
+        }
+        PANIC( "weight %u is not in the layer graph", i );
+}
+
+/* === Load time graph optimizations ---------------------------------------- */
+
+/* Fold each batchnorm2d into the conv2d right before it.
+ *
+ * With frozen mean (m) and var (v), batchnorm2d is an affine map per channel
+ *
+ *   o = i * s + (b - m * s),  where s = w / sqrt(v + eps).
+ *
+ * As conv2d is linear in its kernel (k) and bias, scaling both of channel c by
+ * s scales the output channel c by s. So the batchnorm2d is absorbed as
+ *
+ *   k' = k * s,  bias' = (bias - m) * s + b.
+ *
+ * The batchnorm2d tensors are left untouched in the weights but not used.
+ */
+void
+nn_fold_batchnorm( NN *nn )
+{
+        u32     weight_cnt = nn->weight_cnt;
+        Tensor *weights    = nn->weights;
+        for ( u32 i = 0; i < weight_cnt; i++ ) {
+                if ( weights[i].dim != 4 ) continue; /* Not conv2d. */
+
+                if ( i + 5 >= weight_cnt || weights[i + 2].dim != 1 )
+                        PANIC( "conv2d must be followed by batchnorm2d" );
+
+                Tensor *kernel = &weights[i + 0];
+                Tensor *bias   = &weights[i + 1];
+                Tensor *w      = &weights[i + 2];
+                Tensor *b      = &weights[i + 3];
+                Tensor *mean   = &weights[i + 4];
+                Tensor *var    = &weights[i + 5];
+                nn_own_weight( nn, kernel );
+                nn_own_weight( nn, bias );
+
+                u32 c_out = kernel->shape[0];
+                u32 k     = kernel->ele_total / c_out;
+                assert( c_out == bias->shape[0] );
+                assert( c_out == w->shape[0] );
+                assert( c_out == var->shape[0] );
+
+                for ( u32 c = 0; c < c_out; c++ ) {
+                        f32 scale =
+                            w->data[c] / sqrtf( var->data[c] + BN_EPS );
+                        f32 *ptr = kernel->data + c * k;
+                        for ( u32 j = 0; j < k; j++ ) {
+                                ptr[j] *= scale;
+                        }
+                        bias->data[c] =
+                            ( bias->data[c] - mean->data[c] ) * scale +
+                            b->data[c];
+                }
+                i += 5;
+        }
+}
+
+/* The batchnorm2d of feature c as o = i * scale + shift, the same way as
+ * batchnorm2d computes it. bn points to its weight, bias, mean and var.
+ */
+void
+batchnorm2d_affine( f32 *scale, f32 *shift, Tensor *bn, u32 c )
+{
+        f32 w  = bn[0].data[c];
+        f32 b  = bn[1].data[c];
+        f32 m  = bn[2].data[c];
+        f32 v  = bn[3].data[c];
+        *scale = 1.f / sqrtf( v + BN_EPS ) * w;
+        *shift = -m * *scale + b;
+}
+
+/* Compute the batchnorm2d after each conv2d as o = i * scale + shift, for the
+ * epilogue of conv2d_bn when it is not folded. bn_affine[i] of the conv2d at
+ * weight i holds C_out scales followed by C_out shifts.
+ */
+void
+nn_bn_affine_new( NN *nn )
+{
+        for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                if ( nn->weights[i].dim != 4 ) continue; /* Not conv2d. */
+
+                if ( i + 5 >= nn->weight_cnt || nn->weights[i + 2].dim != 1 )
+                        PANIC( "conv2d must be followed by batchnorm2d" );
+
+                Tensor *bn    = &nn->weights[i + 2];
+                u32     c_out = bn[0].shape[0];
+                f32    *buf   = (f32 *)malloc( sizeof( f32 ) * 2 * c_out );
+                assert( buf != NULL );
+                for ( u32 c = 0; c < c_out; c++ ) {
+                        batchnorm2d_affine( &buf[c], &buf[c_out + c], bn, c );
+                }
+                nn->bn_affine[i] = buf;
+                i += 5;
+        }
+}
+
+/* The epilogue of conv2d_bn for the conv2d at weight. */
+ConvEpilogue
+conv2d_bn_epilogue( NN *nn, u32 weight, Tensor *residual, int relu )
+{
+        ConvEpilogue ep = { NULL, NULL, NULL, relu };
+        if ( residual != NULL ) ep.residual = residual->data;
+        f32 *affine = nn->bn_affine[weight];
+        if ( affine != NULL ) {
+                ep.scale = affine;
+                ep.shift = affine + nn->weights[weight].shape[0];
+        }
+        return ep;
+}
+
+/* Run conv2d and the batchnorm2d after it, unless the batchnorm2d is folded
+ * (see nn_fold_batchnorm), then add residual (if not NULL) and relu (if relu is
+ * non-zero). All of them but the conv2d run in its epilogue. The result is
+ * written into dst.
+ */
+void
+conv2d_bn( NN *nn, Tensor *dst, Tensor *src, Tensor *residual, int relu,
+           Tensor *scratch, u32 weight )
+{
+        Tensor *weights = nn->weights;
+        Tensor *bias    = &weights[weight + 1];
+        QConv  *q       = nn->qconv[weight];
+
+        ConvEpilogue ep = conv2d_bn_epilogue( nn, weight, residual, relu );
+
+        PROF_BEGIN( t_conv );
+        if ( q != NULL ) {
+                conv2d_int8( &dst, src, q, bias, scratch, &ep );
+        } else {
+                conv2d( &dst, src, &weights[weight], bias, scratch, &ep );
+        }
+        PROF_LAYER( t_conv, q != NULL ? "conv2d_int8" : "conv2d", dst,
+                    prof_conv2d_flops( dst, &weights[weight] ) );
+}
+
+/* Map NNBuf to the tensors of the plan, with in as NN_BUF_IN. */
+void
+nn_bufs( NN *nn, Tensor *in, Tensor **bufs )
+{
+        NNPlan *plan        = &nn->plan;
+        bufs[NN_BUF_IN]     = in;
+        bufs[NN_BUF_ACT0]   = &plan->act[0];
+        bufs[NN_BUF_ACT1]   = &plan->act[1];
+        bufs[NN_BUF_ACT2]   = &plan->act[2];
+        bufs[NN_BUF_POLICY] = &plan->policy;
+        bufs[NN_BUF_VALUE]  = &plan->value;
+}
+
+/* Run one op of nn_compile. bufs maps NNBuf to the tensors. */
+void
+nn_run_op( NN *nn, const NNOp *op, Tensor **bufs )
+{
+        Tensor *dst = bufs[op->dst];
+        Tensor *src = bufs[op->src];
+        Tensor *w   = &nn->weights[op->weight];
+
+        switch ( op->type ) {
+        case NN_OP_CONV2D: {
+                Tensor *res = op->residual != NN_BUF_NONE ? bufs[op->residual]
+                                                          : NULL;
+                conv2d_bn( nn, dst, src, res, op->relu, &nn->plan.scratch,
+                           op->weight );
+                break;
+        }
+        case NN_OP_LINEAR: {
+                PROF_BEGIN( t_linear );
+                linear( &dst, src, w, w + 1 );
+                PROF_LAYER( t_linear, "linear", dst,
+                            prof_linear_flops( dst, w ) );
+                break;
+        }
+        case NN_OP_RELU: {
+                PROF_BEGIN( t_relu );
+                relu_inplace( dst );
+                PROF_LAYER( t_relu, "relu", dst, dst->ele_total );
+                break;
+        }
+        case NN_OP_SOFTMAX: {
+                /* max, sub, exp, sum and div */
+                PROF_BEGIN( t_softmax );
+                softmax_inplace( dst );
+                PROF_LAYER( t_softmax, "softmax", dst, 5 * dst->ele_total );
+                break;
+        }
+        case NN_OP_TANH: {
+                /* exp, mul, sub, add and div */
+                PROF_BEGIN( t_tanh );
+                tanh_inplace( dst );
+                PROF_LAYER( t_tanh, "tanh", dst, 5 * dst->ele_total );
+                break;
+        }
+        }
+}
+
 }  // namespace
 NN *
-nn_new( const char *data_file )
+nn_new( const char *data_file, u32 flags )
 {
         NN *nn = (NN *)malloc( sizeof( *nn ) );
         assert( nn != NULL );
-        nn->weight_cnt = 0;
-        read_tensor_data( data_file, &nn->weight_cnt, nn->weights );
+        nn->weight_cnt  = 0;
+        nn->weights     = NULL;
+        nn->names       = NULL;
+        nn->flags       = flags;
+        nn->map         = NULL;
+        nn->map_size    = 0;
+        nn->qconv       = NULL;
+        nn->bn_affine   = NULL;
+        nn->layer_cnt   = 0;
+        nn->op_cnt      = 0;
+        nn->stem_kernel = NULL;
+        nn->stem_plane  = NULL;
+        nn->base        = NULL;
+        nn->plan.buf    = NULL;
+        read_tensor_data( data_file, nn );
+        nn_load_graph( nn, data_file );
+
+        if ( flags & NN_FLAG_FOLD_BN ) {
+                nn_fold_batchnorm( nn );
+        } else {
+                nn_bn_affine_new( nn );
+        }
+        if ( flags & NN_FLAG_INT8 ) {
+                for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                        if ( !qconv_quantizable( &nn->weights[i] ) ) continue;
+                        nn->qconv[i] = qconv_quantize( &nn->weights[i] );
+                }
+        }
+        /* The incremental stem reads the kernel in the original layout. */
+        dup_tensor( &nn->stem_kernel, &nn->weights[nn->layers[0].weight],
+                    /*copy_data=*/1 );
+        /* Must be the last step as other steps assume the original layout. */
+#if defined( CONV2D_DIRECT )
+        for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                if ( !conv2d_direct_packable( &nn->weights[i] ) ) continue;
+                nn_own_weight( nn, &nn->weights[i] );
+                conv2d_direct_pack_weight( &nn->weights[i] );
+        }
+#elif !defined( CONV2D_NAIVE )
+        for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                if ( nn->weights[i].dim != 4 ) continue;
+                nn_own_weight( nn, &nn->weights[i] );
+                conv2d_blas_pack_weight( &nn->weights[i] );
+        }
+#endif
+        nn_plan_new( &nn->plan, nn->weight_cnt, nn->weights );
         return nn;
 }
 
+NN *
+nn_fork( NN *nn )
+{
+        NN *base = nn->base != NULL ? nn->base : nn;
+        NN *f    = (NN *)malloc( sizeof( *f ) );
+        assert( f != NULL );
+        *f            = *base;
+        f->base       = base;
+        f->stem_plane = NULL;
+        if ( nn->stem_plane != NULL )
+                dup_tensor( &f->stem_plane, nn->stem_plane, /*copy_data=*/1 );
+        f->plan.buf       = NULL;
+        f->plan.batch_cap = 0;
+        nn_plan_reserve( &f->plan, 1 );
+        return f;
+}
+
 void
 nn_free( NN *p )
 {
         if ( p == NULL ) return;
-        free_static_tensor_data( p->weight_cnt, p->weights );
+        if ( p->base != NULL ) { /* A fork owns its plan and stem planes. */
+                free_tensor( p->stem_plane );
+                free( p->plan.buf );
+                free( p );
+                return;
+        }
+        for ( u32 i = 0; i < p->weight_cnt; i++ ) {
+                if ( !nn_weight_mapped( p, &p->weights[i] ) )
+                        free( p->weights[i].data );
+        }
+        if ( p->map != NULL ) munmap( p->map, p->map_size );
+        for ( u32 i = 0; i < p->weight_cnt; i++ ) {
+                qconv_free( p->qconv[i] );
+                free( p->bn_affine[i] );
+        }
+        free( p->weights );
+        free( p->names );
+        free( p->qconv );
+        free( p->bn_affine );
+        free_tensor( p->stem_kernel );
+        free_tensor( p->stem_plane );
+        free( p->plan.buf );
         free( p );
 }
 
+void
+nn_save_data( const char *data_file, const char *out, NNDType dtype )
+{
+        /* As is, no load time graph optimizations. */
+        NN *nn = (NN *)calloc( 1, sizeof( *nn ) );
+        assert( nn != NULL );
+        nn->flags = NN_FLAG_NO_MMAP;
+        read_tensor_data( data_file, nn );
+        nn_load_graph( nn, data_file );
+
+        u32          cnt      = nn->weight_cnt;
+        NNDataEntry *table    = (NNDataEntry *)calloc( cnt, sizeof( *table ) );
+        void       **payloads = (void **)calloc( cnt, sizeof( void * ) );
+        assert( table != NULL && payloads != NULL );
+
+        u64 offset = sizeof( u32 ) * 4 + sizeof( *table ) * cnt;
+        for ( u32 i = 0; i < cnt; i++ ) {
+                NNDataEntry *e = &table[i];
+                Tensor      *t = &nn->weights[i];
+                nn_weight_name( nn, i, e->name );
+                /* Kernels of conv2d and linear. */
+                e->dtype = t->dim >= 2 ? (u32)dtype : (u32)NN_DTYPE_F32;
+                e->dim   = t->dim;
+                for ( u32 j = 0; j < t->dim; j++ ) e->shape[j] = t->shape[j];
+                e->size   = nn_encode( e->dtype, t, &payloads[i] );
+                e->crc    = nn_crc32( payloads[i], e->size );
+                e->offset = ( offset + NN_DATA_ALIGN - 1 ) / NN_DATA_ALIGN *
+                            NN_DATA_ALIGN;
+                offset    = e->offset + e->size;
+        }
+
+        int fd = open( out, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( fd == -1 ) PANIC( "failed to open data file %s", out );
+        u32 header[] = { NN_DATA_MAGIC, NN_DATA_VERSION, cnt,
+                         nn_crc32( table, sizeof( *table ) * cnt ) };
+        write_bytes( fd, header, sizeof( header ) );
+        write_bytes( fd, table, sizeof( *table ) * cnt );
+
+        u64 pos = sizeof( header ) + sizeof( *table ) * cnt;
+        u8  zero[NN_DATA_ALIGN] = { };
+        for ( u32 i = 0; i < cnt; i++ ) {
+                write_bytes( fd, zero, table[i].offset - pos );
+                write_bytes( fd, payloads[i], table[i].size );
+                pos = table[i].offset + table[i].size;
+                free( payloads[i] );
+        }
+        close( fd );
+
+        free( payloads );
+        free( table );
+        nn_free( nn );
+}
+
+void
+nn_save_int8( NN *nn, const char *int8_file )
+{
+        int fd = open( int8_file, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( fd == -1 ) PANIC( "failed to open int8 data file" );
+
+        u32 cnt = 0;
+        for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                if ( nn->qconv[i] != NULL ) cnt++;
+        }
+        u32 header[] = { NN_INT8_MAGIC, nn->flags & NN_FLAG_FOLD_BN, cnt };
+        write_bytes( fd, header, sizeof( header ) );
+
+        for ( u32 i = 0; i < nn->weight_cnt; i++ ) {
+                QConv *q = nn->qconv[i];
+                if ( q == NULL ) continue;
+                u32 shape[] = { i, q->c_out, q->c_in, q->kh, q->kw };
+                write_bytes( fd, shape, sizeof( shape ) );
+                write_bytes( fd, q->scale, sizeof( f32 ) * q->c_out );
+
+                u32 k = q->c_in * q->kh * q->kw;
+                for ( u32 o = 0; o < q->c_out; o++ ) {
+                        write_bytes( fd, q->weight + o * q->k_pad, k );
+                }
+                u32 zero = 0;
+                write_bytes( fd, &zero, ( 4 - q->c_out * k % 4 ) % 4 );
+        }
+        close( fd );
+}
+
+void
+nn_load_int8( NN *nn, const char *int8_file )
+{
+        int fd = open( int8_file, O_RDONLY );
+        if ( fd == -1 ) PANIC( "failed to open int8 data file" );
+
+        u32 header[3];
+        read_bytes( fd, header, sizeof( header ) );
+        if ( header[0] != NN_INT8_MAGIC ) PANIC( "not an int8 data file" );
+        if ( header[1] != ( nn->flags & NN_FLAG_FOLD_BN ) )
+                PANIC( "int8 data file has a different NN_FLAG_FOLD_BN" );
+
+        for ( u32 j = 0; j < header[2]; j++ ) {
+                u32 shape[5];
+                read_bytes( fd, shape, sizeof( shape ) );
+                u32 i = shape[0];
+                if ( i >= nn->weight_cnt )
+                        PANIC( "int8 kernel does not match the model" );
+                Tensor *t = &nn->weights[i];
+                if ( t->dim != 4 || t->shape[0] != shape[1] ||
+                     t->shape[1] != shape[2] || t->shape[2] != shape[3] ||
+                     t->shape[3] != shape[4] || !qconv_quantizable( t ) )
+                        PANIC( "int8 kernel does not match the model" );
+
+                QConv *q = qconv_new( shape[1], shape[2], shape[3], shape[4] );
+                read_bytes( fd, q->scale, sizeof( f32 ) * q->c_out );
+
+                u32 k = q->c_in * q->kh * q->kw;
+                for ( u32 o = 0; o < q->c_out; o++ ) {
+                        read_bytes( fd, q->weight + o * q->k_pad, k );
+                }
+                u32 pad;
+                read_bytes( fd, &pad, ( 4 - q->c_out * k % 4 ) % 4 );
+
+                qconv_free( nn->qconv[i] );
+                nn->qconv[i] = q;
+        }
+        close( fd );
+}
+
 void
 nn_forward( NN *nn, Tensor *in, Tensor **policy_out, Tensor **value_out )
 {
-        Tensor *input  = NULL;
-        Tensor *output = NULL;
-
-        u32 weight_idx = 0;
-
-        /* Layer 0 */
-        input = in;
-        conv2d( &output, in, &nn->weights[weight_idx + 0],
-                &nn->weights[weight_idx + 1] );
-        weight_idx += 2;
-
-        /* Layer 1 */
-        input = output;
-        batchnorm2d( &output, input, &nn->weights[weight_idx + 0],
-                     &nn->weights[weight_idx + 1], &nn->weights[weight_idx + 2],
-                     &nn->weights[weight_idx + 3] );
-        weight_idx += 4;
-
-        /* Layer 2 */
-        RESET_TENSOR( input );
-        relu_inplace( output );
-
-        /* Block 0 */
-        RESET_TENSOR( input );
-        input = output;
-        resnet_block( &output, input, &weight_idx, nn->weights );
-
-        /* Block 1 */
-        RESET_TENSOR( input );
-        input = output;
-        resnet_block( &output, input, &weight_idx, nn->weights );
-
-        /* Block 2 */
-        RESET_TENSOR( input );
-        input = output;
-        resnet_block( &output, input, &weight_idx, nn->weights );
-
-        /* Block 3 */
-        RESET_TENSOR( input );
-        input = output;
-        resnet_block( &output, input, &weight_idx, nn->weights );
-
-        /* Block 4 */
-        RESET_TENSOR( input );
-        input = output;
-        resnet_block( &output, input, &weight_idx, nn->weights );
-
-        /* Policy Head */
-        RESET_TENSOR( input );
-        input = output; /* This tensor will be re-used by value head. */
-        policy_head( &output, input, &weight_idx, nn->weights );
-        *policy_out = output;
-        output      = NULL;
-
-        /* Value Head */
-        value_head( &output, input, &weight_idx, nn->weights );
-        *value_out = output;
-        output     = NULL;
-        RESET_TENSOR( input );
-
-        /* Output tensor must be the final one. */
-        assert( weight_idx == nn->weight_cnt );
+        assert( in->shape[0] == 1 );
+        nn_forward_batch( nn, in, policy_out, value_out );
+}
+
+void
+nn_run_ops( NN *nn, Tensor *in, u32 begin, u32 end )
+{
+        assert( end <= nn->op_cnt );
+        Tensor *bufs[NN_BUF_CNT];
+        nn_bufs( nn, in, bufs );
+        for ( u32 i = begin; i < end; i++ ) {
+                nn_run_op( nn, &nn->ops[i], bufs );
+        }
+}
+
+void
+nn_forward_batch( NN *nn, Tensor *in, Tensor **policy_out, Tensor **value_out )
+{
+        assert( in->dim == 4 );
+        PROF_BEGIN( t_forward );
+        PROF_FORWARD_BEGIN( );
+        nn_plan_reserve( &nn->plan, in->shape[0] );
+#if !defined( NDEBUG ) || defined( PROFILE )
+        u64 alloc_cnt = tensor_alloc_count( );
+#endif
+        nn_run_ops( nn, in, 0, nn->op_cnt );
+        *policy_out = &nn->plan.policy;
+        *value_out  = &nn->plan.value;
+
+        /* Everything must be covered by the plan. */
+        assert( alloc_cnt == tensor_alloc_count( ) );
+        PROF_FORWARD_END( t_forward, in->shape[0],
+                          tensor_alloc_count( ) - alloc_cnt );
+}
+
+/* === Incremental stem ----------------------------------------------------- */
+
+namespace {
+
+/* Add delta times input cell (c, y, x) to the stem output (C_out, H, W) at
+ * acc, i.e., the kernel taps of channel c which read the cell.
+ */
+void
+nn_stem_footprint( Tensor *kernel, f32 *acc, u32 h, u32 w, u32 c, u32 y,
+                   u32 x, f32 delta )
+{
+        u32 c_out   = kernel->shape[0];
+        u32 c_in    = kernel->shape[1];
+        i32 kh      = (i32)kernel->shape[2];
+        i32 kw      = (i32)kernel->shape[3];
+        i32 half_kh = ( kh - 1 ) >> 1;
+        i32 half_kw = ( kw - 1 ) >> 1;
+
+        /* Output pixels (py, px) whose kernel window covers the cell. */
+        i32 y0 = (i32)y - half_kh < 0 ? 0 : (i32)y - half_kh;
+        i32 y1 = (i32)y + half_kh >= (i32)h ? (i32)h - 1 : (i32)y + half_kh;
+        i32 x0 = (i32)x - half_kw < 0 ? 0 : (i32)x - half_kw;
+        i32 x1 = (i32)x + half_kw >= (i32)w ? (i32)w - 1 : (i32)x + half_kw;
+
+        for ( u32 o = 0; o < c_out; o++ ) {
+                const f32 *k   = kernel->data + ( o * c_in + c ) * kh * kw;
+                f32       *dst = acc + o * h * w;
+                for ( i32 py = y0; py <= y1; py++ ) {
+                        /* Tap (ky, kx) = (y - py, x - px) + half. */
+                        const f32 *row = k + ( (i32)y - py + half_kh ) * kw +
+                                         (i32)x + half_kw;
+                        f32 *out = dst + py * (i32)w;
+                        for ( i32 px = x0; px <= x1; px++ ) {
+                                out[px] += delta * row[-px];
+                        }
+                }
+        }
+}
+
+/* Compute nn->stem_plane (C_in, C_out, H, W): the stem output of each input
+ * plane filled with ones, without bias.
+ */
+void
+nn_stem_plane_new( NN *nn, u32 h, u32 w )
+{
+        Tensor *kernel = nn->stem_kernel;
+        u32     c_out  = kernel->shape[0];
+        u32     c_in   = kernel->shape[1];
+        u32     size   = c_out * h * w;
+
+        u32 shape[] = { c_in, c_out, h, w };
+        free_tensor( nn->stem_plane );
+        nn->stem_plane = NULL;
+        alloc_tensor( &nn->stem_plane, 4, shape );
+        memset( nn->stem_plane->data, 0, sizeof( f32 ) * c_in * size );
+        for ( u32 c = 0; c < c_in; c++ ) {
+                for ( u32 i = 0; i < h * w; i++ ) {
+                        nn_stem_footprint( kernel,
+                                           nn->stem_plane->data + c * size, h,
+                                           w, c, i / w, i % w, 1.f );
+                }
+        }
+}
+
+}  // namespace
+
+int
+nn_stem_incremental( NN *nn )
+{
+        return nn->qconv[nn->layers[0].weight] == NULL;
+}
+
+void
+nn_stem_new( NN *nn, Tensor **acc, Tensor *in )
+{
+        Tensor *kernel = nn->stem_kernel;
+        Tensor *bias   = &nn->weights[nn->layers[0].weight + 1];
+        u32     c_out  = kernel->shape[0];
+        u32     c_in   = kernel->shape[1];
+        assert( in->dim == 4 && in->shape[0] == 1 && in->shape[1] == c_in );
+
+        u32 h = in->shape[2];
+        u32 w = in->shape[3];
+        if ( nn->stem_plane == NULL || nn->stem_plane->shape[2] != h ||
+             nn->stem_plane->shape[3] != w )
+                nn_stem_plane_new( nn, h, w );
+
+        u32 shape[] = { 1, c_out, h, w };
+        prepare_tensor( acc, 4, shape );
+        for ( u32 o = 0; o < c_out; o++ ) {
+                f32 *dst = ( *acc )->data + o * h * w;
+                for ( u32 i = 0; i < h * w; i++ ) {
+                        dst[i] = bias->data[o];
+                }
+        }
+
+        for ( u32 c = 0; c < c_in; c++ ) {
+                const f32 *plane    = in->data + c * h * w;
+                int        constant = 1;
+                for ( u32 i = 1; i < h * w; i++ ) {
+                        if ( plane[i] != plane[0] ) constant = 0;
+                }
+                if ( constant ) {
+                        if ( plane[0] != 0.f )
+                                nn_stem_add_plane( nn, *acc, c, plane[0] );
+                        continue;
+                }
+                for ( u32 i = 0; i < h * w; i++ ) {
+                        if ( plane[i] == 0.f ) continue;
+                        nn_stem_footprint( kernel, ( *acc )->data, h, w, c,
+                                           i / w, i % w, plane[i] );
+                }
+        }
+}
+
+void
+nn_stem_add( NN *nn, Tensor *acc, u32 c, u32 y, u32 x, f32 delta )
+{
+        assert( acc->dim == 4 && acc->shape[0] == 1 );
+        assert( y < acc->shape[2] && x < acc->shape[3] );
+        nn_stem_footprint( nn->stem_kernel, acc->data, acc->shape[2],
+                           acc->shape[3], c, y, x, delta );
+}
+
+void
+nn_stem_add_plane( NN *nn, Tensor *acc, u32 c, f32 delta )
+{
+        Tensor *plane = nn->stem_plane;
+        assert( plane != NULL && acc->shape[0] == 1 );
+        assert( plane->shape[2] == acc->shape[2] &&
+                plane->shape[3] == acc->shape[3] );
+
+        u32        size = acc->ele_total;
+        const f32 *src  = plane->data + c * size;
+        f32       *dst  = acc->data;
+        for ( u32 i = 0; i < size; i++ ) {
+                dst[i] += delta * src[i];
+        }
+}
+
+void
+nn_forward_stem( NN *nn, Tensor *acc, Tensor **policy_out, Tensor **value_out )
+{
+        assert( acc->dim == 4 );
+        PROF_BEGIN( t_forward );
+        PROF_FORWARD_BEGIN( );
+        nn_plan_reserve( &nn->plan, acc->shape[0] );
+#if !defined( NDEBUG ) || defined( PROFILE )
+        u64 alloc_cnt = tensor_alloc_count( );
+#endif
+        /* The stem conv2d is the only op of the stem layer. */
+        NNLayer *stem = &nn->layers[0];
+        NNOp    *op   = &nn->ops[stem->op_begin];
+        assert( stem->op_end == stem->op_begin + 1 );
+        assert( op->type == NN_OP_CONV2D && op->residual == NN_BUF_NONE );
+
+        Tensor *bufs[NN_BUF_CNT];
+        nn_bufs( nn, acc, bufs );
+        Tensor *dst = bufs[op->dst];
+        prepare_tensor( &dst, 4, acc->shape );
+
+        ConvEpilogue ep = conv2d_bn_epilogue( nn, op->weight, NULL, op->relu );
+
+        /* scale, shift and relu */
+        PROF_BEGIN( t_stem );
+        u32 c_out = acc->shape[1];
+        u32 hw    = acc->shape[2] * acc->shape[3];
+        for ( u32 i = 0; i < acc->shape[0] * c_out; i++ ) {
+                conv2d_epilogue( dst->data + i * hw, acc->data + i * hw, 1, hw,
+                                 i % c_out, i * hw, &ep );
+        }
+        PROF_LAYER( t_stem, "stem_epilogue", dst, 3 * dst->ele_total );
+
+        nn_run_ops( nn, acc, stem->op_end, nn->op_cnt );
+        *policy_out = &nn->plan.policy;
+        *value_out  = &nn->plan.value;
+
+        /* Everything must be covered by the plan. */
+        assert( alloc_cnt == tensor_alloc_count( ) );
+        PROF_FORWARD_END( t_forward, acc->shape[0],
+                          tensor_alloc_count( ) - alloc_cnt );
 }
 
 }  // namespace hermes
@@ -251,55 +1580,82 @@ conv2d1chl( f32 *out_ptr,    /* Ptr to the output */
                 }
         }
 }
+
+/* A parallel conv2d_naive splits the (sample, output channel) pairs. */
+typedef struct {
+        Tensor             *input;
+        Tensor             *weight;
+        Tensor             *bias;
+        const ConvEpilogue *ep;
+        Tensor             *dst;
+} Conv2dNaiveTask;
+
+void
+conv2d_naive_task_run( void *ctx, u32 chunk, u32 begin, u32 end )
+{
+        (void)chunk;
+        Conv2dNaiveTask *t        = (Conv2dNaiveTask *)ctx;
+        u32              c_in     = t->input->shape[1];
+        u32              c_out    = t->weight->shape[0];
+        u32              h        = t->input->shape[2];
+        u32              w        = t->input->shape[3];
+        u32              kernel_h = t->weight->shape[2];
+        u32              kernel_w = t->weight->shape[3];
+
+        for ( u32 i = begin; i < end; i++ ) {
+                u32  b       = i / c_out;
+                u32  out     = i % c_out;
+                f32 *in_buf  = t->input->data + b * c_in * h * w;
+                f32 *out_ptr = t->dst->data + ( b * c_out + out ) * h * w;
+                f32 *kernel_ptr_base =
+                    t->weight->data + out * c_in * kernel_h * kernel_w;
+                f32 bias_v = t->bias->data[out];
+
+                for ( u32 p = 0; p < h * w; p++ ) {
+                        out_ptr[p] = bias_v;
+                }
+                for ( u32 in = 0; in < c_in; in++ ) {
+                        f32 *input_ptr = in_buf + in * h * w;
+                        f32 *kernel_ptr =
+                            kernel_ptr_base + in * kernel_h * kernel_w;
+                        conv2d1chl( out_ptr, input_ptr, (i32)h, (i32)w,
+                                    kernel_ptr, (i32)kernel_h, (i32)kernel_w );
+                }
+                conv2d_epilogue( out_ptr, out_ptr, 1, h * w, out,
+                                 ( b * c_out + out ) * h * w, t->ep );
+        }
+}
+
 }  // namespace
+
 void
-conv2d_naive( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias )
+conv2d_naive( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+              Tensor *scratch, const ConvEpilogue *ep )
 {
+        (void)scratch;
         assert( input->dim == 4 );
         assert( weight->dim == 4 );
         assert( bias->dim == 1 );
 
         assert( input->shape[1] == weight->shape[1] );
         assert( weight->shape[0] == bias->shape[0] );
-        /* We assume batch size is 1 now. */
-        assert( input->shape[0] == 1 );
         /* We assume kernel size (h and w) are both odd */
         assert( weight->shape[2] % 2 == 1 );
         assert( weight->shape[3] % 2 == 1 );
 
-        u32 c_in     = input->shape[1];
-        u32 c_out    = weight->shape[0];
-        u32 h        = input->shape[2];
-        u32 w        = input->shape[3];
-        u32 kernel_h = weight->shape[2];
-        u32 kernel_w = weight->shape[3];
-
-        u32 shape[] = { 1, c_out, h, w };
-        alloc_tensor( dst, 4, shape );
-        f32 *out_buf = ( *dst )->data;
-
-        /* Naive algorithm. */
-        for ( u32 out = 0; out < c_out; out++ ) {
-                f32 *kernel_ptr_base =
-                    weight->data + out * c_in * kernel_h * kernel_w;
-                f32 bias_v = bias->data[out];
+        u32 batch = input->shape[0];
+        u32 c_out = weight->shape[0];
+        u32 h     = input->shape[2];
+        u32 w     = input->shape[3];
 
-                f32 *out_ptr = out_buf + out * h * w;
+        u32 shape[] = { batch, c_out, h, w };
+        prepare_tensor( dst, 4, shape );
 
-                for ( u32 i = 0; i < h * w; i++ ) {
-                        out_ptr[i] = bias_v;
-                }
-                for ( u32 in = 0; in < c_in; in++ ) {
-                        f32 *input_ptr = input->data + in * h * w;
-                        f32 *kernel_ptr =
-                            kernel_ptr_base + in * kernel_h * kernel_w;
-                        conv2d1chl( out_ptr, input_ptr, (i32)h, (i32)w,
-                                    kernel_ptr, (i32)kernel_h, (i32)kernel_w );
-                }
-        }
+        /* Naive algorithm, split (sample, output channel) pairs. */
+        Conv2dNaiveTask task = { input, weight, bias, ep, *dst };
+        pool_run( batch * c_out, conv2d_naive_task_run, &task );
 }
 
-#if defined( MACOS_ACCELERATE ) || defined( BLAS )
 namespace {
 
 /* A helper method of conv2d_blas to extract a block of (kernel_h x kernel_w)
@@ -342,7 +1698,8 @@ conv2d_blas_fill_channel_input( f32 *out_ptr, int h, int w, int y, int x,
 }  // namespace
 
 void
-conv2d_blas( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias )
+conv2d_blas( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+             Tensor *scratch, const ConvEpilogue *ep )
 {
         assert( input->dim == 4 );
         assert( weight->dim == 4 );
@@ -350,115 +1707,149 @@ conv2d_blas( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias )
 
         assert( input->shape[1] == weight->shape[1] );
         assert( weight->shape[0] == bias->shape[0] );
-        /* We assume batch size is 1 now. */
-        assert( input->shape[0] == 1 );
         /* We assume kernel size (h and w) are both odd */
         assert( weight->shape[2] % 2 == 1 );
         assert( weight->shape[3] % 2 == 1 );
 
+        u32 batch    = input->shape[0];
         u32 c_in     = input->shape[1];
         u32 c_out    = weight->shape[0];
         u32 h        = input->shape[2];
         u32 w        = input->shape[3];
         u32 kernel_h = weight->shape[2];
         u32 kernel_w = weight->shape[3];
+        u32 img_size = h * w;
 
-        u32 shape[] = { 1, c_out, h, w };
-        alloc_tensor( dst, 4, shape );
-        f32 *out_buf = ( *dst )->data;
+        u32 shape[] = { batch, c_out, h, w };
+        prepare_tensor( dst, 4, shape );
 
         /* === im2col ----------------------------------------------------------
          *
          * The kernel K (weight) shape is (c_out, c_in*kh*kw).
-         * We construct a new matrix B with shape (h*w, c_in*kh*kw) and do
+         * We construct a new matrix B with shape (N*h*w, c_in*kh*kw) and do
          * matmul(K, trans(B)) + bias, the result is the output.
          *
          * The idea is to extract the kernel block size patch from input and
          * fill it in the matrix B one feature channel after another. Then the
          * contracting dimension of the matmul is in fact the conv2d cross all
          * input channels. Smart.
+         *
+         * All samples in the batch are stacked in B, so the weight matrix is
+         * streamed only once for the whole batch.
          */
 
-        Tensor *col_matrix;
-        u32     shape1[] = { h * w, kernel_h * kernel_w * c_in };
-        alloc_tensor( &col_matrix, 2, shape1 );
+        const u32 matrix_w = kernel_h * kernel_w * c_in;
+        const u32 matrix_h = batch * img_size;
+
+        /* For batch size 1, the matmul output (c_out, h*w) is exactly the
+         * output tensor. Otherwise, it is (c_out, N*h*w) and needs to be
+         * transposed into (N, c_out, h*w) after matmul, so it is placed in
+         * scratch after the im2col matrix.
+         */
+        Tensor *col_matrix = scratch;
+        u32     shape1[]   = { matrix_h, matrix_w + ( batch > 1 ? c_out : 0 ) };
+        prepare_tensor( &col_matrix, 2, shape1 );
+        f32 *mm_buf = batch > 1 ? col_matrix->data + matrix_h * matrix_w
+                                : ( *dst )->data;
 
         // im2col: Favor reading over writing. For each feature channel, fill
         // the output pixel by extracting input patch.
-        const u32 matrix_w = kernel_h * kernel_w * c_in;
-        for ( u32 c = 0; c < c_in; c++ ) {
-                f32 *in_ptr_base = input->data + (u32)c * h * w;
-
-                for ( u32 row = 0; row < h; row++ ) {
-                        f32 *out_ptr_base = col_matrix->data +
-                                            ( row * w ) * matrix_w +
-                                            (u32)c * kernel_h * kernel_w;
-                        for ( u32 col = 0; col < w; col++ ) {
-                                f32 *out_ptr = out_ptr_base + col * matrix_w;
-                                f32 *in_ptr  = in_ptr_base + row * w + col;
-                                conv2d_blas_fill_channel_input(
-                                    out_ptr, (int)h, (int)w, (int)row, (int)col,
-                                    in_ptr, (int)kernel_h, (int)kernel_w );
+        for ( u32 b = 0; b < batch; b++ ) {
+                for ( u32 c = 0; c < c_in; c++ ) {
+                        f32 *in_ptr_base =
+                            input->data + ( b * c_in + c ) * img_size;
+
+                        for ( u32 row = 0; row < h; row++ ) {
+                                f32 *out_ptr_base =
+                                    col_matrix->data +
+                                    ( b * img_size + row * w ) * matrix_w +
+                                    c * kernel_h * kernel_w;
+                                for ( u32 col = 0; col < w; col++ ) {
+                                        f32 *out_ptr =
+                                            out_ptr_base + col * matrix_w;
+                                        f32 *in_ptr =
+                                            in_ptr_base + row * w + col;
+                                        conv2d_blas_fill_channel_input(
+                                            out_ptr, (int)h, (int)w, (int)row,
+                                            (int)col, in_ptr, (int)kernel_h,
+                                            (int)kernel_w );
+                                }
                         }
                 }
         }
 
-        /* Fill bias into the output buffer. */
+        /* Fill bias into the matmul output buffer. */
         for ( u32 c = 0; c < c_out; c++ ) {
                 f32  b       = bias->data[c];
-                f32 *out_ptr = out_buf + c * h * w;
-                for ( u32 n = 0; n < h * w; n++ ) {
+                f32 *out_ptr = mm_buf + c * matrix_h;
+                for ( u32 n = 0; n < matrix_h; n++ ) {
                         *out_ptr = b;
                         out_ptr++;
                 }
         }
 
         /* === The magic: matmul ---------------------------------------------*/
-        int K = (int)( kernel_h * kernel_w * c_in );
-        cblas_sgemm( CblasRowMajor, CblasNoTrans, CblasTrans, (int)c_out,
-                     (int)( h * w ), K, 1.0f,
-                     /*A=*/weight->data, K,
-                     /*B=*/col_matrix->data, K, 1.0f, /*C=*/out_buf,
-                     (int)( h * w ) );
+        u32 K = matrix_w;
+        sgemm_packed( c_out, matrix_h, K, /*A=*/weight->data,
+                      /*B=*/col_matrix->data, K, /*C=*/mm_buf, matrix_h );
+
+        /* Transpose (c_out, N, h*w) into (N, c_out, h*w), or in place for
+         * batch size 1, with the epilogue. */
+        for ( u32 b = 0; b < batch; b++ ) {
+                for ( u32 c = 0; c < c_out; c++ ) {
+                        u32 offset = ( b * c_out + c ) * img_size;
+                        conv2d_epilogue( ( *dst )->data + offset,
+                                         mm_buf + c * matrix_h + b * img_size,
+                                         1, img_size, c, offset, ep );
+                }
+        }
 
-        RESET_TENSOR( col_matrix );
+        if ( scratch == NULL ) RESET_TENSOR( col_matrix );
 }
 
-#endif  // defined(MACOS_ACCELERATE) || defined(BLAS)
-
 void
-batchnorm2d( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
-             Tensor *mean, Tensor *var )
+conv2d_blas_pack_weight( Tensor *weight )
 {
-        assert( input->dim == 4 );
-        assert( weight->dim == 1 );
-        assert( bias->dim == 1 );
-        assert( mean->dim == 1 );
-        assert( var->dim == 1 );
-
-        /* We assume batch size is 1 now. */
-        assert( input->shape[0] == 1 );
-        u32 num_features = input->shape[1];
-        assert( num_features == weight->shape[0] );
-        assert( num_features == bias->shape[0] );
-        assert( num_features == mean->shape[0] );
-        assert( num_features == var->shape[0] );
-
-        dup_tensor( dst, input, 0 );
-        f32 *out_buf = ( *dst )->data;
+        assert( weight->dim == 4 );
+        u32    c_out = weight->shape[0];
+        u32    k     = weight->ele_total / c_out; /* C_in * KH * KW */
+        size_t size  = sgemm_packed_size( c_out, k );
+
+        f32 *packed = (f32 *)malloc( sizeof( f32 ) * size );
+        assert( packed != NULL );
+        sgemm_pack( packed, c_out, k, weight->data, k );
+        free( weight->data );
+        weight->data    = packed;
+        weight->ele_cap = (u32)size;
+}
 
-        u32 h        = input->shape[2];
-        u32 w        = input->shape[3];
-        u32 img_size = h * w;
+namespace {
 
-        for ( u32 n = 0; n < num_features; n++ ) {
-                f32 *input_base_ptr  = input->data + n * img_size;
-                f32 *output_base_ptr = out_buf + n * img_size;
+/* A parallel batchnorm2d splits the features. */
+typedef struct {
+        Tensor *dst;
+        Tensor *input;
+        Tensor *weight;
+        Tensor *bias;
+        Tensor *mean;
+        Tensor *var;
+} BatchNormTask;
 
-                f32 w            = weight->data[n];
-                f32 b            = bias->data[n];
-                f32 m            = mean->data[n];
-                f32 v            = var->data[n];
+void
+batchnorm2d_task_run( void *ctx, u32 chunk, u32 begin, u32 end )
+{
+        (void)chunk;
+        BatchNormTask *t            = (BatchNormTask *)ctx;
+        u32            batch        = t->input->shape[0];
+        u32            num_features = t->input->shape[1];
+        u32            img_size     = t->input->shape[2] * t->input->shape[3];
+        f32           *out_buf      = t->dst->data;
+
+        for ( u32 n = begin; n < end; n++ ) {
+                f32 w            = t->weight->data[n];
+                f32 b            = t->bias->data[n];
+                f32 m            = t->mean->data[n];
+                f32 v            = t->var->data[n];
                 f32 inv_sqrt_v_w = 1.f / sqrtf( v + BN_EPS ) * w;
                 f32 true_bias    = -m * inv_sqrt_v_w + b;
 
@@ -469,66 +1860,42 @@ batchnorm2d( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
                  *   = i * inv_sqrt_v_w + true_bias
                  */
 
-                for ( u32 i = 0; i < img_size; i++ ) {
-                        output_base_ptr[i] =
-                            input_base_ptr[i] * inv_sqrt_v_w + true_bias;
+                for ( u32 b = 0; b < batch; b++ ) {
+                        u32 offset = ( b * num_features + n ) * img_size;
+                        f32 *input_base_ptr  = t->input->data + offset;
+                        f32 *output_base_ptr = out_buf + offset;
+                        for ( u32 i = 0; i < img_size; i++ ) {
+                                output_base_ptr[i] =
+                                    input_base_ptr[i] * inv_sqrt_v_w +
+                                    true_bias;
+                        }
                 }
         }
 }
 
-void
-relu_inplace( Tensor *t )
-{
-        u32 size = t->ele_total;
-        for ( u32 i = 0; i < size; i++ ) {
-                f32 f = t->data[i];
-                if ( f < 0 ) t->data[i] = 0.f;
-        }
-}
+}  // namespace
 
 void
-add_inplace( Tensor *dst, Tensor *src )
+batchnorm2d( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+             Tensor *mean, Tensor *var )
 {
-        assert( dst->ele_total == src->ele_total );
-        u32 size = dst->ele_total;
-        for ( u32 i = 0; i < size; i++ ) {
-                dst->data[i] += src->data[i];
-        }
-}
+        assert( input->dim == 4 );
+        assert( weight->dim == 1 );
+        assert( bias->dim == 1 );
+        assert( mean->dim == 1 );
+        assert( var->dim == 1 );
 
-void
-softmax_inplace( Tensor *dst )
-{
-        assert( dst->dim == 2 );
-        assert( dst->shape[0] == 1 );
-        u32  ele_cnt = dst->ele_total;
-        f32 *ptr     = dst->data;
-        f32  max     = ptr[0];
-        for ( u32 i = 1; i < ele_cnt; i++ ) {
-                f32 v = ptr[i];
-                if ( v > max ) max = v;
-        }
-        f32 total = 0.f;
-        for ( u32 i = 0; i < ele_cnt; i++ ) {
-                f32 v = expf( ptr[i] - max );
-                total += v;
-                ptr[i] = v;
-        }
-        for ( u32 i = 0; i < ele_cnt; i++ ) {
-                ptr[i] /= total;
-        }
-}
+        u32 num_features = input->shape[1];
+        assert( num_features == weight->shape[0] );
+        assert( num_features == bias->shape[0] );
+        assert( num_features == mean->shape[0] );
+        assert( num_features == var->shape[0] );
 
-void
-tanh_inplace( Tensor *dst )
-{
-        u32  ele_cnt = dst->ele_total;
-        f32 *ptr     = dst->data;
-        for ( u32 i = 0; i < ele_cnt; i++ ) {
-                f32 v = ptr[i];
-                ptr[i] =
-                    ( expf( v ) - expf( -v ) ) / ( expf( v ) + expf( -v ) );
-        }
+        prepare_tensor( dst, input->dim, input->shape );
+
+        /* Split the features. */
+        BatchNormTask task = { *dst, input, weight, bias, mean, var };
+        pool_run( num_features, batchnorm2d_task_run, &task );
 }
 
 void
@@ -544,135 +1911,22 @@ linear( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias )
                 ele_cnt *= input->shape[i];
         }
 
-        assert( 1 == input->shape[0] );
         assert( ele_cnt == weight->shape[1] );
         assert( weight->shape[0] == bias->shape[0] );
 
+        u32 batch   = input->shape[0];
         u32 out_dim = weight->shape[0];
 
-        u32 shape[] = { 1, out_dim };
-        alloc_tensor( dst, 2, shape );
-        f32 *out_buf = ( *dst )->data;
+        u32 shape[] = { batch, out_dim };
+        prepare_tensor( dst, 2, shape );
 
-        f32 *input_ptr = input->data;
-        for ( u32 n = 0; n < out_dim; n++ ) {
-                f32  v          = 0.f;
-                f32 *weight_ptr = weight->data + n * ele_cnt;
-                for ( u32 i = 0; i < ele_cnt; i++ ) {
-                        v += input_ptr[i] * weight_ptr[i];
-                }
-                out_buf[n] = v + bias->data[n];
+        /* Fill bias and then (B, C) x trans(N, C) on top of it. */
+        for ( u32 b = 0; b < batch; b++ ) {
+                memcpy( ( *dst )->data + b * out_dim, bias->data,
+                        sizeof( f32 ) * out_dim );
         }
-}
-
-void
-resnet_block( Tensor **dst, Tensor *src, u32 *weight_idx, Tensor *weights )
-{
-        Tensor *dup    = NULL;
-        Tensor *input  = src;
-        Tensor *output = NULL;
-
-        dup_tensor( &dup, src, /*copy_data=*/1 );
-
-        conv2d( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-
-        input = output;
-        batchnorm2d( &output, input, &weights[*weight_idx + 0],
-                     &weights[*weight_idx + 1], &weights[*weight_idx + 2],
-                     &weights[*weight_idx + 3] );
-        *weight_idx += 4;
-        RESET_TENSOR( input );
-
-        relu_inplace( output );
-
-        input = output;
-        conv2d( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-        RESET_TENSOR( input );
-
-        input = output;
-        batchnorm2d( &output, input, &weights[*weight_idx + 0],
-                     &weights[*weight_idx + 1], &weights[*weight_idx + 2],
-                     &weights[*weight_idx + 3] );
-        *weight_idx += 4;
-        RESET_TENSOR( input );
-
-        add_inplace( output, dup );
-        RESET_TENSOR( dup );
-
-        relu_inplace( output );
-        *dst = output;
-}
-
-void
-policy_head( Tensor **dst, Tensor *src, u32 *weight_idx, Tensor *weights )
-{
-        Tensor *input  = src;
-        Tensor *output = NULL;
-
-        conv2d( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-
-        input = output;
-        batchnorm2d( &output, input, &weights[*weight_idx + 0],
-                     &weights[*weight_idx + 1], &weights[*weight_idx + 2],
-                     &weights[*weight_idx + 3] );
-        *weight_idx += 4;
-        RESET_TENSOR( input );
-
-        relu_inplace( output );
-
-        input = output;
-        linear( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-        RESET_TENSOR( input );
-
-        softmax_inplace( output );
-
-        *dst = output;
-}
-
-void
-value_head( Tensor **dst, Tensor *src, u32 *weight_idx, Tensor *weights )
-{
-        Tensor *input  = src;
-        Tensor *output = NULL;
-
-        conv2d( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-
-        input = output;
-        batchnorm2d( &output, input, &weights[*weight_idx + 0],
-                     &weights[*weight_idx + 1], &weights[*weight_idx + 2],
-                     &weights[*weight_idx + 3] );
-        *weight_idx += 4;
-        RESET_TENSOR( input );
-
-        relu_inplace( output );
-
-        input = output;
-        linear( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-        RESET_TENSOR( input );
-
-        relu_inplace( output );
-
-        input = output;
-        linear( &output, input, &weights[*weight_idx + 0],
-                &weights[*weight_idx + 1] );
-        *weight_idx += 2;
-        RESET_TENSOR( input );
-
-        tanh_inplace( output );
-
-        *dst = output;
+        sgemm( batch, out_dim, ele_cnt, /*A=*/input->data, ele_cnt,
+               /*B=*/weight->data, ele_cnt, /*C=*/( *dst )->data, out_dim );
 }
 
 }  // namespace hermes
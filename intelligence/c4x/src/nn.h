@@ -5,50 +5,453 @@
 
 #include "tensor.h"
 
-#define MAX_TENSOR_LIMIT 128 /* Max number of tensors. */
+#define NN_PLAN_ACT_CNT 3   /* Number of activation buffers in the plan. */
+#define NN_MAX_LAYERS   64  /* Max number of layers in the layer graph. */
+#define NN_MAX_OPS      256 /* Max number of ops compiled from the layers. */
 
-#if defined( MACOS_ACCELERATE ) || defined( BLAS )
+/* Flags for nn_new to control load time graph optimizations. */
+#define NN_FLAG_NONE    0x0 /* Use the model as is. */
+#define NN_FLAG_FOLD_BN 0x1 /* Fold batchnorm2d into the conv2d before it. */
+#define NN_FLAG_NO_MMAP 0x2 /* Read weights into heap rather than mmap. */
+#define NN_FLAG_INT8    0x4 /* Quantise conv2d kernels to INT8 at load time. */
+#define NN_FLAG_CRC32   0x8 /* Check the CRC-32 of mapped v2 payloads too. */
+
+#define NN_INT8_MAGIC 0x38513443 /* "C4Q8", magic of the INT8 data file. */
+
+#define NN_DATA_MAGIC    0x54583443 /* "C4XT", magic of the v2 data file. */
+#define NN_DATA_VERSION  2          /* Version of the v2 data file. */
+#define NN_DATA_ALIGN    64         /* Alignment of v2 tensor payloads. */
+#define NN_DATA_NAME_LEN 32         /* Bytes of a v2 tensor name. */
+
+#define CONV2D_DIRECT_BLOCK 16 /* Output channels per block in conv2d_direct. */
+
+#define QCONV_K_ALIGN   64 /* Kernel rows of conv2d_int8 are padded to this. */
+#define QCONV_MIN_C_OUT 16 /* Smaller conv2d (heads) stay in f32. */
+
+/* Select the conv2d implementation, see the Makefile knob CONV2D. By default,
+ * conv2d_blas is used if BLAS is available; otherwise conv2d_direct.
+ */
+#if defined( CONV2D_NAIVE )
+#define conv2d conv2d_naive
+#elif defined( CONV2D_BLAS ) ||     \
+    ( !defined( CONV2D_DIRECT ) && \
+      ( defined( MACOS_ACCELERATE ) || defined( BLAS ) ) )
 #define conv2d conv2d_blas
 #else
-#define conv2d conv2d_naive
+#ifndef CONV2D_DIRECT
+#define CONV2D_DIRECT
+#endif
+#define conv2d conv2d_direct
 #endif
 
 namespace hermes {
 
 /* === --- NN Related Data Structures ----------------------------------- === */
+
+/* Static memory plan for nn_forward.
+ *
+ * The plan is computed once by nn_new from the weight shapes. All tensors
+ * below are views into one heap buffer (buf), so nn_forward runs without any
+ * heap traffic. The buffer is sized for batch_cap samples and only grows when
+ * a larger batch shows up in nn_forward_batch.
+ *
+ * - act:     Activation buffers. Two ping-pong between layers and the third
+ *            one keeps the residual input of the resnet block alive.
+ * - scratch: Scratch space for conv2d, e.g., the im2col matrix.
+ * - policy:  Output of the policy head.
+ * - value:   Output of the value head.
+ */
+typedef struct {
+        u32 batch_cap;   /* Max batch size buf can hold. */
+        u32 act_cap;     /* Capacity of each act tensor per sample. */
+        u32 scratch_cap; /* Capacity of scratch tensor per sample. */
+        u32 tile_cap;    /* Scratch for all threads, whatever the batch. */
+        u32 out_cap;     /* Capacity of each output tensor per sample. */
+
+        f32   *buf; /* Owned. Backs all tensors below. */
+        Tensor act[NN_PLAN_ACT_CNT];
+        Tensor scratch;
+        Tensor policy;
+        Tensor value;
+} NNPlan;
+
+/* Element type of a tensor payload in the v2 data file, see nn_new. */
+typedef enum {
+        NN_DTYPE_F32,
+        NN_DTYPE_F16,  /* IEEE 754 half precision. */
+        NN_DTYPE_BF16, /* Upper 16 bits of f32. */
+        NN_DTYPE_I8,   /* Symmetric, one f32 scale per row (shape[0]). */
+} NNDType;
+
+/* One tensor in the table of the v2 data file. */
+typedef struct {
+        char name[NN_DATA_NAME_LEN]; /* NUL terminated. */
+        u32  dtype;                  /* NNDType. */
+        u32  dim;
+        u32  shape[MAX_DIM_LIMIT];
+        u64  offset; /* From the start of the file, NN_DATA_ALIGN aligned. */
+        u64  size;   /* Bytes of the payload. */
+        u32  crc;    /* CRC-32 of the payload. */
+        u32  reserved;
+} NNDataEntry;
+
+/* Layers of the layer graph, see nn_new. Each one consumes a fixed number of
+ * weights, in the order of the data file:
+ * - stem:        conv2d, batchnorm2d and relu (6 weights).
+ * - block:       resnet block, i.e., two conv2d and batchnorm2d, residual add
+ *                and relu (12 weights).
+ * - policy_head: conv2d, batchnorm2d, relu, linear and softmax (8 weights).
+ * - value_head:  conv2d, batchnorm2d, relu, linear, relu, linear and tanh (10
+ *                weights).
+ * The channel widths follow the weight shapes.
+ */
+typedef enum {
+        NN_LAYER_STEM,
+        NN_LAYER_BLOCK,
+        NN_LAYER_POLICY_HEAD,
+        NN_LAYER_VALUE_HEAD,
+} NNLayerKind;
+
+typedef struct {
+        NNLayerKind kind;
+        u32         weight;     /* Index of the first weight. */
+        u32         weight_cnt; /* Number of weights. */
+        u32         op_begin;   /* Ops [op_begin, op_end) of the layer. */
+        u32         op_end;
+} NNLayer;
+
+/* Buffers ops read and write: the forward input and the plan tensors. */
+typedef enum {
+        NN_BUF_IN,
+        NN_BUF_ACT0,
+        NN_BUF_ACT1,
+        NN_BUF_ACT2,
+        NN_BUF_POLICY,
+        NN_BUF_VALUE,
+        NN_BUF_CNT,
+        NN_BUF_NONE = NN_BUF_CNT,
+} NNBuf;
+
+typedef enum {
+        NN_OP_CONV2D, /* conv2d, batchnorm2d and the epilogue. */
+        NN_OP_LINEAR,
+        NN_OP_RELU,
+        NN_OP_SOFTMAX,
+        NN_OP_TANH,
+} NNOpType;
+
+/* One op of the compiled plan, with buffers assigned at load time. In place
+ * ops (relu, softmax and tanh) have src equal to dst.
+ */
+typedef struct {
+        NNOpType type;
+        u32      weight;   /* First weight of conv2d and linear. */
+        NNBuf    dst;
+        NNBuf    src;
+        NNBuf    residual; /* Added in the conv2d epilogue, or NN_BUF_NONE. */
+        int      relu;     /* Non-zero if relu is in the conv2d epilogue. */
+} NNOp;
+
+/* INT8 kernel of a conv2d for conv2d_int8.
+ *
+ * The (C_out, C_in, KH, KW) kernel is quantised with one symmetric scale per
+ * output channel, i.e., kernel[o] ~= weight[o] * scale[o]. Each row is zero
+ * padded from C_in*KH*KW to k_pad.
+ */
 typedef struct {
-        u32    weight_cnt;                /* Total number of weights. */
-        Tensor weights[MAX_TENSOR_LIMIT]; /* All weights. */
+        u32  c_out, c_in, kh, kw;
+        u32  k_pad;  /* C_in*KH*KW rounded up to QCONV_K_ALIGN. */
+        i8  *weight; /* Owned. (C_out, k_pad). */
+        f32 *scale;  /* Owned. (C_out). */
+} QConv;
+
+typedef struct NN {
+        u32     flags;                     /* NN_FLAG_* used by nn_new. */
+        u32     weight_cnt;                /* Total number of weights. */
+        Tensor *weights;                   /* Owned. All weights. */
+        char  (*names)[NN_DATA_NAME_LEN];  /* Owned. Weight names, or NULL. */
+        u32     layer_cnt;                 /* Number of layers. */
+        NNLayer layers[NN_MAX_LAYERS];     /* Layer graph. */
+        u32     op_cnt;                    /* Number of ops. */
+        NNOp    ops[NN_MAX_OPS];           /* Ops compiled from the layers. */
+        NNPlan  plan;                      /* Memory plan for nn_forward. */
+        void   *map;                       /* Mapped data file or NULL. */
+        size_t  map_size;                  /* Size of map in bytes. */
+        QConv **qconv;                     /* Owned. INT8 kernel or NULL. */
+        f32   **bn_affine;                 /* Owned. See nn_bn_affine_new. */
+        Tensor *stem_kernel;               /* Owned. Stem kernel, not packed. */
+        Tensor *stem_plane;                /* Owned. See nn_stem_new. */
+        NN     *base;                      /* Unowned. See nn_fork, or NULL. */
 } NN;
 
-NN  *nn_new( const char *data_file );
+/* Load the model from data_file. The flags (NN_FLAG_*) control the load time
+ * graph optimizations, which do not change the model outputs beyond f32
+ * rounding errors.
+ *
+ * The layer graph is read from the sidecar file data_file + ".graph" if it
+ * exists, one layer (NNLayerKind without NN_LAYER_, lower case) per line with
+ * an optional repeat count, and # for comments
+ *
+ *     stem
+ *     block 5
+ *     policy_head
+ *     value_head
+ *
+ * Otherwise, the graph above is assumed with the block count derived from the
+ * number of weights. Both heads must come last and read the trunk output. The
+ * graph is compiled into ops (NNOp) with the buffers assigned, and checked
+ * against the weight shapes, so models of other depths and widths load
+ * without code changes.
+ *
+ * A v2 data file names its weights after the layers, e.g.,
+ * "block0.conv1.weight" (see nn_save_data), and the graph follows the names
+ * unless the sidecar file exists.
+ *
+ * The data file is mapped read only and weights point into the mapping, so
+ * processes on one host share one page cache copy of the weights and loading
+ * does not copy them. Weights rewritten at load time (folded, packed or stored
+ * in other than f32) get private heap copies. If the file cannot be mapped, or
+ * NN_FLAG_NO_MMAP is set, all weights are read into heap.
+ *
+ * The data file is in either format below, told apart by the first u32, all in
+ * little endian.
+ *
+ * v1, see read_tensor_data:
+ * - u32 count of tensors, then the shape of each tensor as u32 dim followed by
+ *   dim u32s, then the f32 data of all tensors back to back.
+ *
+ * v2, written by nn_save_data:
+ * - Header: u32 NN_DATA_MAGIC, u32 NN_DATA_VERSION, u32 count of tensors and
+ *   u32 CRC-32 of the table.
+ * - Table: one NNDataEntry per tensor, in the order of the weights.
+ * - Payloads: each one at its offset (NN_DATA_ALIGN aligned, zero padded in
+ *   between) in its dtype. An NN_DTYPE_I8 payload is shape[0] f32 scales
+ *   followed by the i8 values, i.e., value = i8 * scale[row]. Payloads other
+ *   than f32 are converted to f32 at load time.
+ * The CRC-32 of the table, and of each payload read or converted, are checked
+ * at load time. The f32 payloads mapped in place are only checked with
+ * NN_FLAG_CRC32, as that reads the whole file at load time.
+ */
+NN  *nn_new( const char *data_file, u32 flags );
 void nn_free( NN *p );
+
+/* Returns a fork of nn, which shares the weights, layer graph and INT8 kernels
+ * of nn but has its own memory plan and stem planes. So the forks of one nn
+ * (and nn itself) can run nn_forward and the incremental stem concurrently,
+ * e.g., one per search thread, without copying the weights. The fork of a fork
+ * shares the same base NN, which must outlive its forks and not change (e.g.,
+ * nn_load_int8) while they exist. Forks are freed by nn_free.
+ */
+NN *nn_fork( NN *nn );
+
+/* Save the weights of data_file (v1 or v2) into the v2 data_file out, with the
+ * kernels of conv2d and linear in dtype and all other weights (biases and
+ * batchnorm2d) in f32. The weights are named after the layer graph of
+ * data_file, see nn_new.
+ */
+void nn_save_data( const char *data_file, const char *out, NNDType dtype );
+
+/* Save the INT8 conv2d kernels of nn (see NN_FLAG_INT8) into file, or load
+ * them from file produced by the same data file and NN_FLAG_FOLD_BN. With INT8
+ * kernels, the conv2d layers run conv2d_int8.
+ *
+ * The INT8 data file specification, all in little endian:
+ * - u32 magic (NN_INT8_MAGIC), u32 NN_FLAG_FOLD_BN bit of the nn and u32 count
+ *   of kernels.
+ * - For each kernel, u32 weight index and its shape (C_out, C_in, KH, KW) in
+ *   u32s, then C_out f32 scales and C_out*C_in*KH*KW i8 kernel, padded with
+ *   zeros to a multiple of 4 bytes.
+ */
+void nn_save_int8( NN *nn, const char *int8_file );
+void nn_load_int8( NN *nn, const char *int8_file );
+
+/* Run the model on input (1, 3, ROWS, COLS).
+ *
+ * The policy_out and value_out are owned by the nn (see NNPlan) and are only
+ * valid until next nn_forward call. Callers must not free them.
+ */
 void nn_forward( NN *nn, Tensor *in, Tensor **policy_out, Tensor **value_out );
 
+/* Run the model on a batch of inputs (N, 3, ROWS, COLS).
+ *
+ * The policy_out has shape (N, ROWS*COLS) and value_out has shape (N, 1). Same
+ * as nn_forward, both are owned by the nn.
+ */
+void nn_forward_batch( NN *nn, Tensor *in, Tensor **policy_out,
+                       Tensor **value_out );
+
+/* Run the ops [begin, end) on input (N, 3, ROWS, COLS), e.g., the ops of one
+ * layer (NNLayer). The plan must hold the batch (nn_forward_batch on N samples
+ * ran before), and the buffers the ops read are left by the previous ops.
+ */
+void nn_run_ops( NN *nn, Tensor *in, u32 begin, u32 end );
+
+/* === Incremental stem -------------------------------------------------------
+ *
+ * The output of the stem conv2d before its epilogue (the accumulator) is
+ * linear in the input. For a sparse input which changes by a few cells between
+ * positions, e.g., one stone and the next player plane per move, the
+ * accumulator is updated by adding the kernel footprint of the changed cells
+ * rather than running the stem conv2d again. It matches the stem conv2d up to
+ * the f32 summation order.
+ *
+ *     nn_stem_new( nn, &acc, in );              // once, for the root
+ *     nn_stem_add( nn, acc, c, y, x, 1.f );     // stone placed
+ *     nn_stem_add_plane( nn, acc, c, -1.f );    // constant plane cleared
+ *     nn_forward_stem( nn, acc, &policy, &value );
+ *
+ * Like nn_forward, they use state in nn (the plane footprints) and must not run
+ * concurrently on one nn, see nn_fork.
+ */
+
+/* Non-zero if the stem runs in f32, i.e., its kernel is not INT8, so the
+ * accumulator matches the model.
+ */
+int nn_stem_incremental( NN *nn );
+
+/* Compute the accumulator (1, C_out, H, W) of input (1, C_in, H, W) from
+ * scratch, into *acc (see prepare_tensor). Constant input planes take the
+ * precomputed footprint of the whole plane, other cells one footprint each.
+ */
+void nn_stem_new( NN *nn, Tensor **acc, Tensor *in );
+
+/* Add delta times input cell (c, y, x), or the whole input plane c, to acc. */
+void nn_stem_add( NN *nn, Tensor *acc, u32 c, u32 y, u32 x, f32 delta );
+void nn_stem_add_plane( NN *nn, Tensor *acc, u32 c, f32 delta );
+
+/* Same as nn_forward_batch but start from the accumulators (N, C_out, H, W),
+ * i.e., run the stem epilogue and all layers after the stem.
+ */
+void nn_forward_stem( NN *nn, Tensor *acc, Tensor **policy_out,
+                      Tensor **value_out );
+
 /* === --- ML Related Data Structures ----------------------------------- === */
+/* All layers below write the result into *dst. If *dst is NULL, a new tensor
+ * is allocated; otherwise, its buffer is reused (see prepare_tensor).
+ */
+
+/* Epilogue fused into the output store of conv2d. Each output v (with bias) of
+ * channel c at index i becomes
+ *
+ *     v = v * scale[c] + shift[c] + residual[i],  then max(v, 0) if relu,
+ *
+ * while the output tile is still in cache, so the model needs no separate
+ * batchnorm2d, add and relu passes over the activations.
+ */
+typedef struct {
+        const f32 *scale;    /* (C_out) or NULL, for batchnorm2d not folded. */
+        const f32 *shift;    /* (C_out), used with scale. */
+        const f32 *residual; /* Same layout as the output, or NULL. */
+        int        relu;
+} ConvEpilogue;
+
+/* Store n conv2d outputs of channel c, read from src (stride apart), into dst
+ * at offset of the output tensor with the epilogue ep applied. If ep is NULL,
+ * it is a plain copy. dst may be src if stride is 1.
+ */
+void conv2d_epilogue( f32 *dst, const f32 *src, u32 stride, u32 n, u32 c,
+                      size_t offset, const ConvEpilogue *ep );
+
 /* Conv2D on a 4D (N, C_in, H, W) input tensor with
  * - (C_out, C_in, KH, KW) * kernel (weight) and
  * - (C_out) bias.
  *
  * NOTE:
- * - This naive implementation assumes batch size is 1, i.e., N=1;
  * - This naive implementation assumes conv2d is same padding, KH and KW are
  *   both odd numbers.
+ * - The scratch is not used. It is accepted to share signature with other
+ *   conv2d implementations.
+ * - All conv2d implementations apply the epilogue ep (or none if NULL) on the
+ *   output, see ConvEpilogue. The residual must not be the output.
  */
-void conv2d_naive( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias );
+void conv2d_naive( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+                   Tensor *scratch, const ConvEpilogue *ep );
 
 /* Conv2D on a 4D (N, C_in, H, W) input tensor with
  * - (C_out, C_in, KH, KW) * kernel (weight) and
  * - (C_out) bias.
  *
  * NOTE:
- * - This implementation assumes batch size is 1, i.e., N=1;
  * - This implementation assumes conv2d is same padding, KH and KW are
  *   both odd numbers.
- * - This implementation uses im2col and cblas_sgemm to do the trick for
- *   speeding up.
+ * - The weight must have been packed by conv2d_blas_pack_weight.
+ * - This implementation uses im2col and sgemm to do the trick for speeding
+ *   up. All samples share one matmul. sgemm uses BLAS if available, or the
+ *   built-in one, so this works without any external dependency.
+ * - The im2col matrix is stored in scratch, which needs (N*H*W) x
+ *   (C_in*KH*KW) capacity, plus (N*H*W) x C_out if N > 1 for the matmul
+ *   output. If scratch is NULL, a temporary tensor is allocated.
  */
-void conv2d_blas( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias );
+void conv2d_blas( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+                  Tensor *scratch, const ConvEpilogue *ep );
+
+/* Conv2D on a 4D (N, C_in, H, W) input tensor with
+ * - (C_out, C_in, KH, KW) * kernel (weight) and
+ * - (C_out) bias.
+ *
+ * NOTE:
+ * - This implementation assumes conv2d is same padding, KH and KW are
+ *   both odd numbers.
+ * - If the weight is packable (conv2d_direct_packable), it must have been
+ *   packed by conv2d_direct_pack_weight. Otherwise, conv2d_naive is used.
+ * - This implementation does the conv2d directly, without im2col, by SIMD
+ *   kernels specialized for the model shapes (5x5 kernel on 6x7 input). The
+ *   instruction set (AVX-512 or AVX2) is dispatched at runtime. Other shapes
+ *   and CPUs use a generic kernel.
+ * - The zero padded input is stored in scratch, which needs N x C_in x
+ *   (H+KH-1) x (W+KW-1) plus POOL_MAX_THREADS x (H*W) x CONV2D_DIRECT_BLOCK
+ *   (one tile per thread) capacity. If scratch is NULL, a temporary tensor is
+ *   allocated.
+ * - The (block, sample) pairs are split over the thread pool.
+ */
+void conv2d_direct( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
+                    Tensor *scratch, const ConvEpilogue *ep );
+
+/* Conv2D on a 4D (N, C_in, H, W) input tensor with
+ * - (C_out, C_in, KH, KW) * kernel (weight) quantised in q and
+ * - (C_out) bias.
+ *
+ * NOTE:
+ * - This implementation assumes conv2d is same padding, KH and KW are
+ *   both odd numbers.
+ * - The input must be non-negative (model input or relu output). Each sample
+ *   is quantised to UINT8 with one scale, and multiplied with the INT8 kernel
+ *   with INT32 accumulation (VNNI or AVX2 dispatched at runtime). The output
+ *   is requantised to f32.
+ * - The quantised input and its im2col matrix are stored in scratch, which
+ *   needs N + (C_in*H*W + N*H*W*k_pad)/4 capacity. If scratch is NULL, a
+ *   temporary tensor is allocated.
+ */
+void conv2d_int8( Tensor **dst, Tensor *input, QConv *q, Tensor *bias,
+                  Tensor *scratch, const ConvEpilogue *ep );
+
+/* Returns non-zero if weight can be quantised by qconv_quantize, i.e., C_out
+ * is at least QCONV_MIN_C_OUT and the kernel size is odd.
+ */
+int qconv_quantizable( Tensor *weight );
+
+/* Quantise the (C_out, C_in, KH, KW) weight into a new QConv. */
+QConv *qconv_quantize( Tensor *weight );
+
+/* Allocate a zero QConv for the shape, and free it. */
+QConv *qconv_new( u32 c_out, u32 c_in, u32 kh, u32 kw );
+void   qconv_free( QConv *q );
+
+/* Returns non-zero if weight can be packed for conv2d_direct, i.e., C_out is
+ * multiple of CONV2D_DIRECT_BLOCK and the kernel is square with odd size.
+ */
+int conv2d_direct_packable( Tensor *weight );
+
+/* Repack the (C_out, C_in, KH, KW) weight in place into blocked layout
+ * (C_out/BLOCK, C_in, KH, KW, BLOCK) for conv2d_direct. The shape is unchanged.
+ */
+void conv2d_direct_pack_weight( Tensor *weight );
+
+/* Repack the (C_out, C_in, KH, KW) weight into the GEMM panels of sgemm_pack
+ * for conv2d_blas. The shape is unchanged, but the data buffer is replaced by
+ * a larger one (ele_cap), so the weight must own its buffer.
+ */
+void conv2d_blas_pack_weight( Tensor *weight );
 
 /* Batch norm on a 4D (N, C, H, W) input tensor.
  *
@@ -59,7 +462,7 @@ void conv2d_blas( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias );
  * spatial dimension (HxW). However, in the channel dimension C the weights are
  * not shared.
  *
- * NOTE: This naive implementation assumes batch size is 1, i.e., N=1;
+ * NOTE: It is OK to do it in place, i.e., *dst is input.
  */
 void batchnorm2d( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
                   Tensor *mean, Tensor *var );
@@ -67,39 +470,37 @@ void batchnorm2d( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias,
 /* Relu performs max(0, x) for each element x. For performance, this layer does
  * in place update.
  *
- * NOTE: We could fuse this with previous layer to avoid one more mem reading.
+ * NOTE: The relu after conv2d is fused into its epilogue, see ConvEpilogue.
  */
 void relu_inplace( Tensor *t );
 
-/* Add is the Residual add in the resnet block. For performance, this layer does
- * in place update to the dst.
+/* Add performs element wise add. For performance, this layer does in place
+ * update to the dst.
  *
- * NOTE: We could fuse this with previous layer to avoid one more mem reading.
+ * NOTE: The residual add of the resnet block is fused into the conv2d
+ * epilogue, see ConvEpilogue.
  */
 void add_inplace( Tensor *dst, Tensor *src );
 
-/* Perform softmax on the 1-st dim (0-based). For performance, this layer does
- * in place update.
+/* Perform softmax on the 1-st dim (0-based) of a 2D (N, C) tensor. For
+ * performance, this layer does in place update.
  *
- * NOTE:
- * - batch size is assume to be 1.
+ * NOTE: exp is a vectorised polynomial approximation, within 1e-6 relative
+ * error of expf.
  */
 void softmax_inplace( Tensor *dst );
 
-/* Tanh performs element wise tanh op on input. */
+/* Tanh performs element wise tanh op on input, by the same exp approximation
+ * as softmax_inplace, within 1e-6 absolute error of tanhf.
+ */
 void tanh_inplace( Tensor *dst );
 
-/* Linear layer to perform matmul on (1, C) x (C, N) = (1, N).
+/* Linear layer to perform matmul on (B, C) x (C, N) = (B, N).
  *
  * NOTE
- * - Batch size is assumed to be 1.
  * - The weight matrix is assumed to have shape (N, C) rather than (C, N)
  * - Input is OK to have more than 2 dim, and we implicitly do a flatten.
+ * - The matmul is done by sgemm.
  */
 void linear( Tensor **dst, Tensor *input, Tensor *weight, Tensor *bias );
-
-void resnet_block( Tensor **dst, Tensor *src, u32 *weight_idx,
-                   Tensor *weights );
-void policy_head( Tensor **dst, Tensor *src, u32 *weight_idx, Tensor *weights );
-void value_head( Tensor **dst, Tensor *src, u32 *weight_idx, Tensor *weights );
 }  // namespace hermes
@@ -0,0 +1,192 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+
+#include "log.h"
+
+namespace hermes {
+
+namespace {
+
+/* === Pool -------------------------------------------------------------------
+ *
+ * Each pool_run publishes one job (fn, ctx, total) and bumps the generation.
+ * Worker i (1-based, the caller is 0) wakes up, runs chunk i if any, and
+ * decrements pending. The caller runs chunk 0 and waits for pending to drop
+ * to 0.
+ */
+
+typedef struct {
+        pthread_mutex_t mu;      /* Guards all fields below. */
+        pthread_cond_t  work_cv; /* Signaled when a new job is published. */
+        pthread_cond_t  done_cv; /* Signaled when pending drops to 0. */
+        pthread_mutex_t run_mu;  /* Held by the caller of the running job. */
+
+        u64    gen;     /* Generation of the current job. */
+        u64    gen0;    /* Generation when workers were started. */
+        u32    pending; /* Workers not done with the current job. */
+        int    stop;    /* Set to stop all workers. */
+        PoolFn fn;
+        void  *ctx;
+        u32    total;
+        u32    chunks; /* Number of chunks of the current job. */
+
+        /* Including the caller. 0 if not started. Written under run_mu, and
+         * read under it except by pool_thread_cnt. */
+        u32       thread_cnt;
+        pthread_t threads[POOL_MAX_THREADS];
+        u32       ids[POOL_MAX_THREADS];
+} Pool;
+
+Pool pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+    0,
+    0,
+    0,
+    0,
+    NULL,
+    NULL,
+    0,
+    0,
+    0,
+    { },
+    { },
+};
+
+/* Set inside a chunk, so nested pool_run runs inline. */
+thread_local int pool_in_chunk = 0;
+
+void
+pool_run_chunk( PoolFn fn, void *ctx, u32 total, u32 chunks, u32 i )
+{
+        u32 begin = (u32)( (u64)total * i / chunks );
+        u32 end   = (u32)( (u64)total * ( i + 1 ) / chunks );
+        if ( begin == end ) return;
+        pool_in_chunk = 1;
+        fn( ctx, i, begin, end );
+        pool_in_chunk = 0;
+}
+
+void *
+pool_worker( void *arg )
+{
+        u32 id = *(u32 *)arg;
+        /* Not pool.gen, as a job might have been published already. */
+        u64 seen = pool.gen0;
+
+        pthread_mutex_lock( &pool.mu );
+        while ( 1 ) {
+                while ( pool.gen == seen && !pool.stop ) {
+                        pthread_cond_wait( &pool.work_cv, &pool.mu );
+                }
+                if ( pool.stop ) break;
+                seen          = pool.gen;
+                PoolFn fn     = pool.fn;
+                void  *ctx    = pool.ctx;
+                u32    total  = pool.total;
+                u32    chunks = pool.chunks;
+                pthread_mutex_unlock( &pool.mu );
+
+                if ( id < chunks ) pool_run_chunk( fn, ctx, total, chunks, id );
+
+                pthread_mutex_lock( &pool.mu );
+                if ( --pool.pending == 0 ) pthread_cond_signal( &pool.done_cv );
+        }
+        pthread_mutex_unlock( &pool.mu );
+        return NULL;
+}
+
+/* Stop and join all workers. Caller must hold run_mu. */
+void
+pool_stop( void )
+{
+        if ( pool.thread_cnt <= 1 ) return;
+        pthread_mutex_lock( &pool.mu );
+        pool.stop = 1;
+        pthread_cond_broadcast( &pool.work_cv );
+        pthread_mutex_unlock( &pool.mu );
+        for ( u32 i = 1; i < pool.thread_cnt; i++ ) {
+                pthread_join( pool.threads[i], NULL );
+        }
+        pool.stop = 0;
+}
+
+/* Start cnt-1 workers. Caller must hold run_mu. */
+void
+pool_start( u32 cnt )
+{
+        assert( cnt >= 1 && cnt <= POOL_MAX_THREADS );
+        pool.gen0 = pool.gen;
+        for ( u32 i = 1; i < cnt; i++ ) {
+                pool.ids[i] = i;
+                if ( pthread_create( &pool.threads[i], NULL, pool_worker,
+                                     &pool.ids[i] ) != 0 )
+                        PANIC( "failed to create pool thread" );
+        }
+        __atomic_store_n( &pool.thread_cnt, cnt, __ATOMIC_RELEASE );
+}
+
+}  // namespace
+
+void
+pool_run( u32 total, PoolFn fn, void *ctx )
+{
+        if ( total == 0 ) return;
+        if ( total == 1 || pool_in_chunk ||
+             pthread_mutex_trylock( &pool.run_mu ) != 0 ) {
+                fn( ctx, 0, 0, total );
+                return;
+        }
+
+        if ( pool.thread_cnt == 0 ) pool_start( POOL_THREADS );
+        u32 workers = pool.thread_cnt - 1;
+        if ( workers == 0 ) {
+                pthread_mutex_unlock( &pool.run_mu );
+                fn( ctx, 0, 0, total );
+                return;
+        }
+
+        u32 chunks = total < pool.thread_cnt ? total : pool.thread_cnt;
+
+        pthread_mutex_lock( &pool.mu );
+        pool.fn      = fn;
+        pool.ctx     = ctx;
+        pool.total   = total;
+        pool.chunks  = chunks;
+        pool.pending = workers;
+        pool.gen++;
+        pthread_cond_broadcast( &pool.work_cv );
+        pthread_mutex_unlock( &pool.mu );
+
+        pool_run_chunk( fn, ctx, total, chunks, 0 );
+
+        pthread_mutex_lock( &pool.mu );
+        while ( pool.pending != 0 ) {
+                pthread_cond_wait( &pool.done_cv, &pool.mu );
+        }
+        pthread_mutex_unlock( &pool.mu );
+        pthread_mutex_unlock( &pool.run_mu );
+}
+
+void
+pool_set_thread_cnt( u32 cnt )
+{
+        assert( cnt >= 1 && cnt <= POOL_MAX_THREADS );
+        pthread_mutex_lock( &pool.run_mu );
+        pool_stop( );
+        pool_start( cnt );
+        pthread_mutex_unlock( &pool.run_mu );
+}
+
+u32
+pool_thread_cnt( void )
+{
+        u32 cnt = __atomic_load_n( &pool.thread_cnt, __ATOMIC_ACQUIRE );
+        return cnt == 0 ? POOL_THREADS : cnt;
+}
+
+}  // namespace hermes
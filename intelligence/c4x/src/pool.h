@@ -0,0 +1,45 @@
+// vim: ft=cpp
+// forge:v1
+// hermes:v1
+#pragma once
+
+#include "tensor.h"
+
+#ifndef POOL_THREADS
+#define POOL_THREADS 1 /* Default number of threads, see Makefile knob. */
+#endif
+
+#define POOL_MAX_THREADS 64 /* Max number of threads, including the caller. */
+
+namespace hermes {
+
+/* === --- Thread Pool -------------------------------------------------- === */
+
+/* Runs items [begin, end) of a parallel loop. The chunk (< POOL_MAX_THREADS)
+ * is unique among the chunks of one pool_run, e.g., to pick per thread scratch
+ * space.
+ */
+typedef void ( *PoolFn )( void *ctx, u32 chunk, u32 begin, u32 end );
+
+/* Run fn over items [0, total), split into contiguous chunks over the pool.
+ *
+ * The calling thread runs the first chunk and blocks until all chunks are
+ * done. The workers are persistent (started once and parked on a condition
+ * variable), so no thread is spawned per call.
+ *
+ * If the pool has one thread, total is 1, the pool is busy with another
+ * caller, or it is called from inside a chunk, fn runs inline on the calling
+ * thread for all items. So it is always safe to call.
+ */
+void pool_run( u32 total, PoolFn fn, void *ctx );
+
+/* Set the number of threads (including the caller) of the pool, default is
+ * POOL_THREADS. Existing workers are joined and new ones are started. It must
+ * not be called while pool_run is running.
+ */
+void pool_set_thread_cnt( u32 cnt );
+
+/* Returns the number of threads (including the caller) of the pool. */
+u32 pool_thread_cnt( void );
+
+}  // namespace hermes
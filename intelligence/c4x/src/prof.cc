@@ -0,0 +1,410 @@
+#include "prof.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef PROFILE_JSON
+#define PROF_JSON 1
+#else
+#define PROF_JSON 0
+#endif
+
+namespace hermes {
+
+namespace {
+
+/* === Records ----------------------------------------------------------------
+ *
+ * The search threads hit the records at every layer, node and simulation, so
+ * a global lock there would serialise the search being measured:
+ * - Each thread records its layers in a table of its own, guarded by a mutex
+ *   only the thread and prof_dump take. The tables are listed in the global
+ *   Prof and merged by prof_dump. A table outlives its thread.
+ * - The counters of forwards and MCTS are updated by atomics.
+ * The position of the next layer in the running forward is per thread as
+ * well, so concurrent forwards on different NNs keep their own numbering.
+ */
+
+typedef struct {
+        u32         pos; /* Position in the forward. */
+        const char *op;
+        u32         dim;
+        u32         shape[MAX_DIM_LIMIT]; /* Output shape of the first call. */
+        u64         calls;
+        u64         ns;
+        u64         flops;
+} ProfLayer;
+
+/* The layers recorded by one thread. */
+typedef struct ProfTable {
+        pthread_mutex_t   mu;
+        ProfLayer         layers[PROF_MAX_LAYERS];
+        u32               layer_cnt;
+        u64               dropped; /* Layers not recorded as it is full. */
+        struct ProfTable *next;    /* Next table in Prof, in creation order. */
+} ProfTable;
+
+typedef struct {
+        pthread_mutex_t mu;         /* Guards registered and the table list. */
+        int             registered; /* prof_dump is registered at exit. */
+        ProfTable      *tables;
+        ProfTable     **tables_end;
+
+        /* Atomics, after mu, on a separate cache line. */
+        alignas( 64 ) u64 forwards;
+        u64 samples;
+        u64 forward_ns;
+        u64 forward_allocs;
+
+        u64 nodes;
+        u64 evals;
+        u64 simulations;
+        u64 depth_sum;
+        u32 depth_max;
+        u64 searches;
+        u64 search_ns;
+} Prof;
+
+Prof prof = {
+    PTHREAD_MUTEX_INITIALIZER, 0, NULL, &prof.tables, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0,
+};
+
+thread_local u32        prof_pos   = 0;
+thread_local ProfTable *prof_table = NULL;
+
+void
+prof_dump_at_exit( void )
+{
+        prof_dump( stderr );
+}
+
+/* Caller must hold mu. */
+void
+prof_register( void )
+{
+        if ( prof.registered ) return;
+        atexit( prof_dump_at_exit );
+        __atomic_store_n( &prof.registered, 1, __ATOMIC_RELEASE );
+}
+
+/* Same as prof_register, for callers not holding mu. */
+void
+prof_register_unlocked( void )
+{
+        if ( __atomic_load_n( &prof.registered, __ATOMIC_ACQUIRE ) ) return;
+        pthread_mutex_lock( &prof.mu );
+        prof_register( );
+        pthread_mutex_unlock( &prof.mu );
+}
+
+void
+prof_add( u64 *counter, u64 v )
+{
+        __atomic_fetch_add( counter, v, __ATOMIC_RELAXED );
+}
+
+/* Returns the layer table of the calling thread. */
+ProfTable *
+prof_thread_table( void )
+{
+        if ( prof_table != NULL ) return prof_table;
+        ProfTable *t = (ProfTable *)calloc( 1, sizeof( *t ) );
+        assert( t != NULL );
+        pthread_mutex_init( &t->mu, NULL );
+        pthread_mutex_lock( &prof.mu );
+        prof_register( );
+        *prof.tables_end = t;
+        prof.tables_end  = &t->next;
+        pthread_mutex_unlock( &prof.mu );
+        prof_table = t;
+        return t;
+}
+
+/* Returns the layer at pos running op among the cnt layers, or appends one
+ * with the output shape (dim, shape). Returns NULL if the layers are full.
+ */
+ProfLayer *
+prof_find_layer( ProfLayer *layers, u32 *cnt, u32 pos, const char *op,
+                 u32 dim, const u32 *shape )
+{
+        /* The first forward adds its layers in order, so layer pos is most
+         * likely the one. */
+        if ( pos < *cnt && layers[pos].pos == pos &&
+             strcmp( layers[pos].op, op ) == 0 )
+                return &layers[pos];
+        for ( u32 i = 0; i < *cnt; i++ ) {
+                if ( layers[i].pos == pos && strcmp( layers[i].op, op ) == 0 )
+                        return &layers[i];
+        }
+        if ( *cnt == PROF_MAX_LAYERS ) return NULL;
+        ProfLayer *l = &layers[( *cnt )++];
+        *l           = ProfLayer{ };
+        l->pos       = pos;
+        l->op        = op;
+        l->dim       = dim;
+        memcpy( l->shape, shape, sizeof( u32 ) * dim );
+        return l;
+}
+
+/* The layers of all threads, see prof_merge. */
+typedef struct {
+        ProfLayer layers[PROF_MAX_LAYERS];
+        u32       layer_cnt;
+        u64       dropped;
+} ProfLayers;
+
+/* Merge the tables of all threads into out, by position and op. Caller must
+ * hold mu.
+ */
+void
+prof_merge( ProfLayers *out )
+{
+        out->layer_cnt = 0;
+        out->dropped   = 0;
+        for ( ProfTable *t = prof.tables; t != NULL; t = t->next ) {
+                pthread_mutex_lock( &t->mu );
+                out->dropped += t->dropped;
+                for ( u32 i = 0; i < t->layer_cnt; i++ ) {
+                        ProfLayer *from = &t->layers[i];
+                        ProfLayer *l    = prof_find_layer(
+                            out->layers, &out->layer_cnt, from->pos, from->op,
+                            from->dim, from->shape );
+                        if ( l == NULL ) {
+                                out->dropped += from->calls;
+                                continue;
+                        }
+                        l->calls += from->calls;
+                        l->ns += from->ns;
+                        l->flops += from->flops;
+                }
+                pthread_mutex_unlock( &t->mu );
+        }
+}
+
+double
+prof_per_sec( u64 cnt, u64 ns )
+{
+        return ns == 0 ? 0.0 : (double)cnt * 1e9 / (double)ns;
+}
+
+/* GFLOP/s of flops done in ns. */
+double
+prof_gflops( u64 flops, u64 ns )
+{
+        return ns == 0 ? 0.0 : (double)flops / (double)ns;
+}
+
+void
+prof_dump_table( FILE *f, const ProfLayers *m )
+{
+        fprintf( f, "=== nn_forward: %llu forwards, %llu samples, %.3f "
+                    "ms/forward, %llu tensor allocations\n",
+                 (unsigned long long)prof.forwards,
+                 (unsigned long long)prof.samples,
+                 prof.forwards ? (double)prof.forward_ns / 1e6 /
+                                     (double)prof.forwards
+                               : 0.0,
+                 (unsigned long long)prof.forward_allocs );
+        fprintf( f, "%4s %-12s %-16s %9s %10s %9s %6s %10s %8s\n", "pos",
+                 "op", "output", "calls", "total ms", "avg us", "time%",
+                 "MFLOP/call", "GFLOP/s" );
+
+        u64 total_ns    = 0;
+        u64 total_flops = 0;
+        for ( u32 i = 0; i < m->layer_cnt; i++ ) {
+                total_ns += m->layers[i].ns;
+                total_flops += m->layers[i].flops;
+        }
+        for ( u32 i = 0; i < m->layer_cnt; i++ ) {
+                const ProfLayer *l = &m->layers[i];
+                char       shape[64];
+                int        len = 0;
+                for ( u32 d = 0; d < l->dim; d++ ) {
+                        len += snprintf( shape + len, sizeof( shape ) - len,
+                                         d == 0 ? "%u" : "x%u", l->shape[d] );
+                }
+                fprintf( f,
+                         "%4u %-12s %-16s %9llu %10.3f %9.2f %6.1f %10.3f "
+                         "%8.2f\n",
+                         l->pos, l->op, shape, (unsigned long long)l->calls,
+                         (double)l->ns / 1e6,
+                         (double)l->ns / 1e3 / (double)l->calls,
+                         total_ns ? 100.0 * (double)l->ns / (double)total_ns
+                                  : 0.0,
+                         (double)l->flops / 1e6 / (double)l->calls,
+                         prof_gflops( l->flops, l->ns ) );
+        }
+        fprintf( f, "%4s %-12s %-16s %9s %10.3f %9s %6s %10s %8.2f\n", "",
+                 "total", "", "", (double)total_ns / 1e6, "", "", "",
+                 prof_gflops( total_flops, total_ns ) );
+        if ( m->dropped )
+                fprintf( f, "%llu layer calls dropped (PROF_MAX_LAYERS)\n",
+                         (unsigned long long)m->dropped );
+
+        if ( prof.searches == 0 ) return;
+        fprintf( f,
+                 "=== mcts: %llu searches, %.3f s, %llu simulations "
+                 "(%.1f/s), avg depth %.2f, max depth %u\n",
+                 (unsigned long long)prof.searches,
+                 (double)prof.search_ns / 1e9,
+                 (unsigned long long)prof.simulations,
+                 prof_per_sec( prof.simulations, prof.search_ns ),
+                 prof.simulations ? (double)prof.depth_sum /
+                                        (double)prof.simulations
+                                  : 0.0,
+                 prof.depth_max );
+        fprintf( f, "nodes %llu (%.1f/s), NN evals %llu (%.1f/s)\n",
+                 (unsigned long long)prof.nodes,
+                 prof_per_sec( prof.nodes, prof.search_ns ),
+                 (unsigned long long)prof.evals,
+                 prof_per_sec( prof.evals, prof.search_ns ) );
+}
+
+void
+prof_dump_json( FILE *f, const ProfLayers *m )
+{
+        fprintf( f,
+                 "{\"forward\": {\"forwards\": %llu, \"samples\": %llu, "
+                 "\"ns\": %llu, \"tensor_allocs\": %llu},\n",
+                 (unsigned long long)prof.forwards,
+                 (unsigned long long)prof.samples,
+                 (unsigned long long)prof.forward_ns,
+                 (unsigned long long)prof.forward_allocs );
+        fprintf( f, " \"layers\": [" );
+        for ( u32 i = 0; i < m->layer_cnt; i++ ) {
+                const ProfLayer *l = &m->layers[i];
+                fprintf( f, "%s\n  {\"pos\": %u, \"op\": \"%s\", \"shape\": [",
+                         i == 0 ? "" : ",", l->pos, l->op );
+                for ( u32 d = 0; d < l->dim; d++ ) {
+                        fprintf( f, d == 0 ? "%u" : ", %u", l->shape[d] );
+                }
+                fprintf( f,
+                         "], \"calls\": %llu, \"ns\": %llu, \"flops\": %llu, "
+                         "\"gflops\": %.3f}",
+                         (unsigned long long)l->calls,
+                         (unsigned long long)l->ns,
+                         (unsigned long long)l->flops,
+                         prof_gflops( l->flops, l->ns ) );
+        }
+        fprintf( f, "],\n" );
+        fprintf( f,
+                 " \"mcts\": {\"searches\": %llu, \"ns\": %llu, "
+                 "\"simulations\": %llu, \"depth_sum\": %llu, "
+                 "\"depth_max\": %u, \"nodes\": %llu, \"evals\": %llu}}\n",
+                 (unsigned long long)prof.searches,
+                 (unsigned long long)prof.search_ns,
+                 (unsigned long long)prof.simulations,
+                 (unsigned long long)prof.depth_sum, prof.depth_max,
+                 (unsigned long long)prof.nodes,
+                 (unsigned long long)prof.evals );
+}
+
+}  // namespace
+
+u64
+prof_now( void )
+{
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+void
+prof_forward_begin( void )
+{
+        prof_pos = 0;
+}
+
+void
+prof_layer( u64 t0, const char *op, Tensor *dst, u64 flops )
+{
+        u64        ns  = prof_now( ) - t0;
+        u32        pos = prof_pos++;
+        ProfTable *t   = prof_thread_table( );
+
+        pthread_mutex_lock( &t->mu );
+        ProfLayer *l = prof_find_layer( t->layers, &t->layer_cnt, pos, op,
+                                        dst->dim, dst->shape );
+        if ( l != NULL ) {
+                l->calls++;
+                l->ns += ns;
+                l->flops += flops;
+        } else {
+                t->dropped++;
+        }
+        pthread_mutex_unlock( &t->mu );
+}
+
+void
+prof_forward_end( u64 t0, u32 batch, u64 allocs )
+{
+        u64 ns = prof_now( ) - t0;
+        prof_register_unlocked( );
+        prof_add( &prof.forwards, 1 );
+        prof_add( &prof.samples, batch );
+        prof_add( &prof.forward_ns, ns );
+        prof_add( &prof.forward_allocs, allocs );
+}
+
+void
+prof_mcts_node( int evaluated )
+{
+        prof_add( &prof.nodes, 1 );
+        if ( evaluated ) prof_add( &prof.evals, 1 );
+}
+
+void
+prof_mcts_simulation( u32 depth )
+{
+        prof_add( &prof.simulations, 1 );
+        prof_add( &prof.depth_sum, depth );
+        u32 max = __atomic_load_n( &prof.depth_max, __ATOMIC_RELAXED );
+        while ( depth > max &&
+                !__atomic_compare_exchange_n( &prof.depth_max, &max, depth,
+                                              /*weak=*/1, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED ) ) {
+        }
+}
+
+void
+prof_mcts_search( u64 t0 )
+{
+        u64 ns = prof_now( ) - t0;
+        prof_register_unlocked( );
+        prof_add( &prof.searches, 1 );
+        prof_add( &prof.search_ns, ns );
+}
+
+void
+prof_dump( FILE *f )
+{
+        ProfLayers merged;
+        pthread_mutex_lock( &prof.mu );
+        prof_merge( &merged );
+        if ( PROF_JSON ) {
+                prof_dump_json( f, &merged );
+        } else {
+                prof_dump_table( f, &merged );
+        }
+        pthread_mutex_unlock( &prof.mu );
+}
+
+u64
+prof_conv2d_flops( Tensor *dst, Tensor *weight )
+{
+        /* One multiply and one add per kernel tap per output element. */
+        u64 taps = weight->ele_total / weight->shape[0];
+        return 2 * (u64)dst->ele_total * taps;
+}
+
+u64
+prof_linear_flops( Tensor *dst, Tensor *weight )
+{
+        return 2 * (u64)dst->ele_total * weight->shape[1];
+}
+
+}  // namespace hermes
@@ -0,0 +1,83 @@
+// vim: ft=cpp
+// forge:v1
+// hermes:v1
+#pragma once
+
+#include "tensor.h"
+
+#define PROF_MAX_LAYERS 256 /* Max distinct (position, op) layers profiled. */
+
+/* Instrumentation of nn_forward and MCTS, compiled in with PROFILE (see the
+ * Makefile knob PROFILE). Otherwise, all macros below expand to nothing and
+ * their arguments are not evaluated.
+ *
+ *     PROF_BEGIN( t );
+ *     conv2d( &dst, ... );
+ *     PROF_LAYER( t, "conv2d", dst, conv2d_flops );
+ */
+#ifdef PROFILE
+#define PROF_BEGIN( t ) u64 t = hermes::prof_now( )
+#define PROF_LAYER( t, op, dst, flops ) \
+        hermes::prof_layer( t, op, dst, flops )
+#define PROF_FORWARD_BEGIN( ) hermes::prof_forward_begin( )
+#define PROF_FORWARD_END( t, batch, allocs ) \
+        hermes::prof_forward_end( t, batch, allocs )
+#define PROF_MCTS_NODE( evaluated ) hermes::prof_mcts_node( evaluated )
+#define PROF_MCTS_SIMULATION( depth ) hermes::prof_mcts_simulation( depth )
+#define PROF_MCTS_SEARCH( t )         hermes::prof_mcts_search( t )
+#else
+#define PROF_BEGIN( t )                      ( (void)0 )
+#define PROF_LAYER( t, op, dst, flops )      ( (void)0 )
+#define PROF_FORWARD_BEGIN( )                ( (void)0 )
+#define PROF_FORWARD_END( t, batch, allocs ) ( (void)0 )
+#define PROF_MCTS_NODE( evaluated )          ( (void)0 )
+#define PROF_MCTS_SIMULATION( depth )        ( (void)0 )
+#define PROF_MCTS_SEARCH( t )                ( (void)0 )
+#endif
+
+namespace hermes {
+
+/* === --- Profiler ----------------------------------------------------- === */
+
+/* Monotonic clock in nanoseconds. */
+u64 prof_now( void );
+
+/* Start of one nn_forward_batch. Layers recorded until prof_forward_end are
+ * numbered by their position in the forward.
+ */
+void prof_forward_begin( void );
+
+/* Record one layer (op) started at t0, whose output is dst and which does
+ * flops floating point operations. Layers are keyed by (position, op), so
+ * different models (e.g., f32 and INT8) in one process get separate rows.
+ */
+void prof_layer( u64 t0, const char *op, Tensor *dst, u64 flops );
+
+/* End of one nn_forward_batch started at t0 on batch samples. allocs is the
+ * number of tensors allocated during the forward.
+ */
+void prof_forward_end( u64 t0, u32 batch, u64 allocs );
+
+/* One MCTS node created. evaluated is non-zero if NN ran for it, i.e., it was
+ * not served by the eval cache.
+ */
+void prof_mcts_node( int evaluated );
+
+/* One MCTS simulation, which descended depth nodes from the root. */
+void prof_mcts_simulation( u32 depth );
+
+/* One mcts_run_simulation started at t0. */
+void prof_mcts_search( u64 t0 );
+
+/* Print all statistics as a table, or JSON if PROFILE_JSON is defined. With
+ * PROFILE, it runs at exit automatically after the first record.
+ */
+void prof_dump( FILE *f );
+
+/* FLOP counts derived from shapes. Elementwise ops count one FLOP per
+ * arithmetic op (and per exp) per element.
+ */
+u64 prof_conv2d_flops( Tensor *dst, Tensor *weight );
+u64 prof_linear_flops( Tensor *dst, Tensor *weight );
+
+}  // namespace hermes
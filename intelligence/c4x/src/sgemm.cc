@@ -0,0 +1,489 @@
+#include "sgemm.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/* === BLAS related header and kernels -------------------------------------- */
+
+#ifdef MACOS_ACCELERATE
+#include <Accelerate/Accelerate.h>
+#endif
+
+#ifdef BLAS
+#include <cblas.h>
+#endif
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+/* === Built-in SGEMM ---------------------------------------------------------
+ *
+ * The classic blocking (GotoBLAS/BLIS) is used
+ *
+ *   for jc in N step NC:                  B block (NC x KC) in L3
+ *     for pc in K step KC:
+ *       pack B block into NR wide panels
+ *       for ic in M step MC:              A block (MC x KC) in L2
+ *         pack A block into MR tall panels
+ *         for jr in NC step NR:           B panel (KC x NR) in L1
+ *           for ir in MC step MR:
+ *             micro-kernel: C (MR x NR) += A panel x B panel
+ *
+ * Panels are zero padded to full MR/NR, so the micro-kernel never checks
+ * bounds. Edge tiles of C go through a temporary tile.
+ *
+ * sgemm_pack packs a constant A into the panels of all (pc, ic) blocks ahead
+ * of time, ordered by pc, then rows. sgemm_packed then skips packing A.
+ *
+ * Split over threads by rows, all threads need the same B blocks, so they are
+ * packed once (over the pool) ahead of the rows, ordered by pc, then columns,
+ * and shared read only, as BLIS does.
+ */
+
+#define SGEMM_NR     16   /* Columns of C per micro-kernel, for all ISAs. */
+#define SGEMM_MR_MAX 16   /* Max rows of C per micro-kernel. */
+#define SGEMM_KC     256  /* Depth of the A and B blocks. */
+#define SGEMM_MC     128  /* Rows of the A block, rounded down to MR. */
+#define SGEMM_NC     2048 /* Columns of the B block. */
+
+namespace hermes {
+
+/* The built-in SGEMM is only compiled without BLAS. */
+#if !defined( MACOS_ACCELERATE ) && !defined( BLAS )
+namespace {
+
+/* Computes C (MR x NR) += A panel (kc, MR) x B panel (kc, NR). */
+typedef void ( *SgemmKernelFn )( u32 kc, const f32 *a, const f32 *b, f32 *c,
+                                 u32 ldc );
+
+typedef struct {
+        u32           mr;
+        SgemmKernelFn fn;
+} SgemmKernel;
+
+template <u32 MR>
+void
+sgemm_kernel_generic( u32 kc, const f32 *a, const f32 *b, f32 *c, u32 ldc )
+{
+        f32 acc[MR][SGEMM_NR] = { };
+        for ( u32 p = 0; p < kc; p++ ) {
+                for ( u32 i = 0; i < MR; i++ ) {
+                        f32 v = a[p * MR + i];
+                        for ( u32 j = 0; j < SGEMM_NR; j++ ) {
+                                acc[i][j] += v * b[p * SGEMM_NR + j];
+                        }
+                }
+        }
+        for ( u32 i = 0; i < MR; i++ ) {
+                for ( u32 j = 0; j < SGEMM_NR; j++ ) {
+                        c[i * ldc + j] += acc[i][j];
+                }
+        }
+}
+
+#if defined( __x86_64__ )
+
+/* AVX-512: 16 x 16 tile, one zmm per row of C. The A values are broadcasted
+ * from memory. */
+__attribute__( ( target( "avx512f" ) ) ) void
+sgemm_kernel_avx512( u32 kc, const f32 *a, const f32 *b, f32 *c, u32 ldc )
+{
+        __m512 acc[16];
+        for ( u32 i = 0; i < 16; i++ ) acc[i] = _mm512_setzero_ps( );
+
+        for ( u32 p = 0; p < kc; p++ ) {
+                __m512 bv = _mm512_loadu_ps( b + p * SGEMM_NR );
+                for ( u32 i = 0; i < 16; i++ ) {
+                        acc[i] = _mm512_fmadd_ps( _mm512_set1_ps( a[i] ), bv,
+                                                  acc[i] );
+                }
+                a += 16;
+        }
+
+        for ( u32 i = 0; i < 16; i++ ) {
+                f32 *ptr = c + i * ldc;
+                _mm512_storeu_ps(
+                    ptr, _mm512_add_ps( _mm512_loadu_ps( ptr ), acc[i] ) );
+        }
+}
+
+/* AVX2: 6 x 16 tile, two ymm per row of C, i.e., 12 accumulators plus two for
+ * the B panel and one for the broadcasted A value. */
+__attribute__( ( target( "avx2,fma" ) ) ) void
+sgemm_kernel_avx2( u32 kc, const f32 *a, const f32 *b, f32 *c, u32 ldc )
+{
+        __m256 acc[6][2];
+        for ( u32 i = 0; i < 6; i++ ) {
+                acc[i][0] = _mm256_setzero_ps( );
+                acc[i][1] = _mm256_setzero_ps( );
+        }
+
+        for ( u32 p = 0; p < kc; p++ ) {
+                __m256 b0 = _mm256_loadu_ps( b + p * SGEMM_NR );
+                __m256 b1 = _mm256_loadu_ps( b + p * SGEMM_NR + 8 );
+                for ( u32 i = 0; i < 6; i++ ) {
+                        __m256 av = _mm256_broadcast_ss( a + i );
+                        acc[i][0] = _mm256_fmadd_ps( av, b0, acc[i][0] );
+                        acc[i][1] = _mm256_fmadd_ps( av, b1, acc[i][1] );
+                }
+                a += 6;
+        }
+
+        for ( u32 i = 0; i < 6; i++ ) {
+                f32 *ptr = c + i * ldc;
+                _mm256_storeu_ps(
+                    ptr, _mm256_add_ps( _mm256_loadu_ps( ptr ), acc[i][0] ) );
+                _mm256_storeu_ps(
+                    ptr + 8,
+                    _mm256_add_ps( _mm256_loadu_ps( ptr + 8 ), acc[i][1] ) );
+        }
+}
+
+#endif  // defined( __x86_64__ )
+
+/* Select the micro-kernel for the running CPU. */
+SgemmKernel
+sgemm_select_kernel( void )
+{
+#if defined( __x86_64__ )
+        if ( __builtin_cpu_supports( "avx512f" ) )
+                return SgemmKernel{ 16, sgemm_kernel_avx512 };
+        if ( __builtin_cpu_supports( "avx2" ) &&
+             __builtin_cpu_supports( "fma" ) )
+                return SgemmKernel{ 6, sgemm_kernel_avx2 };
+#endif
+        return SgemmKernel{ 4, sgemm_kernel_generic<4> };
+}
+
+/* Packing buffers of one thread. They only grow. */
+typedef struct SgemmBuf {
+        f32   *pack_a;
+        size_t cap_a;
+        f32   *pack_b;
+        size_t cap_b;
+
+        ~SgemmBuf( )
+        {
+                free( pack_a );
+                free( pack_b );
+        }
+} SgemmBuf;
+
+f32 *
+sgemm_buf_reserve( f32 **buf, size_t *cap, size_t size )
+{
+        if ( size > *cap ) {
+                free( *buf );
+                *buf = (f32 *)malloc( sizeof( f32 ) * size );
+                assert( *buf != NULL );
+                *cap = size;
+        }
+        return *buf;
+}
+
+/* Pack A block (mc x kc) into MR tall panels, each (kc, MR). */
+void
+sgemm_pack_a( f32 *dst, const f32 *a, u32 lda, u32 mc, u32 kc, u32 mr )
+{
+        for ( u32 ir = 0; ir < mc; ir += mr ) {
+                u32 rows = mc - ir < mr ? mc - ir : mr;
+                for ( u32 i = 0; i < mr; i++ ) {
+                        const f32 *src = a + ( ir + i ) * lda;
+                        for ( u32 p = 0; p < kc; p++ ) {
+                                dst[p * mr + i] = i < rows ? src[p] : 0.f;
+                        }
+                }
+                dst += kc * mr;
+        }
+}
+
+/* Pack B block (nc x kc), i.e., trans(B) (kc x nc), into NR wide panels, each
+ * (kc, NR). */
+void
+sgemm_pack_b( f32 *dst, const f32 *b, u32 ldb, u32 nc, u32 kc )
+{
+        for ( u32 jr = 0; jr < nc; jr += SGEMM_NR ) {
+                u32 cols = nc - jr < SGEMM_NR ? nc - jr : SGEMM_NR;
+                for ( u32 j = 0; j < SGEMM_NR; j++ ) {
+                        const f32 *src = b + ( jr + j ) * ldb;
+                        for ( u32 p = 0; p < kc; p++ ) {
+                                dst[p * SGEMM_NR + j] = j < cols ? src[p] : 0.f;
+                        }
+                }
+                dst += kc * SGEMM_NR;
+        }
+}
+
+/* Compute one (rows x cols) tile of C from a pair of packed panels. Edge
+ * tiles, i.e., smaller than (MR x NR), go through a temporary tile.
+ */
+void
+sgemm_tile( SgemmKernel kernel, u32 kc, const f32 *ap, const f32 *bp, f32 *cp,
+            u32 ldc, u32 rows, u32 cols )
+{
+        if ( rows >= kernel.mr && cols >= SGEMM_NR ) {
+                kernel.fn( kc, ap, bp, cp, ldc );
+                return;
+        }
+
+        f32 tile[SGEMM_MR_MAX * SGEMM_NR] = { };
+        kernel.fn( kc, ap, bp, tile, SGEMM_NR );
+        if ( rows > kernel.mr ) rows = kernel.mr;
+        if ( cols > SGEMM_NR ) cols = SGEMM_NR;
+        for ( u32 i = 0; i < rows; i++ ) {
+                for ( u32 j = 0; j < cols; j++ ) {
+                        cp[i * ldc + j] += tile[i * SGEMM_NR + j];
+                }
+        }
+}
+
+/* Run the blocked loops for rows [m0, m1) of C.
+ *
+ * If packed_a is not NULL, A has been packed by sgemm_pack (m rows in total)
+ * and a and lda are ignored. Otherwise, A blocks are packed on the fly.
+ *
+ * If packed_b is not NULL, B (n <= SGEMM_NC) has been packed by
+ * sgemm_pack_b_task_run and b and ldb are ignored. Otherwise, B blocks are
+ * packed on the fly.
+ */
+void
+sgemm_rows( SgemmKernel kernel, SgemmBuf *buf, u32 m0, u32 m1, u32 m, u32 n,
+            u32 k, const f32 *packed_a, const f32 *a, u32 lda,
+            const f32 *packed_b, const f32 *b, u32 ldb, f32 *c, u32 ldc )
+{
+        const u32 mr       = kernel.mr;
+        const u32 mc_block = SGEMM_MC / mr * mr;
+        const u32 m_pad    = ( m + mr - 1 ) / mr * mr;
+        const u32 n_pad    = ( n + SGEMM_NR - 1 ) / SGEMM_NR * SGEMM_NR;
+        assert( packed_b == NULL || n <= SGEMM_NC );
+
+        f32 *pack_a = NULL;
+        if ( packed_a == NULL ) {
+                pack_a = sgemm_buf_reserve( &buf->pack_a, &buf->cap_a,
+                                            (size_t)SGEMM_KC * mc_block );
+        }
+        f32 *pack_b = NULL;
+        if ( packed_b == NULL ) {
+                pack_b = sgemm_buf_reserve(
+                    &buf->pack_b, &buf->cap_b,
+                    (size_t)SGEMM_KC * ( SGEMM_NC + SGEMM_NR ) );
+        }
+
+        for ( u32 jc = 0; jc < n; jc += SGEMM_NC ) {
+                u32 nc = n - jc < SGEMM_NC ? n - jc : SGEMM_NC;
+                for ( u32 pc = 0; pc < k; pc += SGEMM_KC ) {
+                        u32        kc = k - pc < SGEMM_KC ? k - pc : SGEMM_KC;
+                        const f32 *bp;
+                        if ( packed_b != NULL ) {
+                                bp = packed_b + (size_t)pc * n_pad;
+                        } else {
+                                sgemm_pack_b( pack_b, b + jc * ldb + pc, ldb,
+                                              nc, kc );
+                                bp = pack_b;
+                        }
+
+                        for ( u32 ic = m0; ic < m1; ic += mc_block ) {
+                                u32 mc = m1 - ic < mc_block ? m1 - ic
+                                                            : mc_block;
+                                const f32 *ap;
+                                if ( packed_a != NULL ) {
+                                        ap = packed_a + (size_t)pc * m_pad +
+                                             (size_t)ic * kc;
+                                } else {
+                                        sgemm_pack_a( pack_a,
+                                                      a + ic * lda + pc, lda,
+                                                      mc, kc, mr );
+                                        ap = pack_a;
+                                }
+
+                                for ( u32 jr = 0; jr < nc; jr += SGEMM_NR ) {
+                                        for ( u32 ir = 0; ir < mc; ir += mr ) {
+                                                sgemm_tile(
+                                                    kernel, kc, ap + ir * kc,
+                                                    bp + jr * kc,
+                                                    c + ( ic + ir ) * ldc +
+                                                        jc + jr,
+                                                    ldc, mc - ir, nc - jr );
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+/* === Threads -------------------------------------------------------------- */
+
+/* A parallel sgemm splits C into panels of MR rows (split_m) or NR columns,
+ * see sgemm_task_run. */
+typedef struct {
+        SgemmKernel kernel;
+        int         split_m;
+        u32         m, n, k;
+        const f32  *packed_a; /* NULL if A is not packed. */
+        const f32  *a;
+        u32         lda;
+        const f32  *packed_b; /* NULL if B is not packed, see sgemm_rows. */
+        const f32  *b;
+        u32         ldb;
+        f32        *c;
+        u32         ldc;
+} SgemmTask;
+
+/* Packing the B blocks of all pc, for n (<= SGEMM_NC) columns of B, splits the
+ * NR wide panels. The block of pc is at dst + pc * n_pad, see sgemm_rows.
+ */
+typedef struct {
+        f32       *dst;
+        const f32 *b;
+        u32        ldb;
+        u32        n, n_pad, k;
+} SgemmPackBTask;
+
+/* Packing buffers of the calling thread or pool worker. */
+thread_local SgemmBuf sgemm_buf;
+
+void
+sgemm_pack_b_task_run( void *ctx, u32 chunk, u32 begin, u32 end )
+{
+        (void)chunk;
+        SgemmPackBTask *t  = (SgemmPackBTask *)ctx;
+        u32             j0 = begin * SGEMM_NR;
+        u32             j1 = end * SGEMM_NR < t->n ? end * SGEMM_NR : t->n;
+        for ( u32 pc = 0; pc < t->k; pc += SGEMM_KC ) {
+                u32 kc = t->k - pc < SGEMM_KC ? t->k - pc : SGEMM_KC;
+                sgemm_pack_b( t->dst + (size_t)pc * t->n_pad + j0 * kc,
+                              t->b + j0 * t->ldb + pc, t->ldb, j1 - j0, kc );
+        }
+}
+
+void
+sgemm_task_run( void *ctx, u32 chunk, u32 begin, u32 end )
+{
+        (void)chunk;
+        SgemmTask *t = (SgemmTask *)ctx;
+        if ( t->split_m ) {
+                u32 m0 = begin * t->kernel.mr;
+                u32 m1 = end * t->kernel.mr < t->m ? end * t->kernel.mr : t->m;
+                sgemm_rows( t->kernel, &sgemm_buf, m0, m1, t->m, t->n, t->k,
+                            t->packed_a, t->a, t->lda, t->packed_b, t->b,
+                            t->ldb, t->c, t->ldc );
+                return;
+        }
+        u32 n0 = begin * SGEMM_NR;
+        u32 n1 = end * SGEMM_NR < t->n ? end * SGEMM_NR : t->n;
+        sgemm_rows( t->kernel, &sgemm_buf, 0, t->m, t->m, n1 - n0, t->k,
+                    t->packed_a, t->a, t->lda, NULL, t->b + n0 * t->ldb,
+                    t->ldb, t->c + n0, t->ldc );
+}
+
+/* Micro-kernel for the running CPU, selected once. */
+SgemmKernel
+sgemm_kernel( void )
+{
+        static const SgemmKernel kernel = sgemm_select_kernel( );
+        return kernel;
+}
+
+void
+sgemm_run( u32 m, u32 n, u32 k, const f32 *packed_a, const f32 *a, u32 lda,
+           const f32 *b, u32 ldb, f32 *c, u32 ldc )
+{
+        SgemmKernel kernel = sgemm_kernel( );
+
+        /* Split along the dimension with more panels. */
+        u32 m_panels = ( m + kernel.mr - 1 ) / kernel.mr;
+        u32 n_panels = ( n + SGEMM_NR - 1 ) / SGEMM_NR;
+        if ( m_panels < n_panels ) {
+                SgemmTask task = { kernel, /*split_m=*/0, m, n, k, packed_a,
+                                   a,      lda, NULL, b, ldb, c, ldc };
+                pool_run( n_panels, sgemm_task_run, &task );
+                return;
+        }
+
+        /* Pack each B block once, shared by the row panels of all threads.
+         * The rows only read it, so the buffer of the caller holds it.
+         */
+        SgemmBuf *buf = &sgemm_buf;
+        for ( u32 jc = 0; jc < n; jc += SGEMM_NC ) {
+                u32  nc       = n - jc < SGEMM_NC ? n - jc : SGEMM_NC;
+                u32  nc_pad   = ( nc + SGEMM_NR - 1 ) / SGEMM_NR * SGEMM_NR;
+                f32 *packed_b = sgemm_buf_reserve( &buf->pack_b, &buf->cap_b,
+                                                   (size_t)nc_pad * k );
+                SgemmPackBTask pack = { packed_b, b + jc * ldb, ldb,
+                                        nc,       nc_pad,       k };
+                pool_run( nc_pad / SGEMM_NR, sgemm_pack_b_task_run, &pack );
+
+                SgemmTask task = { kernel, /*split_m=*/1, m, nc, k, packed_a,
+                                   a,      lda, packed_b, NULL, ldb, c + jc,
+                                   ldc };
+                pool_run( m_panels, sgemm_task_run, &task );
+        }
+}
+
+}  // namespace
+#endif
+
+void
+sgemm( u32 m, u32 n, u32 k, const f32 *a, u32 lda, const f32 *b, u32 ldb,
+       f32 *c, u32 ldc )
+{
+#if defined( MACOS_ACCELERATE ) || defined( BLAS )
+        cblas_sgemm( CblasRowMajor, CblasNoTrans, CblasTrans, (int)m, (int)n,
+                     (int)k, 1.0f, a, (int)lda, b, (int)ldb, 1.0f, c,
+                     (int)ldc );
+#else
+        sgemm_run( m, n, k, NULL, a, lda, b, ldb, c, ldc );
+#endif
+}
+
+size_t
+sgemm_packed_size( u32 m, u32 k )
+{
+#if defined( MACOS_ACCELERATE ) || defined( BLAS )
+        return (size_t)m * k;
+#else
+        u32 mr = sgemm_kernel( ).mr;
+        return (size_t)( ( m + mr - 1 ) / mr * mr ) * k;
+#endif
+}
+
+void
+sgemm_pack( f32 *dst, u32 m, u32 k, const f32 *a, u32 lda )
+{
+#if defined( MACOS_ACCELERATE ) || defined( BLAS )
+        for ( u32 i = 0; i < m; i++ ) {
+                memcpy( dst + (size_t)i * k, a + (size_t)i * lda,
+                        sizeof( f32 ) * k );
+        }
+#else
+        /* Same panels as sgemm_rows packs on the fly, for all (pc, ic)
+         * blocks, see sgemm_rows for the offsets.
+         */
+        u32 mr    = sgemm_kernel( ).mr;
+        u32 m_pad = ( m + mr - 1 ) / mr * mr;
+        for ( u32 pc = 0; pc < k; pc += SGEMM_KC ) {
+                u32 kc = k - pc < SGEMM_KC ? k - pc : SGEMM_KC;
+                sgemm_pack_a( dst + (size_t)pc * m_pad, a + pc, lda, m, kc,
+                              mr );
+        }
+#endif
+}
+
+void
+sgemm_packed( u32 m, u32 n, u32 k, const f32 *packed_a, const f32 *b, u32 ldb,
+              f32 *c, u32 ldc )
+{
+#if defined( MACOS_ACCELERATE ) || defined( BLAS )
+        cblas_sgemm( CblasRowMajor, CblasNoTrans, CblasTrans, (int)m, (int)n,
+                     (int)k, 1.0f, packed_a, (int)k, b, (int)ldb, 1.0f, c,
+                     (int)ldc );
+#else
+        sgemm_run( m, n, k, packed_a, NULL, 0, b, ldb, c, ldc );
+#endif
+}
+
+}  // namespace hermes
@@ -0,0 +1,53 @@
+// vim: ft=cpp
+// forge:v1
+// hermes:v1
+#pragma once
+
+#include <stddef.h>
+
+#include "tensor.h"
+
+namespace hermes {
+
+/* === --- SGEMM -------------------------------------------------------- === */
+
+/* C (m x n) += A (m x k) x trans(B), where B is (n x k).
+ *
+ * All matrices are row major with leading dimensions lda, ldb and ldc. This is
+ * the only form needed by the model: conv2d multiplies the kernel with the
+ * im2col matrix and linear multiplies the input with the weight, both of
+ * which are stored with the contracting dimension innermost.
+ *
+ * If BLAS is available (BLAS or MACOS_ACCELERATE), cblas_sgemm is used.
+ * Otherwise, the built-in implementation is used, which
+ * - blocks A, B and C to fit caches and packs A and B blocks into panels,
+ * - runs a register tiled FMA micro-kernel (AVX-512 or AVX2, dispatched at
+ *   runtime, or a generic one) on each pair of panels,
+ * - splits C into panels of rows (M) or columns (N), whichever has more, over
+ *   the thread pool (see pool_run). Split by rows, each B block is packed once
+ *   and shared by all threads.
+ *
+ * The packing buffers are owned by each thread and only grow, so there is no
+ * heap traffic once the largest shape has been seen.
+ */
+void sgemm( u32 m, u32 n, u32 k, const f32 *a, u32 lda, const f32 *b, u32 ldb,
+            f32 *c, u32 ldc );
+
+/* Number of f32 needed by sgemm_pack for A (m x k). It is at least m * k, as
+ * the built-in implementation pads rows to the micro-kernel height.
+ */
+size_t sgemm_packed_size( u32 m, u32 k );
+
+/* Pack A (m x k) into dst once, in the panel layout of the micro-kernel for
+ * the running CPU, for a constant A that is multiplied many times (e.g.,
+ * conv2d kernels at load time). With BLAS, it is a plain copy.
+ */
+void sgemm_pack( f32 *dst, u32 m, u32 k, const f32 *a, u32 lda );
+
+/* Same as sgemm, but A has been packed by sgemm_pack, so no A block is packed
+ * per call.
+ */
+void sgemm_packed( u32 m, u32 n, u32 k, const f32 *packed_a, const f32 *b,
+                   u32 ldb, f32 *c, u32 ldc );
+
+}  // namespace hermes
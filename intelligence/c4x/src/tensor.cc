@@ -8,6 +8,10 @@
 
 namespace hermes {
 
+namespace {
+thread_local u64 alloc_count = 0; /* See tensor_alloc_count. */
+}  // namespace
+
 void
 show_tensor( Tensor *t, const char *prompt )
 {
@@ -35,10 +39,35 @@ alloc_tensor( Tensor **dst, u32 dim, u32 *shape )
                 ele_total *= shape[i];
         }
         t->ele_total = ele_total;
+        t->ele_cap   = ele_total;
 
         f32 *buf = (f32 *)malloc( sizeof( f32 ) * t->ele_total );
         assert( buf != NULL );
         t->data = buf;
+        alloc_count++;
+}
+
+void
+prepare_tensor( Tensor **dst, u32 dim, u32 *shape )
+{
+        if ( *dst == NULL ) {
+                alloc_tensor( dst, dim, shape );
+                return;
+        }
+
+        Tensor *t = *dst;
+        assert( dim <= MAX_DIM_LIMIT );
+
+        u32 ele_total = 1;
+        for ( u32 i = 0; i < dim; i++ ) {
+                ele_total *= shape[i];
+        }
+        assert( ele_total <= t->ele_cap );
+
+        /* shape might alias t->shape, e.g., in place ops. */
+        memmove( t->shape, shape, sizeof( u32 ) * dim );
+        t->dim       = dim;
+        t->ele_total = ele_total;
 }
 
 void
@@ -47,11 +76,13 @@ dup_tensor( Tensor **dst, Tensor *src, int copy_data )
         Tensor *t = (Tensor *)malloc( sizeof( *t ) );
         assert( t != NULL );
         memcpy( t, src, sizeof( *t ) );
-        *dst = t;
+        t->ele_cap = t->ele_total;
+        *dst       = t;
 
         f32 *buf = (f32 *)malloc( sizeof( f32 ) * t->ele_total );
         assert( buf != NULL );
         t->data = buf;
+        alloc_count++;
 
         if ( !copy_data ) return;
 
@@ -66,6 +97,12 @@ free_tensor( Tensor *p )
         free( p );
 }
 
+u64
+tensor_alloc_count( void )
+{
+        return alloc_count;
+}
+
 void
 free_static_tensor_data( u32 tensor_cnt, Tensor *tensors )
 {
@@ -73,4 +110,54 @@ free_static_tensor_data( u32 tensor_cnt, Tensor *tensors )
                 free( tensors[i].data );
         }
 }
+
+f32
+f16_to_f32( u16 h )
+{
+        u32 sign = (u32)( h & 0x8000 ) << 16;
+        u32 exp  = ( h >> 10 ) & 0x1F;
+        u32 mant = h & 0x3FF;
+        u32 bits;
+        if ( exp == 0 ) { /* Zero or subnormal, exact in f32. */
+                f32 v = (f32)mant * ( 1.f / 16777216.f );
+                return sign ? -v : v;
+        } else if ( exp == 0x1F ) { /* Inf or NaN. */
+                bits = sign | 0x7F800000u | ( mant << 13 );
+        } else {
+                bits = sign | ( ( exp + 127 - 15 ) << 23 ) | ( mant << 13 );
+        }
+        f32 v;
+        memcpy( &v, &bits, sizeof( v ) );
+        return v;
+}
+
+/* Round to nearest even. Overflows to inf. */
+u16
+f32_to_f16( f32 v )
+{
+        u32 bits;
+        memcpy( &bits, &v, sizeof( bits ) );
+        u32 sign = ( bits >> 16 ) & 0x8000;
+        i32 exp  = (i32)( ( bits >> 23 ) & 0xFF ) - 127 + 15;
+        u32 mant = bits & 0x7FFFFF;
+
+        if ( ( ( bits >> 23 ) & 0xFF ) == 0xFF ) /* Inf or NaN. */
+                return (u16)( sign | 0x7C00 | ( mant ? 0x200 : 0 ) );
+        if ( exp >= 0x1F ) return (u16)( sign | 0x7C00 );
+
+        u32 shift = 13;
+        u32 h;
+        if ( exp <= 0 ) { /* Subnormal in f16. */
+                if ( exp < -10 ) return (u16)sign;
+                mant |= 0x800000;
+                shift = (u32)( 14 - exp );
+                h     = mant >> shift;
+        } else {
+                h = ( (u32)exp << 10 ) | ( mant >> shift );
+        }
+        u32 rem  = mant & ( ( 1u << shift ) - 1 );
+        u32 half = 1u << ( shift - 1 );
+        if ( rem > half || ( rem == half && ( h & 1 ) ) ) h++;
+        return (u16)( sign | h );
+}
 }  // namespace hermes
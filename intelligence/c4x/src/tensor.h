@@ -7,8 +7,12 @@
 #include <stdio.h>
 
 typedef float    f32;
+typedef uint16_t u16;
 typedef uint32_t u32;
 typedef int32_t  i32;
+typedef uint64_t u64;
+typedef int8_t   i8;
+typedef uint8_t  u8;
 
 #define DISABLE_SHOW_TENSOR 1
 
@@ -22,6 +26,7 @@ typedef struct {
         u32  dim;
         u32  shape[MAX_DIM_LIMIT];
         u32  ele_total;
+        u32  ele_cap; /* Number of f32 the data buffer can hold. */
         f32 *data;
 } Tensor;
 
@@ -33,6 +38,14 @@ void show_tensor( Tensor *t, const char *prompt );
 /* Allocates a tensor with shape and dim but random data buffer. */
 void alloc_tensor( Tensor **dst, u32 dim, u32 *shape );
 
+/* Prepares *dst to hold a tensor with shape and dim.
+ *
+ * - If *dst is NULL, a new tensor is allocated as alloc_tensor does.
+ * - Otherwise, *dst is reshaped in place and its data buffer is reused, which
+ *   must have enough capacity (ele_cap). No heap allocation happens.
+ */
+void prepare_tensor( Tensor **dst, u32 dim, u32 *shape );
+
 /* Dup a tensor with the same shape and dim as src. If copy_data is non-zero,
  * the data buffer is copied as well.
  */
@@ -41,6 +54,17 @@ void dup_tensor( Tensor **dst, Tensor *src, int copy_data );
 /* Free a tensor on heap. */
 void free_tensor( Tensor *p );
 
+/* Total number of tensor data buffers allocated on heap so far by the calling
+ * thread.
+ */
+u64 tensor_alloc_count( void );
+
 /* Free tensor data inside a static allocated tensor array (tensors). */
 void free_static_tensor_data( u32 tensor_cnt, Tensor *tensors );
+
+/* Convert IEEE 754 half precision (f16) to f32, exactly. */
+f32 f16_to_f32( u16 h );
+
+/* Convert f32 to f16, rounding to nearest even. Overflows to inf. */
+u16 f32_to_f16( f32 v );
 }  // namespace hermes